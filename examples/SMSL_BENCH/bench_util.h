@@ -0,0 +1,65 @@
+// Timing shared by the parts of smsl_bench.
+// skiplist.h and smsl.h cannot be included together, so each list is timed in its own file.
+
+#ifndef _SMSL_BENCH_UTIL_H_
+#define _SMSL_BENCH_UTIL_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <time.h>
+
+namespace bench {
+
+inline int cmp(const int& lhs, const int& rhs) {
+    return (lhs < rhs) ? -1 : (lhs > rhs);
+}
+
+inline std::string tostr(const int& val) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%d", val);
+    return buffer;
+}
+
+inline double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Set then get every key, print the nanoseconds per operation.
+// Return 0 means every key was found.
+template <typename List>
+int set_get(const std::string& name, List& list, const std::vector<int>& keys) {
+    double start = now_seconds();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        list.set(keys[i], keys[i]);
+    }
+    double set_seconds = now_seconds() - start;
+    long sum = 0;
+    int val = 0;
+    int missing = 0;
+    start = now_seconds();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (list.get(keys[i], val) < 0) {
+            ++missing;
+        }
+        sum += val;
+    }
+    double get_seconds = now_seconds() - start;
+    printf("%-12s set %6.0f ns/op, get %6.0f ns/op (checksum %ld)\n", name.c_str(),
+        set_seconds / keys.size() * 1e9, get_seconds / keys.size() * 1e9, sum);
+    if (missing != 0) {
+        std::cout << name << ": " << missing << " keys are missing.\n";
+        return -1;
+    }
+    return 0;
+}
+
+// Defined in heap_bench.cpp.
+int bench_skiplist(const std::vector<int>& keys);
+
+} // End namespace bench.
+
+#endif
@@ -0,0 +1,13 @@
+// The heap SkipList part of smsl_bench.
+
+#include "bench_util.h"
+#include "../../include/skiplist.hpp"
+
+namespace bench {
+
+int bench_skiplist(const std::vector<int>& keys) {
+    skiplist::SkipList<int, int> list(cmp, tostr);
+    return set_get("SkipList", list, keys);
+}
+
+} // End namespace bench.
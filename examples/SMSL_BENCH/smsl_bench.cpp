@@ -0,0 +1,62 @@
+// Set and get latency of Smsl against the heap SkipList.
+// The keys are the integers [0, ENTRIES) in a random order, set once and then got once.
+// Usage: ./smsl_bench [ENTRIES] [sysv|shm|file|memfd]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bench_util.h"
+#include "../../include/smsl.hpp"
+
+using namespace std;
+
+namespace {
+
+const char DATA_DIR[] = "./bench_data";
+const char SMSL_PATH[] = "./bench_data/smsl";
+
+} // End anonymous namespace.
+
+int main(int argc, char **argv) {
+    int entries = (argc > 1) ? atoi(argv[1]) : 1000000;
+    string backend_name = (argc > 2) ? argv[2] : "sysv";
+    smsl::SmslBackend backend = smsl::SMSL_SYSV;
+    if (backend_name == "shm") {
+        backend = smsl::SMSL_SHM;
+    } else if (backend_name == "file") {
+        backend = smsl::SMSL_FILE;
+    } else if (backend_name == "memfd") {
+        backend = smsl::SMSL_MEMFD;
+    } else if (backend_name != "sysv") {
+        entries = 0;
+    }
+    if (entries <= 0) {
+        cout << "Usage: " << argv[0] << " [ENTRIES] [sysv|shm|file|memfd]\n";
+        return -1;
+    }
+    mkdir(DATA_DIR, 0755);
+    // ftok of SMSL_SYSV needs an existing file.
+    close(open(SMSL_PATH, O_RDWR | O_CREAT, 0666));
+
+    vector<int> keys(entries);
+    for (int i = 0; i < entries; ++i) {
+        keys[i] = i;
+    }
+    unsigned int seed = 1;
+    for (int i = entries - 1; i > 0; --i) {
+        swap(keys[i], keys[rand_r(&seed) % (i + 1)]);
+    }
+    cout << "Entries: " << entries << ", backend: " << backend_name << ".\n";
+
+    int ret = bench::bench_skiplist(keys);
+    {
+        smsl::Smsl<int, int> list(SMSL_PATH, bench::cmp, bench::tostr, false, DEFAULT_LEVEL, backend);
+        list.set_quit_strategy(true);
+        ret |= bench::set_get("Smsl", list, keys);
+    }
+    return ret;
+}
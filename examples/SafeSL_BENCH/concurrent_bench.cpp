@@ -0,0 +1,226 @@
+// Multithreaded durability benchmark of SafeSL.
+// Readers call safe_get while writers call safe_set, all writes are logged with the sync policy.
+// With more than one shard, the keys are spread over SafeSLs with their own logs,
+// so the writers of different shards don't wait for each other.
+// The workload runs in a child process, which is killed mid-run like a crash.
+// Then every shard is restored from its log and each acknowledged key is checked,
+// only SYNC_PER_OP promises that none is lost, the other policies may lose the unsynced tail.
+// Usage: ./safesl_bench [READERS] [WRITERS] [SHARDS] [SECONDS] [none|interval|records|perop]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../../include/safesl.hpp"
+
+using namespace skiplist;
+using namespace std;
+
+namespace {
+
+typedef SafeSL<int, string> Shard;
+
+int cmp(const int& lhs, const int& rhs) {
+    return (lhs < rhs) ? -1 : (lhs > rhs);
+}
+
+string tostr(const int& val) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%d", val);
+    return buffer;
+}
+
+void inttobin(const int& val, Binary& bin) {
+    bin.set_data(sizeof(int), &val);
+}
+
+void bintoint(int& val, const Binary& bin) {
+    memcpy(&val, bin.data, sizeof(int));
+}
+
+void strtobin(const string& str, Binary& bin) {
+    bin.set_data(str.size() + 1, str.c_str(), TAG_COPY); // The last "\0" is included.
+}
+
+void bintostr(string& str, const Binary& bin) {
+    str = reinterpret_cast<const char*>(bin.data);
+}
+
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct BenchContext {
+    vector<Shard*> shards;
+    int writers;
+};
+
+// Shared with the parent, which reads the counters after killing the child.
+struct WorkerArg {
+    BenchContext* context;
+    int id;
+    volatile long ops; // Operations done, for a writer the acknowledged writes.
+    volatile long failed;
+};
+
+// Writer ID writes the keys ID, ID + WRITERS, ..., so the acknowledged keys are a prefix of them.
+// Workers run until the process is killed.
+void* writer_main(void* param) {
+    WorkerArg* arg = static_cast<WorkerArg*>(param);
+    BenchContext* context = arg->context;
+    for (int key = arg->id; ; key += context->writers) {
+        Shard* shard = context->shards[key % context->shards.size()];
+        if (shard->safe_set(key, tostr(key)) != 0) {
+            ++arg->failed;
+            break;
+        }
+        ++arg->ops;
+    }
+    return nullptr;
+}
+
+void* reader_main(void* param) {
+    WorkerArg* arg = static_cast<WorkerArg*>(param);
+    BenchContext* context = arg->context;
+    unsigned int seed = arg->id;
+    string val;
+    while (true) {
+        int key = rand_r(&seed) % 1000000;
+        Shard* shard = context->shards[key % context->shards.size()];
+        if (shard->safe_get(key, val) >= 0 && val != tostr(key)) {
+            ++arg->failed;
+        }
+        ++arg->ops;
+    }
+    return nullptr;
+}
+
+// Run the workers in this process until it's killed.
+void run_workload(WorkerArg* args, int readers, int writers,
+    const vector<string>& log_paths, SyncPolicy policy, long param) {
+    BenchContext context;
+    context.writers = writers;
+    for (size_t i = 0; i < log_paths.size(); ++i) {
+        context.shards.push_back(new Shard(cmp, tostr, inttobin, strtobin, bintoint, bintostr, log_paths[i]));
+        context.shards[i]->set_sync_policy(policy, param);
+    }
+    vector<pthread_t> threads(readers + writers);
+    for (int i = 0; i < readers + writers; ++i) {
+        args[i].context = &context;
+        args[i].id = (i < writers) ? i : i - writers;
+        pthread_create(&threads[i], nullptr, (i < writers) ? writer_main : reader_main, &args[i]);
+    }
+    // Never reach the destructors, wait to be killed.
+    while (true) {
+        pause();
+    }
+}
+
+} // End anonoymous namespace.
+
+int main(int argc, char **argv) {
+    int readers = (argc > 1) ? atoi(argv[1]) : 4;
+    int writers = (argc > 2) ? atoi(argv[2]) : 2;
+    int shard_num = (argc > 3) ? atoi(argv[3]) : 1;
+    double seconds = (argc > 4) ? atof(argv[4]) : 5;
+    string policy_name = (argc > 5) ? argv[5] : "interval";
+    if (readers < 0 || writers <= 0 || shard_num <= 0 || seconds <= 0) {
+        cout << "Usage: " << argv[0] << " [READERS] [WRITERS] [SHARDS] [SECONDS] [none|interval|records|perop]\n";
+        return -1;
+    }
+    SyncPolicy policy = SYNC_INTERVAL;
+    long param = 10;
+    if (policy_name == "none") {
+        policy = SYNC_NONE;
+    } else if (policy_name == "records") {
+        policy = SYNC_RECORDS;
+        param = 64;
+    } else if (policy_name == "perop") {
+        policy = SYNC_PER_OP;
+    }
+
+    // Start from empty logs.
+    mkdir("./bench_data", 0755);
+    vector<string> log_paths;
+    for (int i = 0; i < shard_num; ++i) {
+        log_paths.push_back("./bench_data/shard" + tostr(i));
+        if (system(("rm -f " + log_paths[i] + "*").c_str()) != 0) {
+            cout << "Cannot clean the former logs.\n";
+            return -1;
+        }
+    }
+
+    size_t args_bytes = sizeof(WorkerArg) * (readers + writers);
+    WorkerArg* args = static_cast<WorkerArg*>(mmap(nullptr, args_bytes,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (args == MAP_FAILED) {
+        cout << "Cannot map the shared counters.\n";
+        return -1;
+    }
+    double begin = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_workload(args, readers, writers, log_paths, policy, param);
+    }
+    if (pid == -1) {
+        cout << "Cannot fork the workload.\n";
+        return -1;
+    }
+    usleep(static_cast<useconds_t>(seconds * 1e6));
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    double elapsed = now_seconds() - begin;
+
+    long writes = 0;
+    long reads = 0;
+    long failed = 0;
+    for (int i = 0; i < readers + writers; ++i) {
+        ((i < writers) ? writes : reads) += args[i].ops;
+        failed += args[i].failed;
+    }
+    cout << "Policy: " << policy_name << ", readers: " << readers << ", writers: " << writers
+        << ", shards: " << shard_num << ", seconds: " << elapsed << ".\n";
+    cout << "Writes: " << writes << ", " << static_cast<long>(writes / elapsed) << " ops/s.\n";
+    cout << "Reads: " << reads << ", " << static_cast<long>(reads / elapsed) << " ops/s.\n";
+    
+    // Every acknowledged write must be restored.
+    vector<Shard*> restored;
+    for (int i = 0; i < shard_num; ++i) {
+        restored.push_back(new Shard(cmp, tostr, inttobin, strtobin, bintoint, bintostr, log_paths[i]));
+        if (restored[i]->restore(log_paths[i]) != 0) {
+            ++failed;
+        }
+    }
+    long lost = 0;
+    string val;
+    for (int w = 0; w < writers; ++w) {
+        for (long i = 0; i < args[w].ops; ++i) {
+            int key = w + i * writers;
+            if (restored[key % shard_num]->safe_get(key, val) < 0 || val != tostr(key)) {
+                ++lost;
+            }
+        }
+    }
+    for (int i = 0; i < shard_num; ++i) {
+        delete restored[i];
+    }
+    munmap(args, args_bytes);
+    cout << "Killed and restored, lost writes: " << lost << ", failed operations: " << failed << ".\n";
+    if (policy != SYNC_PER_OP) {
+        // The writes not synced yet die with the process.
+        cout << "The policy is " << policy_name << ", the lost writes are not counted as failures.\n";
+        lost = 0;
+    }
+    return (lost == 0 && failed == 0) ? 0 : -1;
+}
@@ -0,0 +1,272 @@
+// Durability and recovery benchmark of SafeSL.
+//  sync:    safe_set throughput under each sync policy.
+//  dump:    dump_to_file and parse_from_file MB/s, and the dump bytes per entry.
+//  restore: restore time against the log length.
+//  crash:   a child process writes with SYNC_PER_OP and is killed mid-stream,
+//           then the log is restored, timed and every acknowledged write is checked.
+// Usage: ./durability_bench [all|sync|dump|restore|crash] [ENTRIES] [VALUE_BYTES]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../../include/safesl.hpp"
+
+using namespace skiplist;
+using namespace std;
+
+namespace {
+
+typedef SafeSL<int, string> Bench;
+
+const char DATA_DIR[] = "./bench_data";
+const int CRASH_ROUNDS = 5;
+
+int cmp(const int& lhs, const int& rhs) {
+    return (lhs < rhs) ? -1 : (lhs > rhs);
+}
+
+string tostr(const int& val) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%d", val);
+    return buffer;
+}
+
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The value of a key, its head tells the key so a misplaced value is caught.
+// The rest is pseudo random, so the compressed dump isn't unrealistically small.
+string make_val(int key, size_t bytes) {
+    string val = tostr(key) + ":";
+    unsigned int seed = key;
+    while (val.size() < bytes) {
+        seed = seed * 1103515245 + 12345;
+        val.push_back('a' + (seed >> 16) % 26);
+    }
+    return val;
+}
+
+size_t file_bytes(const string& path) {
+    struct stat info;
+    return (stat(path.c_str(), &info) == 0) ? info.st_size : 0;
+}
+
+// Bytes of all log segments listed by the manifest.
+size_t log_bytes(const string& log_path) {
+    unsigned long long first = 0;
+    unsigned long long last = 0;
+    if (LogWriter::read_manifest(log_path, first, last) != 0) {
+        return 0;
+    }
+    size_t bytes = 0;
+    for (unsigned long long i = first; i <= last; ++i) {
+        bytes += file_bytes(LogWriter::segment_path(log_path, i));
+    }
+    return bytes;
+}
+
+void remove_files(const string& prefix) {
+    if (system(("rm -f " + prefix + "*").c_str()) != 0) {
+        cout << "Cannot remove the files: " << prefix << "*.\n";
+    }
+}
+
+double megabytes(size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+// Write keys [0, entries) and return the seconds.
+double fill(Bench& sl, int entries, size_t val_bytes) {
+    double begin = now_seconds();
+    for (int key = 0; key < entries; ++key) {
+        sl.safe_set(key, make_val(key, val_bytes));
+    }
+    return now_seconds() - begin;
+}
+
+// Count the keys restored with the right value, stop at the first missing one.
+int restored_prefix(Bench& sl, int entries, size_t val_bytes) {
+    string val;
+    int key = 0;
+    while (key < entries && sl.safe_get(key, val) >= 0 && val == make_val(key, val_bytes)) {
+        ++key;
+    }
+    return key;
+}
+
+void bench_sync(int entries, size_t val_bytes) {
+    cout << "== safe_set under each sync policy ==\n";
+    const char* names[] = {"SYNC_NONE", "SYNC_INTERVAL 10ms", "SYNC_RECORDS 64", "SYNC_PER_OP"};
+    SyncPolicy policies[] = {SYNC_NONE, SYNC_INTERVAL, SYNC_RECORDS, SYNC_PER_OP};
+    long params[] = {0, 10, 64, 0};
+    for (int i = 0; i < 4; ++i) {
+        string log_path = string(DATA_DIR) + "/sync_log";
+        remove_files(log_path);
+        // Each fdatasync takes milliseconds, a tenth of the entries is enough.
+        int num = (policies[i] == SYNC_PER_OP) ? (entries + 9) / 10 : entries;
+        double seconds = 0;
+        {
+            Bench sl(cmp, tostr, log_path);
+            sl.set_sync_policy(policies[i], params[i]);
+            seconds = fill(sl, num, val_bytes);
+        }
+        cout << names[i] << ": " << num << " ops, " << static_cast<long>(num / seconds) << " ops/s, "
+            << seconds * 1e6 / num << " us/op, log " << megabytes(log_bytes(log_path)) << " MB.\n";
+        remove_files(log_path);
+    }
+}
+
+void bench_dump(int entries, size_t val_bytes) {
+    cout << "== dump_to_file and parse_from_file ==\n";
+    string log_path = string(DATA_DIR) + "/dump_log";
+    string dump_path = string(DATA_DIR) + "/dump.data";
+    remove_files(log_path);
+    remove_files(dump_path);
+    size_t bytes = 0;
+    {
+        Bench sl(cmp, tostr, log_path);
+        fill(sl, entries, val_bytes);
+        double begin = now_seconds();
+        if (sl.dump_to_file(dump_path) != 0) {
+            cout << "Dump failed.\n";
+            return;
+        }
+        double seconds = now_seconds() - begin;
+        bytes = file_bytes(dump_path);
+        cout << "dump_to_file: " << megabytes(bytes) << " MB, " << seconds << " s, "
+            << megabytes(bytes) / seconds << " MB/s, " << bytes / entries << " bytes/entry.\n";
+    }
+    {
+        Bench sl(cmp, tostr, log_path + "_parse");
+        double begin = now_seconds();
+        int ret = sl.parse_from_file(dump_path);
+        double seconds = now_seconds() - begin;
+        cout << "parse_from_file: " << seconds << " s, " << megabytes(bytes) / seconds << " MB/s, "
+            << ((ret == 0 && restored_prefix(sl, entries, val_bytes) == entries) ? "all" : "NOT all")
+            << " entries restored.\n";
+    }
+    remove_files(log_path);
+    remove_files(dump_path);
+}
+
+void bench_restore(int entries, size_t val_bytes) {
+    cout << "== restore against the log length ==\n";
+    string log_path = string(DATA_DIR) + "/restore_log";
+    for (int num = entries / 4; num <= entries; num *= 2) {
+        remove_files(log_path);
+        {
+            Bench sl(cmp, tostr, log_path);
+            fill(sl, num, val_bytes);
+        }
+        size_t bytes = log_bytes(log_path);
+        Bench sl(cmp, tostr, log_path);
+        double begin = now_seconds();
+        int ret = sl.restore(log_path);
+        double seconds = now_seconds() - begin;
+        cout << "restore: " << num << " records, log " << megabytes(bytes) << " MB, " << seconds << " s, "
+            << seconds / (megabytes(bytes) / 1024) << " s/GB, "
+            << ((ret == 0 && restored_prefix(sl, num, val_bytes) == num) ? "all" : "NOT all")
+            << " entries restored.\n";
+        if (num == 0) {
+            break;
+        }
+    }
+    remove_files(log_path);
+}
+
+// Return 0 if every acknowledged write survived all rounds.
+int bench_crash(int entries, size_t val_bytes) {
+    cout << "== crash injection, SYNC_PER_OP ==\n";
+    string log_path = string(DATA_DIR) + "/crash_log";
+    // The child publishes the number of acknowledged writes here.
+    volatile long* acked = static_cast<volatile long*>(mmap(nullptr, sizeof(long),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (acked == MAP_FAILED) {
+        cout << "Cannot map the shared counter.\n";
+        return -1;
+    }
+    int failed = 0;
+    srand(time(0));
+    for (int round = 0; round < CRASH_ROUNDS; ++round) {
+        remove_files(log_path);
+        *acked = 0;
+        pid_t pid = fork();
+        if (pid == 0) {
+            Bench sl(cmp, tostr, log_path);
+            sl.set_sync_policy(SYNC_PER_OP);
+            for (int key = 0; key < entries; ++key) {
+                if (sl.safe_set(key, make_val(key, val_bytes)) != 0) {
+                    _exit(1);
+                }
+                *acked = key + 1;
+            }
+            // Never reach the destructor, wait to be killed.
+            while (true) {
+                pause();
+            }
+        }
+        // Kill somewhere between 20 and 220 ms into the stream.
+        usleep(20000 + rand() % 200000);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        long acknowledged = *acked;
+
+        Bench sl(cmp, tostr, log_path);
+        double begin = now_seconds();
+        int ret = sl.restore(log_path);
+        double seconds = now_seconds() - begin;
+        int restored = restored_prefix(sl, entries, val_bytes);
+        // The write in flight may or may not survive, nothing after it may appear.
+        bool ok = (ret == 0 && restored >= acknowledged && restored <= acknowledged + 1 &&
+            sl.size() == static_cast<size_t>(restored));
+        cout << "round " << round << ": acknowledged " << acknowledged << ", restored " << restored
+            << ", recovery " << seconds * 1000 << " ms, " << (ok ? "OK" : "LOST WRITES") << ".\n";
+        if (!ok) {
+            ++failed;
+        }
+    }
+    munmap(const_cast<long*>(acked), sizeof(long));
+    remove_files(log_path);
+    return (failed == 0) ? 0 : -1;
+}
+
+} // End anonoymous namespace.
+
+int main(int argc, char **argv) {
+    string mode = (argc > 1) ? argv[1] : "all";
+    int entries = (argc > 2) ? atoi(argv[2]) : 200000;
+    size_t val_bytes = (argc > 3) ? atoi(argv[3]) : 100;
+    if (entries <= 0 || (mode != "all" && mode != "sync" && mode != "dump" &&
+        mode != "restore" && mode != "crash")) {
+        cout << "Usage: " << argv[0] << " [all|sync|dump|restore|crash] [ENTRIES] [VALUE_BYTES]\n";
+        return -1;
+    }
+    mkdir(DATA_DIR, 0755);
+    cout << "Entries: " << entries << ", value bytes: " << val_bytes << ".\n";
+    int ret = 0;
+    if (mode == "all" || mode == "sync") {
+        bench_sync(entries, val_bytes);
+    }
+    if (mode == "all" || mode == "dump") {
+        bench_dump(entries, val_bytes);
+    }
+    if (mode == "all" || mode == "restore") {
+        bench_restore(entries, val_bytes);
+    }
+    if (mode == "all" || mode == "crash") {
+        ret = bench_crash(entries, val_bytes);
+    }
+    return ret;
+}
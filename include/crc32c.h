@@ -0,0 +1,62 @@
+// CRC32C (Castagnoli), used to check the records written to disk.
+// Uses the SSE4.2 instruction when compiled with -msse4.2, otherwise a lookup table.
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+namespace skiplist {
+
+/**
+ * Continue the CRC32C of former data with more bytes.
+ * Start with crc = 0.
+ */
+inline uint32_t crc32c(uint32_t crc, const void* data, size_t bytes) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+#if defined(__SSE4_2__)
+    while (bytes >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(uint64_t));
+        crc = static_cast<uint32_t>(_mm_crc32_u64(crc, word));
+        p += sizeof(uint64_t);
+        bytes -= sizeof(uint64_t);
+    }
+    while (bytes > 0) {
+        crc = _mm_crc32_u8(crc, *p);
+        ++p;
+        --bytes;
+    }
+#else
+    // Table of the reflected polynomial 0x82F63B78, built once.
+    struct Table {
+        uint32_t data[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+                }
+                data[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    while (bytes > 0) {
+        crc = table.data[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+        ++p;
+        --bytes;
+    }
+#endif
+    return ~crc;
+}
+
+} // End namespace skiplist.
+
+#endif // End ifndef _CRC32C_H_.
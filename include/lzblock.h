@@ -0,0 +1,144 @@
+// A small LZ77 compressor for the blocks of SafeSL snapshots.
+// The stream is a list of sequences, each copies some literals and then a match of earlier data:
+//     [TOKEN][LITERAL_LENGTH...][LITERALS][OFFSET][MATCH_LENGTH...]
+//      uint8      255 each               uint16     255 each
+// The high 4 bits of TOKEN are the literal length, the low 4 bits are the match length - 4,
+// 15 means more bytes follow. The last sequence has only literals.
+
+#ifndef _LZBLOCK_H_
+#define _LZBLOCK_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+namespace {
+
+const int LZ_MIN_MATCH = 4;
+const int LZ_HASH_BITS = 12;
+const size_t LZ_MAX_OFFSET = 65535;
+
+} // End anoyomous namespace.
+
+namespace skiplist {
+
+inline void _lz_append_length(std::string& out, size_t length) {
+    while (length >= 255) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+inline void _lz_append_sequence(std::string& out, const char* literals, size_t literal_bytes,
+    size_t offset, size_t match_bytes) {
+    size_t match_code = (match_bytes == 0) ? 0 : match_bytes - LZ_MIN_MATCH;
+    uint8_t token = static_cast<uint8_t>(((literal_bytes < 15 ? literal_bytes : 15) << 4) |
+        (match_code < 15 ? match_code : 15));
+    out.push_back(static_cast<char>(token));
+    if (literal_bytes >= 15) {
+        _lz_append_length(out, literal_bytes - 15);
+    }
+    out.append(literals, literal_bytes);
+    if (match_bytes == 0) {
+        return;
+    }
+    out.push_back(static_cast<char>(offset & 0xFF));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (match_code >= 15) {
+        _lz_append_length(out, match_code - 15);
+    }
+}
+
+/**
+ * Append the compressed data to out.
+ */
+inline void lz_compress(const char* data, size_t bytes, std::string& out) {
+    uint32_t table[1 << LZ_HASH_BITS]; // Last position + 1 of each hashed 4 bytes, 0 means none.
+    memset(table, 0, sizeof(table));
+    size_t anchor = 0; // Literals begin here.
+    size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= bytes) {
+        uint32_t word;
+        memcpy(&word, data + pos, sizeof(uint32_t));
+        uint32_t hash = (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = static_cast<uint32_t>(pos + 1);
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+            memcmp(data + candidate - 1, data + pos, LZ_MIN_MATCH) != 0) {
+            ++pos;
+            continue;
+        }
+        size_t match = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (pos + length < bytes && data[match + length] == data[pos + length]) {
+            ++length;
+        }
+        _lz_append_sequence(out, data + anchor, pos - anchor, pos - match, length);
+        pos += length;
+        anchor = pos;
+    }
+    _lz_append_sequence(out, data + anchor, bytes - anchor, 0, 0);
+}
+
+/**
+ * Decompress to out, which has raw_bytes of space.
+ * Return 0 means OK, -1 means the data is broken.
+ */
+inline int lz_decompress(const char* data, size_t bytes, char* out, size_t raw_bytes) {
+    size_t pos = 0;
+    size_t written = 0;
+    while (pos < bytes) {
+        uint8_t token = static_cast<uint8_t>(data[pos++]);
+        size_t literal_bytes = token >> 4;
+        if (literal_bytes == 15) {
+            uint8_t more;
+            do {
+                if (pos >= bytes) {
+                    return -1;
+                }
+                more = static_cast<uint8_t>(data[pos++]);
+                literal_bytes += more;
+            } while (more == 255);
+        }
+        if (literal_bytes > bytes - pos || literal_bytes > raw_bytes - written) {
+            return -1;
+        }
+        memcpy(out + written, data + pos, literal_bytes);
+        pos += literal_bytes;
+        written += literal_bytes;
+        if (pos == bytes) {
+            break; // The last sequence.
+        }
+        if (bytes - pos < 2) {
+            return -1;
+        }
+        size_t offset = static_cast<uint8_t>(data[pos]) | (static_cast<uint8_t>(data[pos + 1]) << 8);
+        pos += 2;
+        size_t match_bytes = (token & 0x0F);
+        if (match_bytes == 15) {
+            uint8_t more;
+            do {
+                if (pos >= bytes) {
+                    return -1;
+                }
+                more = static_cast<uint8_t>(data[pos++]);
+                match_bytes += more;
+            } while (more == 255);
+        }
+        match_bytes += LZ_MIN_MATCH;
+        if (offset == 0 || offset > written || match_bytes > raw_bytes - written) {
+            return -1;
+        }
+        // Byte by byte, the match may overlap the output.
+        for (size_t i = 0; i < match_bytes; ++i) {
+            out[written + i] = out[written - offset + i];
+        }
+        written += match_bytes;
+    }
+    return written == raw_bytes ? 0 : -1;
+}
+
+} // End namespace skiplist.
+
+#endif // End ifndef _LZBLOCK_H_.
@@ -0,0 +1,214 @@
+// Log writer of SafeSL.
+// Appends records to numbered log segments with group commit and a configurable sync policy.
+// A manifest records the segments in use:
+//     [BASE].manifest, [BASE].00000001, [BASE].00000002, ...
+
+#ifndef _SAFELOG_H_
+#define _SAFELOG_H_
+
+#include <string>
+#include <pthread.h>
+
+namespace {
+
+const size_t LOG_BUFFER_LIMIT = 1024 * 1024; // Buffered bytes are written when reaching this.
+const size_t DEFAULT_SEGMENT_BYTES = 64 * 1024 * 1024; // Roll to a new segment after this size.
+
+} // End anoyomous namespace.
+
+namespace skiplist {
+
+// When the appended records are synced to disk.
+enum SyncPolicy {
+    SYNC_NONE, // Never sync, the OS decides when the data reaches disk.
+    SYNC_INTERVAL, // A background thread syncs every N milliseconds.
+    SYNC_RECORDS, // Sync after every N records.
+    SYNC_PER_OP // Each record is synced before commit returns.
+};
+
+class LogWriter {
+private:
+    LogWriter(const LogWriter&);
+    LogWriter& operator=(const LogWriter&);
+public:
+    LogWriter();
+    ~LogWriter();
+
+    /**
+     * Open the last segment of the log for appending.
+     * The manifest and the first segment are created if unexisting.
+     * A new segment is used if the last one begins with another file header.
+     * @param base_path: The log path, segments are named after it.
+     * @param file_header: Written at the beginning of each new segment.
+     * Return 0 means success.
+     */
+    int open(const std::string& base_path, const std::string& file_header = "");
+
+    /**
+     * Write and sync all records, then close the file.
+     */
+    void close();
+
+    /**
+     * Sync all records and continue in a new segment.
+     * Records appended before are all in the former segments.
+     * Return the number of the new segment, 0 means failed.
+     */
+    unsigned long long roll();
+
+    /**
+     * Remove the segments before the given one, they are covered by a checkpoint.
+     * Return 0 means success.
+     */
+    int remove_before(unsigned long long segment);
+
+    /**
+     * Cut a segment of the log to bytes, dropping the torn tail found by a restore.
+     * Call it before appending, later records follow the kept bytes.
+     * Return 0 means success.
+     */
+    int truncate_segment(const std::string& base_path, unsigned long long segment, size_t bytes);
+    
+    /**
+     * Roll to a new segment when the current one reaches the size, 0 means never.
+     */
+    void set_segment_bytes(size_t bytes) {
+        _segment_bytes = bytes;
+    }
+
+    /**
+     * Read the segments in use from the manifest of the log.
+     * Return 0 means success, -1 means no manifest.
+     */
+    static int read_manifest(const std::string& base_path,
+        unsigned long long& first, unsigned long long& last);
+
+    /**
+     * Return the path of a segment.
+     */
+    static std::string segment_path(const std::string& base_path, unsigned long long segment);
+
+    /**
+     * Replace the file atomically by writing a temporary file and renaming it.
+     * The file and its directory are synced. Return 0 means success.
+     */
+    static int replace_file(const std::string& path, const std::string& content);
+    
+    /**
+     * Set the sync policy.
+     * @param param: N milliseconds for SYNC_INTERVAL, N records for SYNC_RECORDS.
+     */
+    void set_sync_policy(SyncPolicy policy, long param = 0);
+    
+    /**
+     * Call hook(arg) before each sync of the log, e.g. to sync a file the records refer to.
+     * If it doesn't return 0, the sync fails. nullptr means no hook.
+     */
+    void set_sync_hook(int (*hook)(void*), void* arg);
+
+    /**
+     * Use a dedicated writer thread, or write on the callers' threads.
+     * With the writer thread, append only copies the record into the buffer, the thread
+     * swaps the buffers and writes all records appended so far at once.
+     * Callers never write, they wait for the thread when the sync policy requires.
+     * Return 0 means success.
+     */
+    int set_async(bool flag);
+
+    /**
+     * Append one record to the memory buffer. It's thread safe.
+     * Return the sequence number of the record, -1 means failed.
+     * The sequence number is the token of wait_synced.
+     */
+    long long append(const char* data, size_t bytes);
+
+    /**
+     * Wait until the record meets the sync policy.
+     * Concurrent callers share one write and one fdatasync: the first caller
+     * becomes the leader and syncs all records appended so far, the others wait.
+     * Return 0 means success, -1 means the write or sync failed.
+     */
+    int commit(long long seq);
+
+    /**
+     * Wait until the record is synced, whatever the sync policy.
+     * Return 0 means success, -1 means the write or sync failed.
+     */
+    int wait_synced(long long seq);
+
+    /**
+     * Write all buffered records to the file without sync.
+     * Return 0 means success.
+     */
+    int flush();
+
+    /**
+     * Write and sync all buffered records.
+     * Return 0 means success.
+     */
+    int sync();
+
+private:
+    int _fd; // Descriptor of the current segment, -1 means not opened.
+    std::string _base_path;
+    std::string _file_header;
+    unsigned long long _first_segment; // The oldest segment in use.
+    unsigned long long _segment; // The segment being appended.
+    size_t _segment_size; // Bytes written to the current segment.
+    size_t _segment_bytes; // Roll after this size, 0 means never.
+    pthread_mutex_t _lock;
+    pthread_cond_t _cond; // Signaled when the leader finishes.
+    std::string _buffer; // Records appended but not written.
+    std::string _writing; // Records being written by the leader.
+    long long _appended; // Sequence number of the last appended record.
+    long long _written; // Sequence number of the last written record.
+    long long _synced; // Sequence number of the last synced record.
+    bool _leading; // A leader is writing the buffer.
+    bool _error; // Write or sync failed, all later commits fail.
+    SyncPolicy _policy;
+    long _param;
+    pthread_t _flusher; // The background thread of SYNC_INTERVAL.
+    bool _flusher_running;
+    bool _flusher_stop;
+    pthread_t _writer; // The writer thread of set_async.
+    pthread_cond_t _writer_cond; // Signaled when records are appended or a sync is requested.
+    bool _writer_running;
+    bool _writer_stop;
+    long long _sync_target; // Callers wait for the records up to it to be synced.
+    int (*_sync_hook)(void*); // Called before each sync, nullptr means none.
+    void* _sync_arg;
+
+    // Wait until the records up to target are written, and synced if do_sync.
+    // The lock must be held.
+    int _drain(long long target, bool do_sync);
+
+    // Stop the background thread.
+    void _stop_flusher();
+
+    // Stop the writer thread after it writes all records.
+    void _stop_writer();
+
+    // Records are written by the writer thread. The lock must be held.
+    bool _async() const {
+        return _writer_running && !_writer_stop;
+    }
+
+    // Open the segment for appending, write the file header if it's empty. The lock must be held.
+    int _open_segment(unsigned long long segment);
+
+    // The current segment begins with the file header.
+    bool _has_header();
+    
+    // Sync and switch to the next segment. The lock must be held.
+    int _roll_locked();
+
+    // Replace the manifest atomically by rename.
+    int _write_manifest();
+
+    static void* _flush_loop(void* writer);
+    static void* _write_loop(void* writer);
+};
+
+} // End namespace skiplist.
+
+#endif // End ifndef _SAFELOG_H_.
@@ -0,0 +1,478 @@
+// Log writer of SafeSL.
+// Appends records to numbered log segments with group commit and a configurable sync policy.
+
+#ifndef _SAFELOG_HPP_
+#define _SAFELOG_HPP_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <iostream>
+#include "safelog.h"
+
+#define toscreen std::cout<<__FILE__<<", "<<__LINE__<<": "
+
+namespace skiplist {
+
+inline LogWriter::LogWriter() : _fd(-1), _first_segment(0), _segment(0),
+    _segment_size(0), _segment_bytes(DEFAULT_SEGMENT_BYTES),
+    _appended(0), _written(0), _synced(0),
+    _leading(false), _error(false), _policy(SYNC_NONE), _param(0),
+    _flusher_running(false), _flusher_stop(false),
+    _writer_running(false), _writer_stop(false), _sync_target(0),
+    _sync_hook(nullptr), _sync_arg(nullptr) {
+    pthread_mutex_init(&_lock, nullptr);
+    pthread_cond_init(&_cond, nullptr);
+    pthread_cond_init(&_writer_cond, nullptr);
+}
+
+inline LogWriter::~LogWriter() {
+    close();
+    pthread_cond_destroy(&_writer_cond);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+}
+
+inline int LogWriter::open(const std::string& base_path, const std::string& file_header) {
+    close();
+    pthread_mutex_lock(&_lock);
+    _base_path = base_path;
+    _file_header = file_header;
+    _error = false;
+    bool new_log = (read_manifest(base_path, _first_segment, _segment) != 0);
+    if (new_log) {
+        _first_segment = 1;
+        _segment = 1;
+    }
+    int ret = _open_segment(_segment);
+    if (ret == 0 && !new_log && !_has_header()) {
+        // Written with another format, continue in a new segment.
+        ::close(_fd);
+        ret = _open_segment(_segment + 1);
+        new_log = true;
+    }
+    if (ret == 0 && new_log) {
+        ret = _write_manifest();
+    }
+    pthread_mutex_unlock(&_lock);
+    if (ret != 0) {
+        toscreen << "Cannot open the log: " << base_path << ".\n";
+        return -1;
+    }
+    if (_policy == SYNC_INTERVAL) {
+        set_sync_policy(_policy, _param);
+    }
+    return 0;
+}
+
+inline void LogWriter::close() {
+    _stop_flusher();
+    _stop_writer();
+    pthread_mutex_lock(&_lock);
+    if (_fd != -1) {
+        _drain(_appended, true);
+        ::close(_fd);
+        _fd = -1;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+inline void LogWriter::set_sync_hook(int (*hook)(void*), void* arg) {
+    pthread_mutex_lock(&_lock);
+    _sync_hook = hook;
+    _sync_arg = arg;
+    pthread_mutex_unlock(&_lock);
+}
+
+inline void LogWriter::set_sync_policy(SyncPolicy policy, long param) {
+    _stop_flusher();
+    pthread_mutex_lock(&_lock);
+    _policy = policy;
+    _param = param;
+    pthread_mutex_unlock(&_lock);
+    if (policy == SYNC_INTERVAL && param > 0 && _fd != -1) {
+        _flusher_stop = false;
+        if (pthread_create(&_flusher, nullptr, _flush_loop, this) != 0) {
+            toscreen << "Create the log sync thread failed.\n";
+            return;
+        }
+        _flusher_running = true;
+    }
+}
+
+inline int LogWriter::set_async(bool flag) {
+    if (!flag) {
+        _stop_writer();
+        return 0;
+    }
+    if (_writer_running) {
+        return 0;
+    }
+    if (_fd == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&_lock);
+    _writer_stop = false;
+    _writer_running = (pthread_create(&_writer, nullptr, _write_loop, this) == 0);
+    pthread_mutex_unlock(&_lock);
+    if (!_writer_running) {
+        toscreen << "Create the log writer thread failed.\n";
+        return -1;
+    }
+    return 0;
+}
+
+inline long long LogWriter::append(const char* data, size_t bytes) {
+    pthread_mutex_lock(&_lock);
+    if (_fd == -1 || _error) {
+        pthread_mutex_unlock(&_lock);
+        return -1;
+    }
+    if (_async()) {
+        // Bound the memory when the writer thread falls behind.
+        while (_buffer.size() >= LOG_BUFFER_LIMIT && !_error) {
+            pthread_cond_wait(&_cond, &_lock);
+        }
+        _buffer.append(data, bytes);
+        long long seq = ++_appended;
+        pthread_cond_signal(&_writer_cond);
+        pthread_mutex_unlock(&_lock);
+        return seq;
+    }
+    _buffer.append(data, bytes);
+    long long seq = ++_appended;
+    if (_segment_bytes != 0 && _segment_size + _buffer.size() >= _segment_bytes && !_leading) {
+        _roll_locked();
+    } else if (_buffer.size() >= LOG_BUFFER_LIMIT && !_leading) {
+        // Bound the memory when nobody syncs.
+        _drain(seq, false);
+    }
+    pthread_mutex_unlock(&_lock);
+    return seq;
+}
+
+inline int LogWriter::commit(long long seq) {
+    pthread_mutex_lock(&_lock);
+    int ret = _error ? -1 : 0;
+    if (_async()) {
+        bool do_sync = (_policy == SYNC_PER_OP || (_policy == SYNC_RECORDS && seq - _synced >= _param));
+        pthread_mutex_unlock(&_lock);
+        return do_sync ? wait_synced(seq) : ret;
+    }
+    if (_policy == SYNC_PER_OP) {
+        ret = _drain(seq, true);
+    } else if (_policy == SYNC_RECORDS && seq - _synced >= _param) {
+        ret = _drain(seq, true);
+    }
+    pthread_mutex_unlock(&_lock);
+    return ret;
+}
+
+inline int LogWriter::wait_synced(long long seq) {
+    pthread_mutex_lock(&_lock);
+    int ret = 0;
+    if (_async()) {
+        // Ask the writer thread to sync, concurrent callers share its fdatasync.
+        if (_sync_target < seq) {
+            _sync_target = seq;
+            pthread_cond_signal(&_writer_cond);
+        }
+        while (_synced < seq && !_error) {
+            pthread_cond_wait(&_cond, &_lock);
+        }
+        ret = _error ? -1 : 0;
+    } else {
+        ret = _drain(seq, true);
+    }
+    pthread_mutex_unlock(&_lock);
+    return ret;
+}
+
+inline int LogWriter::flush() {
+    pthread_mutex_lock(&_lock);
+    int ret = _drain(_appended, false);
+    pthread_mutex_unlock(&_lock);
+    return ret;
+}
+
+inline int LogWriter::sync() {
+    pthread_mutex_lock(&_lock);
+    int ret = _drain(_appended, true);
+    pthread_mutex_unlock(&_lock);
+    return ret;
+}
+
+inline int LogWriter::_drain(long long target, bool do_sync) {
+    while ((do_sync ? _synced : _written) < target) {
+        if (_error || _fd == -1) {
+            return -1;
+        }
+        if (_leading) {
+            // Another caller is writing, its write may cover this target.
+            pthread_cond_wait(&_cond, &_lock);
+            continue;
+        }
+        // Become the leader, write all records appended so far.
+        _leading = true;
+        // The buffers are swapped, so both keep their capacity.
+        std::string& data = _writing;
+        data.swap(_buffer);
+        long long upto = _appended;
+        int (*hook)(void*) = do_sync ? _sync_hook : nullptr;
+        void* hook_arg = _sync_arg;
+        pthread_mutex_unlock(&_lock);
+
+        int ret = 0;
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t bytes = ::write(_fd, data.data() + done, data.size() - done);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                toscreen << "Write the log failed.\n";
+                ret = -1;
+                break;
+            }
+            done += bytes;
+        }
+        if (ret == 0 && hook != nullptr && hook(hook_arg) != 0) {
+            toscreen << "The sync hook of the log failed.\n";
+            ret = -1;
+        }
+        if (ret == 0 && do_sync && fdatasync(_fd) != 0) {
+            toscreen << "Sync the log failed.\n";
+            ret = -1;
+        }
+
+        pthread_mutex_lock(&_lock);
+        _leading = false;
+        if (ret != 0) {
+            _error = true;
+        } else {
+            _written = upto;
+            _segment_size += data.size();
+            data.clear();
+            if (do_sync) {
+                _synced = upto;
+            }
+        }
+        pthread_cond_broadcast(&_cond);
+    }
+    return _error ? -1 : 0;
+}
+
+inline unsigned long long LogWriter::roll() {
+    pthread_mutex_lock(&_lock);
+    unsigned long long segment = (_roll_locked() == 0) ? _segment : 0;
+    pthread_mutex_unlock(&_lock);
+    return segment;
+}
+
+inline int LogWriter::remove_before(unsigned long long segment) {
+    pthread_mutex_lock(&_lock);
+    if (segment > _segment) {
+        segment = _segment;
+    }
+    unsigned long long former_first = _first_segment;
+    int ret = 0;
+    if (segment > _first_segment) {
+        // Update the manifest first, a crash then only leaves unused files.
+        _first_segment = segment;
+        ret = _write_manifest();
+        for (unsigned long long i = former_first; ret == 0 && i < segment; ++i) {
+            unlink(segment_path(_base_path, i).c_str());
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+    return ret;
+}
+
+inline int LogWriter::read_manifest(const std::string& base_path,
+    unsigned long long& first, unsigned long long& last) {
+    FILE* manifest = fopen((base_path + ".manifest").c_str(), "r");
+    if (manifest == nullptr) {
+        return -1;
+    }
+    int ret = fscanf(manifest, "SAFESL_MANIFEST first %llu last %llu", &first, &last);
+    fclose(manifest);
+    if (ret != 2 || first == 0 || first > last) {
+        toscreen << "The manifest of log: " << base_path << " has wrong format.\n";
+        return -1;
+    }
+    return 0;
+}
+
+inline std::string LogWriter::segment_path(const std::string& base_path, unsigned long long segment) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%08llu", segment);
+    return base_path + suffix;
+}
+
+inline int LogWriter::truncate_segment(const std::string& base_path, unsigned long long segment,
+    size_t bytes) {
+    pthread_mutex_lock(&_lock);
+    int ret = ::truncate(segment_path(base_path, segment).c_str(), bytes);
+    if (ret == 0 && _fd != -1 && base_path == _base_path && segment == _segment) {
+        // The size decides when to roll, it must not count the dropped bytes.
+        _segment_size = lseek(_fd, 0, SEEK_END);
+    }
+    pthread_mutex_unlock(&_lock);
+    return (ret == 0) ? 0 : -1;
+}
+
+inline int LogWriter::_open_segment(unsigned long long segment) {
+    std::string path = segment_path(_base_path, segment);
+    _fd = ::open(path.c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (_fd == -1) {
+        toscreen << "Cannot open the log segment: " << path << ".\n";
+        return -1;
+    }
+    _segment = segment;
+    _segment_size = lseek(_fd, 0, SEEK_END);
+    if (_segment_size == 0 && !_file_header.empty()) {
+        if (::write(_fd, _file_header.data(), _file_header.size()) != (ssize_t)_file_header.size()) {
+            toscreen << "Write the log file header failed.\n";
+            return -1;
+        }
+        _segment_size = _file_header.size();
+    }
+    return 0;
+}
+
+inline bool LogWriter::_has_header() {
+    std::string header(_file_header.size(), '\0');
+    return _file_header.empty() ||
+        (pread(_fd, &header[0], header.size(), 0) == (ssize_t)header.size() && header == _file_header);
+}
+
+inline int LogWriter::_roll_locked() {
+    if (_fd == -1 || _drain(_appended, true) != 0) {
+        return -1;
+    }
+    // Records appended while draining stay in the buffer, they go to the new segment.
+    ::close(_fd);
+    _fd = -1;
+    if (_open_segment(_segment + 1) != 0 || _write_manifest() != 0) {
+        _error = true;
+        return -1;
+    }
+    return 0;
+}
+
+inline int LogWriter::_write_manifest() {
+    char content[128];
+    int bytes = snprintf(content, sizeof(content), "SAFESL_MANIFEST\nfirst %llu\nlast %llu\n",
+        _first_segment, _segment);
+    if (replace_file(_base_path + ".manifest", std::string(content, bytes)) != 0) {
+        toscreen << "Replace the log manifest failed.\n";
+        return -1;
+    }
+    return 0;
+}
+
+inline int LogWriter::replace_file(const std::string& path, const std::string& content) {
+    std::string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    bool ok = (::write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()) && 
+        fsync(fd) == 0);
+    ::close(fd);
+    if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+        return -1;
+    }
+    // Sync the directory, so the rename and the files created before survive a crash.
+    size_t slash = path.find_last_of('/');
+    std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+    int dir_fd = ::open(dir.c_str(), O_RDONLY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        ::close(dir_fd);
+    }
+    return 0;
+}
+
+inline void LogWriter::_stop_flusher() {
+    if (!_flusher_running) {
+        return;
+    }
+    pthread_mutex_lock(&_lock);
+    _flusher_stop = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_flusher, nullptr);
+    _flusher_running = false;
+}
+
+inline void LogWriter::_stop_writer() {
+    if (!_writer_running) {
+        return;
+    }
+    pthread_mutex_lock(&_lock);
+    _writer_stop = true;
+    pthread_cond_signal(&_writer_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_writer, nullptr);
+    pthread_mutex_lock(&_lock);
+    _writer_running = false;
+    pthread_mutex_unlock(&_lock);
+}
+
+inline void* LogWriter::_write_loop(void* writer) {
+    LogWriter& log = *reinterpret_cast<LogWriter*>(writer);
+    pthread_mutex_lock(&log._lock);
+    while (true) {
+        bool do_sync = log._sync_target > log._synced || log._policy == SYNC_PER_OP ||
+            (log._policy == SYNC_RECORDS && log._appended - log._synced >= log._param);
+        bool has_work = !log._error && (log._written < log._appended || 
+            (do_sync && log._synced < log._appended));
+        if (!has_work) {
+            // Records appended before stopping are all written.
+            if (log._writer_stop) {
+                break;
+            }
+            pthread_cond_wait(&log._writer_cond, &log._lock);
+            continue;
+        }
+        if (log._segment_bytes != 0 && log._segment_size > log._file_header.size() &&
+            log._segment_size + log._buffer.size() >= log._segment_bytes) {
+            log._roll_locked();
+            continue;
+        }
+        // Records appended while writing go to the other buffer, they are written in the next round.
+        log._drain(log._appended, do_sync);
+    }
+    pthread_mutex_unlock(&log._lock);
+    return nullptr;
+}
+
+inline void* LogWriter::_flush_loop(void* writer) {
+    LogWriter& log = *reinterpret_cast<LogWriter*>(writer);
+    pthread_mutex_lock(&log._lock);
+    while (!log._flusher_stop) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += log._param / 1000;
+        deadline.tv_nsec += (log._param % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        // Other broadcasts may wake it early, wait until the deadline.
+        while (!log._flusher_stop &&
+            pthread_cond_timedwait(&log._cond, &log._lock, &deadline) != ETIMEDOUT) {}
+        if (!log._flusher_stop && log._synced < log._appended) {
+            log._drain(log._appended, true);
+        }
+    }
+    pthread_mutex_unlock(&log._lock);
+    return nullptr;
+}
+
+} // End namespace skiplist.
+
+#endif // End ifndef _SAFELOG_HPP_.
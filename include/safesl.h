@@ -7,17 +7,125 @@
 #define _SAFESL_H_
 
 #include "skiplist.hpp"
+#include "safelog.hpp"
+#include "crc32c.h"
+#include "serializer.h"
+#include "lzblock.h"
 #include <iostream>
 #include <malloc.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace {
+
+// The log segment begins with this, followed by framed records with LSN.
+const char LOG_MAGIC[] = "SAFESL03";
+const char LOG_MAGIC_V2[] = "SAFESL02"; // Framed records without LSN.
+const size_t LOG_MAGIC_BYTES = 8;
+
+// The dump file begins with this, followed by the dump time, the first log segment after it,
+// the LSN of the last operation in it and the key encoding, then the blocks and the trailer.
+const char DUMP_MAGIC[] = "SAFEDMP5";
+const char DUMP_MAGIC_V4[] = "SAFEDMP4"; // Blocks without the trailer.
+const char DUMP_MAGIC_V3[] = "SAFEDMP3"; // Records without blocks.
+const char DUMP_MAGIC_V2[] = "SAFEDMP2"; // Records without LSN.
+const size_t DUMP_MAGIC_BYTES = 8;
+
+// The delta file has the header of the dump followed by the LSN of the checkpoint it follows,
+// then blocks of the keys changed after that checkpoint, the vals are tagged with the tombstone flag.
+const char DELTA_MAGIC[] = "SAFEDLT2";
+const char DELTA_MAGIC_V1[] = "SAFEDLT1"; // Blocks without the trailer.
+
+const size_t DUMP_BLOCK_BYTES = 16 * 1024; // A block is finished after reaching this.
+const uint32_t DUMP_RESTART_INTERVAL = 16; // Every 16th entry stores the whole key.
+
+} // End anoyomous namespace.
 
 namespace skiplist {
 
+// Each log record begins with this header.
+// [CRC][LENGTH] [LSN][LOG_TIME][OPERATION_TAG][KEY_BYTES][KEY][VAL_BYTES][VAL]
+// A batch is one record, the operations follow [LSN][LOG_TIME][TAG_BATCH][OP_NUM]:
+//     [OPERATION_TAG][KEY_BYTES][KEY][VAL_BYTES][VAL], no val for TAG_DEL.
+// CRC is the CRC32C of LENGTH and the payload after it.
+struct LogRecordHeader {
+    uint32_t crc;
+    uint32_t length; // Bytes of the payload.
+};
+
+// Each block of the dump begins with this header.
+// CRC is the CRC32C of the other fields and the stored data.
+// The stored data is compressed if STORED_BYTES < RAW_BYTES.
+// The trailer ending the blocks has RAW_BYTES 0, its stored data is the number of entries.
+struct DumpBlockHeader {
+    uint32_t crc;
+    uint32_t stored_bytes;
+    uint32_t raw_bytes;
+    uint32_t entries;
+};
+
+// How keys are encoded in the blocks of the dump.
+enum KeyEncoding {
+    KEY_PREFIX, // Serialized bytes sharing the prefix with the former key.
+    KEY_DELTA // Zigzag varint of the difference to the former integer key.
+};
+
+// Converts integer keys for KEY_DELTA.
+template <typename T, bool = std::is_integral<T>::value>
+struct IntegerKey {
+    static const bool enabled = false;
+    static unsigned long long to_u64(const T&) {
+        return 0;
+    }
+    static void from_u64(T&, unsigned long long) {}
+};
+
+template <typename T>
+struct IntegerKey<T, true> {
+    static const bool enabled = true;
+    static unsigned long long to_u64(const T& key) {
+        return static_cast<unsigned long long>(key);
+    }
+    static void from_u64(T& key, unsigned long long value) {
+        key = static_cast<T>(value);
+    }
+};
+
+// Varint, 7 bits per byte with the high bit meaning more bytes.
+inline void append_varint(std::string& out, unsigned long long value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Return 0 means OK and pos is moved after it, -1 means out of range.
+inline int read_varint(const char* data, size_t bytes, size_t& pos, unsigned long long& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < bytes; shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(data[pos++]);
+        value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
 enum Tags {
     TAG_COPY,
     TAG_POINTER,
     TAG_SET,
-    TAG_DEL
+    TAG_DEL,
+    TAG_BATCH // Log record of a WriteBatch.
 };
 
 struct Binary {
@@ -66,8 +174,93 @@ public:
     }
 };
 
+// A read-only memory mapping of a whole file.
+struct MappedFile {
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+public:
+    const char *data;
+    size_t bytes;
+    
+    MappedFile() : data(nullptr), bytes(0) {}
+    
+    // Return 0 means OK.
+    int map(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return -1;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            return -1;
+        }
+        bytes = info.st_size;
+        if (bytes == 0) {
+            close(fd);
+            data = "";
+            return 0;
+        }
+        void* addr = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            bytes = 0;
+            return -1;
+        }
+        madvise(addr, bytes, MADV_SEQUENTIAL);
+        data = reinterpret_cast<const char*>(addr);
+        return 0;
+    }
+    
+    ~MappedFile() {
+        if (bytes != 0) {
+            munmap(const_cast<char*>(data), bytes);
+        }
+    }
+};
+
+template <typename KeyType, typename ValType>
+class SSTable;
+template <typename KeyType, typename ValType>
+class SSTableWriter;
+template <typename KeyType, typename ValType>
+class SafeSL;
+template <typename KeyType, typename ValType>
+class VlogSL;
+
+// Sets and deletes logged by SafeSL::safe_write as one record, they are replayed all or none.
+// The last operation of a key wins.
+template <typename KeyType, typename ValType>
+class WriteBatch {
+    friend class SafeSL<KeyType, ValType>;
+public:
+    void set(const KeyType& key, const ValType& val) {
+        BatchOp<KeyType, ValType> op = {key, val, false};
+        _ops.push_back(op);
+    }
+    void del(const KeyType& key) {
+        BatchOp<KeyType, ValType> op = {key, ValType(), true};
+        _ops.push_back(op);
+    }
+    void clear() {
+        _ops.clear();
+    }
+    size_t size() const {
+        return _ops.size();
+    }
+private:
+    std::vector<BatchOp<KeyType, ValType> > _ops;
+};
+
 template <typename KeyType, typename ValType>
 class SafeSL : protected SkipList<KeyType, ValType> {
+    // The tables share the block format and the converters.
+    friend class SSTable<KeyType, ValType>;
+    friend class SSTableWriter<KeyType, ValType>;
+    // Its skiplist maps the keys to the handles of the values, sharing the converters.
+    template <typename K, typename V>
+    friend class VlogSL;
 public:
     /**
      * To use this class, you must assign 6 functions:
@@ -77,6 +270,7 @@ public:
      * 3. Convert val to binary.
      * 4. Parse key from binary.
      * 5. Parse val from binary.
+     * A nullptr converter means using the Serializer of the type.
      **/
     SafeSL(int (*cmp_fun)(const KeyType&, const KeyType&), 
         std::string (*key_to_str)(const KeyType&), 
@@ -84,32 +278,188 @@ public:
         void (*convert_val_to_bin)(const ValType&, Binary& bin_data),
         void (*parse_key_from_bin)(KeyType&, const Binary& bin_data),
         void (*parse_val_from_bin)(ValType&, const Binary& bin_data),
+        const std::string &log_path_in = "log", // Log segments are named after this path.
+        int level_in = DEFAULT_LEVEL);
+    
+    // Use the Serializer of the key and val instead of the converters.
+    SafeSL(int (*cmp_fun)(const KeyType&, const KeyType&), 
+        std::string (*key_to_str)(const KeyType&), 
         const std::string &log_path_in = "log",
         int level_in = DEFAULT_LEVEL);
     virtual ~SafeSL();
     
     // The interface to provide safely manipulating the data in skiplist.
+    // All of them are thread safe. Readers run in parallel, and writers are serialized.
+    // A writer blocks the readers only while changing the skiplist, not while logging.
+    // safe_set and safe_del return after the log record meets the sync policy,
+    // and they return -1 if writing the log failed.
     int safe_get(const KeyType& key, ValType& val);
     int safe_set(const KeyType& key, const ValType& val);
     int safe_del(const KeyType& key);
     
+    // Like safe_set and safe_del, but return without waiting for the log, see use_async_log.
+    // The token is the sequence number of the record, 0 means nothing is logged.
+    int async_set(const KeyType& key, const ValType& val, long long& token);
+    int async_del(const KeyType& key, long long& token);
+    
+    // Wait until the records up to the token are synced to disk. Return 0 means success.
+    int wait_log(long long token);
+    
+    // Apply the batch in one pass through the skiplist, and log it as one record with one LSN.
+    // Set overwrites the existing key, and deleting an unexisting key is ignored.
+    // If some set fails, the state of the batch keys is logged after it, so the replay
+    // only keeps the applied operations.
+    // safe_write returns like safe_set, async_write like async_set.
+    // Return 0 means success, -1 means writing the log or some set failed.
+    int safe_write(const WriteBatch<KeyType, ValType>& batch);
+    int async_write(const WriteBatch<KeyType, ValType>& batch, long long& token);
+    
+    // Set when the log is synced to disk, see SyncPolicy.
+    // Concurrent writers waiting for sync share one fdatasync.
+    void set_sync_policy(SyncPolicy policy, long param = 0) {
+        _log.set_sync_policy(policy, param);
+    }
+    
+    // The log rolls to a new segment when the current one reaches the size, 0 means never.
+    void set_segment_bytes(size_t bytes) {
+        _log.set_segment_bytes(bytes);
+    }
+    
+    // Write the log on a dedicated thread, writers only copy the records into its buffer.
+    // The sync policy still decides when safe_set and safe_del return.
+    // Return 0 means success.
+    int use_async_log(bool flag) {
+        return _log.set_async(flag);
+    }
+    
+    // Return the elements numbers.
+    // In LSM mode it merges all entries like safe_scan, so it costs a full scan.
+    size_t size();
+    
+    // Deferred deletion, see SkipList::use_lazy_delete and SkipList::compact.
+    // Only the skiplist is affected, safe_del still logs the deletion.
+    // The tombstones of the memtable are kept in LSM mode, they hide the keys in the tables.
+    void use_lazy_delete(bool flag) {
+        SkipList<KeyType, ValType>::use_lazy_delete(flag);
+    }
+    size_t compact(size_t budget);
+    
+    // Use the skiplist as the memtable of an LSM tree, call it before restore and any write.
+    // When the memtable reaches memtable_entries, the log rolls and the memtable is frozen,
+    // a background thread flushes it to an immutable sorted table:
+    //     [LOG_PATH].table.00000001, ... listed by the manifest [LOG_PATH].tables
+    // Then the log segments before are removed. When merge_width tables of a tier exist,
+    // the thread merges them into one table of the next tier.
+    // In LSM mode:
+    // safe_get looks up the memtable, the frozen memtable, then the tables from new to old.
+    // safe_set overwrites, and safe_del looks the key up, then writes a tombstone.
+    // restore loads the tables and replays the log after them, the dump is ignored.
+    // size, safe_scan and safe_prefix_scan merge the memtable, the frozen memtable and the tables,
+    // the newest entry of a key wins and tombstones hide the older ones.
+    // dump_to_file and checkpoint are unsupported, the tables are the checkpoint.
+    // Return 0 means success.
+    int use_lsm(size_t memtable_entries, int merge_width = 4);
+    
+    // Freeze the memtable and wait until it's flushed to a table.
+    // Return 0 means success, -1 means failed or not in LSM mode.
+    int flush_memtable();
+    
+    // Return the number of tables in LSM mode.
+    size_t table_num();
+    
+    // Range queries, see SkipList::scan and SkipList::prefix_scan.
+    // The visitor runs with the read lock held, it must not call this SafeSL.
+    // In LSM mode a table which cannot be read ends the scan early.
+    template <typename Visitor>
+    size_t safe_scan(const KeyType& begin, Visitor visitor) {
+        if (_lsm) {
+            return _lsm_scan(&begin, visitor);
+        }
+        pthread_rwlock_rdlock(&_rw_lock);
+        size_t visited = SkipList<KeyType, ValType>::scan(begin, visitor);
+        pthread_rwlock_unlock(&_rw_lock);
+        return visited;
+    }
+    template <typename Visitor>
+    size_t safe_prefix_scan(const KeyType& prefix, Visitor visitor) {
+        if (_lsm) {
+            size_t visited = 0;
+            _lsm_scan(&prefix, [&](const KeyType& key, const ValType& val) {
+                if (key.compare(0, prefix.size(), prefix) != 0) {
+                    // Out of the prefix range.
+                    return false;
+                }
+                ++visited;
+                return static_cast<bool>(visitor(key, val));
+            });
+            return visited;
+        }
+        pthread_rwlock_rdlock(&_rw_lock);
+        size_t visited = SkipList<KeyType, ValType>::prefix_scan(prefix, visitor);
+        pthread_rwlock_unlock(&_rw_lock);
+        return visited;
+    }
+    
     // Save all data to a file.
     // Call this function will cause the skiplist unused during processing.
+    // The log rolls to a new segment first, and the former segments are removed after dumping.
     // Return 0 means success.
     int dump_to_file(const std::string& dump_path);
     
+    // Save the keys set or deleted since the last checkpoint to a delta file.
+    // The delta follows the last dump_to_file, checkpoint, dump_incremental or restore from them,
+    // it's restored after them by restore. The log segments before are removed.
+    // Return 0 means success, -1 means failed or no checkpoint to follow.
+    int dump_incremental(const std::string& delta_path);
+    
+    // Merge the dump and its deltas into a new dump, the newest wins and deleted keys are dropped.
+    // The deltas are given from old to new. It only reads the files, writers aren't blocked.
+    // The new dump is at the last delta, so later deltas follow it.
+    // Return 0 means success.
+    int compact_deltas(const std::string& dump_path, const std::vector<std::string>& delta_paths,
+        const std::string& new_dump_path);
+    
+    // Save all data to a file without stopping the writers.
+    // A forked child writes the skiplist at this moment, the log rolls to a new segment first.
+    // Writers only pay for copying the pages they modify while the child runs.
+    // Return 0 means the checkpoint started.
+    int checkpoint(const std::string& dump_path);
+    
+    // Check the checkpoint started by checkpoint(), block until it finishes if wait.
+    // The former log segments are removed when it succeeds.
+    // Return 1 means running, 0 means finished or none started, -1 means failed.
+    int checkpoint_status(bool wait = false);
+    
     // Append all data from a file.
     // Call this function will cause the skiplist unused during processing.
     // Return 0 means successful.
     int parse_from_file(const std::string& dump_path);
 
     // Restore from an accident, e.g., process stop, power off or etc.
-    // You must give the last dumpped file and logfile.
-    // If you have not dumpped data to file, you just need give the logfile.
+    // You must give the last dumpped file and the log path.
+    // If you have not dumpped data to file, you just need give the log path.
+    // Only the log segments after the dump are replayed.
+    // Readers and writers wait until the restore finishes.
+    // Return 0 means successful. -1 means failed, e.g., a segment is missing, broken,
+    // or torn before the last one, then the skiplist only has the records before it.
     int restore(const std::string& log_file, const std::string& dump_file = "NOFILE");
     
+    // Restore from the dump and the deltas following it from old to new, then the log after them.
+    int restore(const std::string& log_file, const std::string& dump_file,
+        const std::vector<std::string>& delta_files);
+    
+    // Restore like restore, but the dump and log segments are mapped into memory and
+    // decoded by threads in parallel chunks. The last operation of each key is resolved
+    // in parallel hash partitions, then all entries are loaded in key order at once.
+    // Threads <= 0 means the number of cores.
+    // The deltas following the dump are merged into it from old to new before the log.
+    // It falls back to restore if the skiplist isn't empty or the files are of former versions.
+    int parallel_restore(const std::string& log_file, 
+        const std::string& dump_file = "NOFILE", int threads = 0,
+        const std::vector<std::string>& delta_files = std::vector<std::string>());
+    
     // Write the log from buffer to file.
-    // If using multi-thread, it can set time-interval to automatially do this.
+    // It doesn't sync, use set_sync_policy for durability.
     void land_log();
 private:
     std::string (*key2str)(const KeyType&);
@@ -118,30 +468,306 @@ private:
     void (*bin2key)(KeyType&, const Binary& bin_data);
     void (*bin2val)(ValType&, const Binary& bin_data);
     
-    // This function need a FILE pointer, and the position is after the last_update_time.
+    // The header of the dump file.
+    struct DumpHeader {
+        int version; // 1 means only the time, 4 means blocks, 5 means blocks and the trailer.
+        long time;
+        unsigned long long segment;
+        unsigned long long lsn;
+        uint32_t key_encoding;
+        bool delta; // A delta file, its blocks are tagged.
+        unsigned long long base_lsn; // LSN of the checkpoint the delta follows.
+        DumpHeader() : version(0), time(0), segment(0), lsn(0), key_encoding(KEY_PREFIX),
+            delta(false), base_lsn(0) {}
+    };
+    
+    // This function need a FILE pointer, and the position is after the header.
     // This function won't close the file.
-    int _parse_from_file(FILE* file);
-    
-    // Read the correct data from file.
-    // Append the record to the file.
-    // File must at position begin with the correct data.
-    // It will move the file position after the correct data.
-    int _read_key(FILE* file, KeyType& key); // Return 1 means the file is over. 0 means OK, 1 means error.
-    int _read_val(FILE* file, ValType& val);
-    int _write_key(FILE* file, const KeyType& key);
-    int _write_val(FILE* file, const ValType& val);
-    
-    // Write or read the key and val to the file or from the file.
-    int _write_record(FILE* file, const KeyType& key, const ValType& val);
-    int _read_record(FILE* file, KeyType& key, ValType& val); // Return 1 means the file is over. 0 means OK, 1 means error.
-    
-    // Write the operation to log file.
-    void _write_to_log(Tags tag, const KeyType& key, const ValType& val);
-    
-    // Log file pointer and path.
-    FILE* _log_pointer;
+    int _parse_from_file(FILE* file, const DumpHeader& header);
+    
+    // The restores, the writer lock and the read-write lock must be held.
+    int _restore(const std::string& log_file, const std::string& dump_file,
+        const std::vector<std::string>& delta_files);
+    int _parallel_restore(const std::string& log_file, const std::string& dump_file, int threads,
+        const std::vector<std::string>& delta_files);
+    
+    // Read the blocks one by one, and load the entries of each.
+    // Entries of a delta replace the existing ones, its tombstones delete them.
+    int _parse_blocks(FILE* file, const DumpHeader& header);
+    
+    // Read and decode the next block, the tombstone flags are appended to deleted for a delta.
+    // records counts the entries read from the file, the trailer must match it.
+    // Return 0 means OK, 1 means the file is over, -1 means error.
+    int _next_block(FILE* file, const DumpHeader& header, std::string& stored, std::string& raw,
+        std::vector<std::pair<KeyType, ValType> >& entries, std::vector<char>* deleted,
+        unsigned long long& records);
+    
+    // The block being built by the dump.
+    struct BlockBuilder {
+        std::string raw; // [ENTRY]...[RESTART_OFFSET]...[RESTART_NUM]
+        std::string stored; // Compressed raw.
+        std::vector<uint32_t> restarts; // Offsets of the entries storing the whole key.
+        uint32_t entries;
+        std::string last_key; // Serialized former key for KEY_PREFIX.
+        unsigned long long last_int; // Former key for KEY_DELTA.
+        bool tagged; // Vals are tagged with the tombstone flag, used by the tables.
+        BlockBuilder() : entries(0), last_int(0), tagged(false) {}
+    };
+    
+    // Integer keys with the Serializer use KEY_DELTA, others use KEY_PREFIX.
+    KeyEncoding _key_encoding() const {
+        return (IntegerKey<KeyType>::enabled && key2bin == nullptr) ? KEY_DELTA : KEY_PREFIX;
+    }
+    
+    // Append an entry to the block, deleted is only stored in tagged blocks.
+    void _add_entry(BlockBuilder& block, const KeyType& key, const ValType& val, std::string& scratch,
+        bool deleted = false);
+    
+    // Append the restart points, compress and write the block. Return 0 means OK.
+    int _flush_block(FILE* file, BlockBuilder& block);
+    
+    // Check the CRC and decompress the stored data of a block. Return 0 means OK.
+    static int _unpack_block(const DumpBlockHeader& header, const char* body, std::string& raw);
+    
+    // Write the trailer after the blocks, so a file cut between blocks is detected.
+    // Return 0 means OK.
+    static int _flush_trailer(FILE* file, unsigned long long records);
+    
+    // Return 0 means the block is an intact trailer of the records entries.
+    static int _check_trailer(const DumpBlockHeader& header, const char* body, unsigned long long records);
+    
+    // Append the entries of the raw block to out. Return 0 means OK.
+    // The block is tagged if deleted isn't nullptr, the tombstone flags are appended to it.
+    int _decode_block(const std::string& raw, uint32_t entries, uint32_t key_encoding,
+        std::vector<std::pair<KeyType, ValType> >& out, std::vector<char>* deleted = nullptr);
+    
+    // Append [size_t][binary data] of the key or val to the buffer.
+    // The Serializer writes in place if the converter is nullptr.
+    template <typename T>
+    static void _append_obj(std::string& out, const T& obj, void (*to_bin)(const T&, Binary&));
+    
+    // Parse the key or val from the binary data by the converter or the Serializer.
+    // Return 0 means OK.
+    template <typename T>
+    static int _parse_obj(T& obj, const Binary& bin, void (*from_bin)(T&, const Binary&));
+    
+    // Read [size_t][binary data] at pos of the memory, bin points into the memory.
+    // Return 0 means OK and pos is moved after the data, -1 means out of range.
+    static int _read_bin(const char* data, size_t bytes, size_t& pos, Binary& bin);
+    
+    // Append one framed log record to the buffer.
+    void _encode_record(std::string& out, Tags tag, unsigned long long lsn, long log_time, 
+        const KeyType& key, const ValType& val);
+    
+    // Append one framed log record of the batch operations to the buffer.
+    void _encode_batch(std::string& out, unsigned long long lsn, long log_time,
+        const std::vector<BatchOp<KeyType, ValType> >& ops);
+    
+    // Fill the header of the record beginning at start of the buffer.
+    static void _seal_record(std::string& out, size_t start);
+    
+    // Decode the payload of a framed log record, lsn is read only if has_lsn. Return 0 means OK.
+    // The operations of a TAG_BATCH record are decoded into batch, it fails if batch is nullptr.
+    int _decode_record(const char* payload, size_t bytes, bool has_lsn, 
+        unsigned long long& lsn, long& log_time, Tags& tag, KeyType& key, ValType& val,
+        std::vector<BatchOp<KeyType, ValType> >* batch = nullptr);
+    
+    // Which records are already in the dump.
+    struct ReplayFilter {
+        bool has_lsn; // The records have LSN.
+        unsigned long long min_lsn; // Records with LSN not after it are skipped.
+        long min_time; // Records without LSN not after it are skipped.
+        ReplayFilter() : has_lsn(false), min_lsn(0), min_time(0) {}
+    };
+    
+    // Replay the framed records from pos, records covered by the filter are skipped.
+    // Replayed records are appended to valid_records with LSN if it's not nullptr.
+    // Return the position after the last intact record.
+    size_t _replay_records(const std::string& data, size_t pos, const ReplayFilter& filter,
+        std::string* valid_records, unsigned long& handled_lines, unsigned long& valid_datas);
+    
+    // Replay the single log file written by former versions, records not after min_time are skipped.
+    // Replayed records are appended to valid_records in the framed format.
+    int _replay_legacy_log(const std::string& log_file, long min_time, std::string& valid_records,
+        unsigned long& handled_lines, unsigned long& valid_datas);
+    
+    // A decoded log record of parallel_restore.
+    struct ReplayOp {
+        unsigned long long lsn;
+        Tags tag;
+        KeyType key;
+        ValType val;
+        const char *key_data; // The serialized key in the mapped segment, used for partitioning.
+        size_t key_bytes;
+    };
+    
+    // Run fun(0) ... fun(threads - 1) in threads and wait for them.
+    template <typename Fun>
+    static void _parallel_run(int threads, Fun fun);
+    template <typename Fun>
+    static void* _parallel_entry(void* task);
+    
+    // FNV-1a hash of the bytes.
+    static size_t _hash_bytes(const char* data, size_t bytes) {
+        size_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < bytes; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ULL;
+        }
+        return hash;
+    }
+    
+    // Manipulate the skiplist by a log record.
+    void _apply_record(Tags tag, const KeyType& key, const ValType& val);
+    
+    // Apply the operations of a batch sorted by key, the writer lock must be held.
+    // Return 0 means success, -1 means some set failed.
+    int _apply_batch(const std::vector<BatchOp<KeyType, ValType> >& ops);
+    
+    // Read the whole file. Return 0 means OK.
+    static int _read_file(const std::string& path, std::string& data);
+    
+    // Read the header of the dump file and locate to the data part.
+    // Segment and lsn are 0 if the dump doesn't know them.
+    int _read_dump_header(FILE* file, DumpHeader& header);
+    
+    // Parse the header of the dump in memory, pos is set to the data part.
+    // Return 0 means OK, -1 means error.
+    static int _parse_dump_header(const char* data, size_t bytes, size_t& pos, DumpHeader& header);
+    
+    // Write the dump with the segment in header to a temporary file, then rename it.
+    // A delta only has the dirty keys, and follows the checkpoint at _chain_lsn.
+    // It doesn't print, so it's safe in the forked child.
+    // Return the number of dumpped nodes, -1 means failed and error is set.
+    long _write_dump(const std::string& dump_path, unsigned long long segment, 
+        unsigned long long lsn, const char*& error, bool delta = false);
+    
+    // Write the header of the dump or the delta. Return 0 means OK.
+    int _write_dump_header(FILE* file, const DumpHeader& header);
+    
+    // Sync and close the temporary file, then rename it. Return 0 means OK, or error is set.
+    static int _finish_dump(FILE* file, const std::string& temp_path, const std::string& dump_path,
+        const char*& error);
+    
+    // Remember the key changed after the last checkpoint, the writer lock must be held.
+    void _mark_dirty(const KeyType& key) {
+        if (_track_dirty) {
+            _dirty.insert(key);
+        }
+    }
+    
+    // An evicted key is gone from the skiplist, the next delta must delete it.
+    virtual void _on_evict(const KeyType& key) {
+        _mark_dirty(key);
+    }
+    
+    // Read the key and val of the dump without blocks, scratch is the serialization buffer.
+    // File must at position begin with the correct data, it's moved after the data.
+    int _read_record(FILE* file, KeyType& key, ValType& val, std::string& scratch); // Return 1 means the file is over. 0 means OK, -1 means error.
+    
+    // Stamp the next LSN into the record encoded with LSN 0, then append it to the log.
+    // The writer lock must be held, so the record order in the log is the operation order.
+    // Return the sequence number of the record, -1 means failed.
+    long long _write_to_log(std::string& record);
+    
+    // Log the current state of the key after its logged operation failed to apply,
+    // so the replay matches the skiplist. The writer lock must be held.
+    // Return the sequence number of the record, -1 means failed.
+    long long _log_undo(const KeyType& key);
+    
+    // Like above, for the keys of a batch. It's logged as one batch record.
+    long long _log_undo(const std::vector<BatchOp<KeyType, ValType> >& ops);
+    
+    // Make the read-write lock prefer the writers, so a stream of readers cannot starve them.
+    static void _init_rw_lock(pthread_rwlock_t* lock);
+    
+    // Wait until the record meets the sync policy, without the writer lock.
+    // So concurrent writers can share one sync. Return 0 means success.
+    int _commit_log(long long seq);
+    
+    // Set the key in the memtable, or mark it as a tombstone. Return 0 means success.
+    int _lsm_put(const KeyType& key, const ValType& val, bool deleted);
+    
+    // Look up the memtable, the frozen memtable and the tables. Return 0 means found.
+    int _lsm_get(const KeyType& key, ValType& val);
+    
+    // Visit the live entries whose key >= *begin in order, merged from the memtable,
+    // the frozen memtable and the tables. nullptr begins from the first entry.
+    // Return the number of visited entries.
+    template <typename Visitor>
+    size_t _lsm_scan(const KeyType* begin, Visitor visitor);
+    
+    // Freeze the memtable if it's full, the writer lock must be held.
+    // Like checkpoint_status, _checkpoint_lock must be held.
+    int _checkpoint_status(bool wait);
+    
+    void _maybe_freeze();
+    
+    // Roll the log and move the memtable to _frozen, the writer lock must be held.
+    // Return 0 means success.
+    int _freeze();
+    
+    // Write the frozen memtable to a table and remove the log segments before it.
+    // Return 0 means success.
+    int _flush_frozen();
+    
+    // Merge the oldest merge_width tables of a tier if there are so many.
+    // Return 1 means merged, 0 means nothing to merge, -1 means failed.
+    int _merge_tables();
+    
+    // Replace the table manifest, _tables_lock must be held. Return 0 means success.
+    int _write_tables();
+    
+    // Open the tables listed by the table manifest. Return 0 means success.
+    int _load_tables();
+    
+    // Path of the table file.
+    std::string _table_path(unsigned long long id) const;
+    
+    // Flush and merge the tables in background.
+    static void* _compact_loop(void* safesl);
+    
+    // Log writer and path.
+    LogWriter _log;
     std::string _log_path;
+    unsigned long long _lsn; // LSN of the last operation, increases by 1 for each operation.
+    pthread_mutex_t _write_lock; // Serialize the writers.
+    pthread_rwlock_t _rw_lock; // Shared by the readers, a writer takes it to change the skiplist.
+    
+    // The running checkpoint, guarded by _checkpoint_lock, which is taken before the writer lock.
+    pthread_mutex_t _checkpoint_lock;
+    pid_t _checkpoint_pid; // 0 means none.
+    unsigned long long _checkpoint_segment; // First segment after the checkpoint.
+    bool _checkpoint_failed; // The last checkpoint failed.
+    
+    // Keys changed after the last checkpoint, tracked after the first checkpoint.
+    struct KeyLess {
+        int (*cmp)(const KeyType&, const KeyType&);
+        explicit KeyLess(int (*cmp_fun)(const KeyType&, const KeyType&)) : cmp(cmp_fun) {}
+        bool operator()(const KeyType& left, const KeyType& right) const {
+            return cmp(left, right) < 0;
+        }
+    };
+    std::set<KeyType, KeyLess> _dirty;
+    bool _track_dirty; // A checkpoint exists for the next delta to follow.
+    unsigned long long _chain_lsn; // LSN of the last checkpoint or delta.
     
+    // LSM mode, see use_lsm.
+    bool _lsm;
+    size_t _memtable_entries; // Freeze the memtable after this number of entries.
+    int _merge_width; // Merge this number of tables of a tier.
+    SkipList<KeyType, ValType>* _frozen; // The memtable being flushed, protected by _write_lock.
+    unsigned long long _frozen_segment; // First log segment after the frozen memtable.
+    unsigned long long _frozen_lsn; // LSN of the last operation in the frozen memtable.
+    pthread_mutex_t _tables_lock; // Protect the fields below, taken after _write_lock.
+    pthread_cond_t _tables_cond; // Signaled when a memtable is frozen or flushed.
+    bool _flush_pending; // The frozen memtable is not flushed yet.
+    std::vector<std::shared_ptr<SSTable<KeyType, ValType> > > _tables; // From new to old.
+    unsigned long long _next_table; // Id of the next table file.
+    unsigned long long _table_segment; // The tables cover the log segments before this.
+    unsigned long long _table_lsn; // The tables cover the operations up to this LSN.
+    pthread_t _compactor;
+    bool _compactor_running;
+    bool _compactor_stop;
 };
 
 }
@@ -8,14 +8,15 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <unordered_map>
+#include <vector>
 #include "safesl.h"
-
-namespace {
-    
-char buffer[1024 * 1024 * 100]; // 100 MB.
-    
-} // End anoyomous namespace.
+#include "sstable.hpp"
 
 namespace skiplist {
 
@@ -30,359 +31,1812 @@ SafeSL<KeyType, ValType>::SafeSL(int (*cmp_fun)(const KeyType&, const KeyType&),
     SkipList<KeyType, ValType>(cmp_fun, key_to_str, level_in), 
     bin2key(parse_key_from_bin), bin2val(parse_val_from_bin), 
     key2bin(convert_key_to_bin), val2bin(convert_val_to_bin),
-    _log_path(log_path_in) {
-    _log_pointer = fopen(_log_path.c_str(), "ab+");
-    if (_log_pointer == nullptr) {
+    _log_path(log_path_in), _lsn(0), _checkpoint_pid(0), _checkpoint_segment(0), _checkpoint_failed(false),
+    _dirty(KeyLess(cmp_fun)), _track_dirty(false), _chain_lsn(0), 
+    _lsm(false), _memtable_entries(0), _merge_width(0), 
+    _frozen(nullptr), _frozen_segment(0), _frozen_lsn(0),
+    _flush_pending(false), _next_table(1), _table_segment(0), _table_lsn(0),
+    _compactor_running(false), _compactor_stop(false) {
+    pthread_mutex_init(&_write_lock, nullptr);
+    pthread_mutex_init(&_checkpoint_lock, nullptr);
+    _init_rw_lock(&_rw_lock);
+    pthread_mutex_init(&_tables_lock, nullptr);
+    pthread_cond_init(&_tables_cond, nullptr);
+    if (_log.open(_log_path, std::string(LOG_MAGIC, LOG_MAGIC_BYTES)) != 0) {
+        toscreen << "Initializing SafeSL failed. Cannot open the log file.\n";
+    }
+}
+
+template <typename KeyType, typename ValType>
+SafeSL<KeyType, ValType>::SafeSL(int (*cmp_fun)(const KeyType&, const KeyType&), 
+    std::string (*key_to_str)(const KeyType&), 
+    const std::string &log_path_in, int level_in) :
+    SkipList<KeyType, ValType>(cmp_fun, key_to_str, level_in), 
+    bin2key(nullptr), bin2val(nullptr), key2bin(nullptr), val2bin(nullptr),
+    _log_path(log_path_in), _lsn(0), _checkpoint_pid(0), _checkpoint_segment(0), _checkpoint_failed(false),
+    _dirty(KeyLess(cmp_fun)), _track_dirty(false), _chain_lsn(0), 
+    _lsm(false), _memtable_entries(0), _merge_width(0), 
+    _frozen(nullptr), _frozen_segment(0), _frozen_lsn(0),
+    _flush_pending(false), _next_table(1), _table_segment(0), _table_lsn(0),
+    _compactor_running(false), _compactor_stop(false) {
+    if (!Serializer<KeyType>::enabled || !Serializer<ValType>::enabled) {
+        toscreen << "Initializing SafeSL failed. No Serializer for the key or val, specialize it.\n";
+    }
+    pthread_mutex_init(&_write_lock, nullptr);
+    pthread_mutex_init(&_checkpoint_lock, nullptr);
+    _init_rw_lock(&_rw_lock);
+    pthread_mutex_init(&_tables_lock, nullptr);
+    pthread_cond_init(&_tables_cond, nullptr);
+    if (_log.open(_log_path, std::string(LOG_MAGIC, LOG_MAGIC_BYTES)) != 0) {
         toscreen << "Initializing SafeSL failed. Cannot open the log file.\n";
     }
 }
 
 template <typename KeyType, typename ValType>
 SafeSL<KeyType, ValType>::~SafeSL() {
-    if (_log_pointer != nullptr) {
-        fclose(_log_pointer);
+    checkpoint_status(true);
+    if (_compactor_running) {
+        // The frozen memtable is still in the log if it's not flushed.
+        pthread_mutex_lock(&_tables_lock);
+        _compactor_stop = true;
+        pthread_cond_broadcast(&_tables_cond);
+        pthread_mutex_unlock(&_tables_lock);
+        pthread_join(_compactor, nullptr);
     }
+    delete _frozen;
+    _tables.clear();
+    _log.close();
+    pthread_cond_destroy(&_tables_cond);
+    pthread_mutex_destroy(&_tables_lock);
+    pthread_rwlock_destroy(&_rw_lock);
+    pthread_mutex_destroy(&_checkpoint_lock);
+    pthread_mutex_destroy(&_write_lock);
 }
 
 template <typename KeyType, typename ValType>
 void SafeSL<KeyType, ValType>::land_log() {
-    fflush(_log_pointer);
+    _log.flush();
 }
 
 template <typename KeyType, typename ValType>
 int SafeSL<KeyType, ValType>::safe_get(const KeyType& key, ValType& val) {
-    return SkipList<KeyType, ValType>::get(key, val);
+    if (_lsm) {
+        return _lsm_get(key, val);
+    }
+    pthread_rwlock_rdlock(&_rw_lock);
+    int ret = SkipList<KeyType, ValType>::get(key, val);
+    pthread_rwlock_unlock(&_rw_lock);
+    return ret;
 }
 
 template <typename KeyType, typename ValType>
 int SafeSL<KeyType, ValType>::safe_set(const KeyType& key, const ValType& val) {
-    int ret = SkipList<KeyType, ValType>::set(key, val);
+    long long seq = 0;
+    int ret = async_set(key, val, seq);
     if (ret == 0) {
-        _write_to_log(TAG_SET, key, val);
+        return _commit_log(seq);
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::async_set(const KeyType& key, const ValType& val, long long& token) {
+    // Serialize out of the lock, each thread has its own buffer.
+    static thread_local std::string record;
+    record.clear();
+    _encode_record(record, TAG_SET, 0, time(0), key, val);
+    
+    pthread_mutex_lock(&_write_lock);
+    token = 0;
+    // Only the writers change the skiplist, so the check holds until the set below.
+    ValType old_val;
+    if (!_lsm && SkipList<KeyType, ValType>::get(key, old_val) >= 0) {
+        pthread_mutex_unlock(&_write_lock);
+        toscreen << "Key: " << SkipList<KeyType, ValType>::_tostr(key) << " already exists, set key failed.\n";
+        return 1;
+    }
+    // Log before applying, so a change that cannot be logged is never visible.
+    token = _write_to_log(record);
+    if (token == -1) {
+        pthread_mutex_unlock(&_write_lock);
+        toscreen << "Write the operation to log failed.\n";
+        return -1;
+    }
+    pthread_rwlock_wrlock(&_rw_lock);
+    int ret = _lsm ? _lsm_put(key, val, false) : SkipList<KeyType, ValType>::set(key, val);
+    pthread_rwlock_unlock(&_rw_lock);
+    if (ret != 0) {
+        token = _log_undo(key);
+    } else {
+        _mark_dirty(key);
+        if (_lsm) {
+            _maybe_freeze();
+        }
+    }
+    pthread_mutex_unlock(&_write_lock);
+    if (token == -1) {
+        toscreen << "Write the operation to log failed.\n";
+        return -1;
     }
     return ret;
 }
 
 template <typename KeyType, typename ValType>
 int SafeSL<KeyType, ValType>::safe_del(const KeyType& key) {
-    int ret = SkipList<KeyType, ValType>::del(key);
+    long long seq = 0;
+    int ret = async_del(key, seq);
     if (ret == 0) {
-        static ValType empty_val;
-        _write_to_log(TAG_DEL, key, empty_val);
+        return _commit_log(seq);
     }
     return ret;
 }
 
 template <typename KeyType, typename ValType>
-void SafeSL<KeyType, ValType>::_write_to_log(
-    Tags tag, const KeyType& key, const ValType& val) {
-    static int settag = static_cast<int>(TAG_SET);
-    static int deltag = static_cast<int>(TAG_DEL);
+int SafeSL<KeyType, ValType>::async_del(const KeyType& key, long long& token) {
+    static thread_local std::string record;
+    record.clear();
+    _encode_record(record, TAG_DEL, 0, time(0), key, ValType());
     
-    // Write time.
-    long cur_time = time(0);
-    if (fwrite(&cur_time, sizeof(long), 1, _log_pointer) != 1) {
-        toscreen << "Write time to log failed.\n";
-        return;
+    pthread_mutex_lock(&_write_lock);
+    token = 0;
+    ValType old_val;
+    if (_lsm ? (_lsm_get(key, old_val) != 0) : (SkipList<KeyType, ValType>::get(key, old_val) < 0)) {
+        pthread_mutex_unlock(&_write_lock);
+        return -1;
     }
-    
-    if (tag == TAG_SET) {
-        if (fwrite(&settag, sizeof(int), 1, _log_pointer) != 1) {
-            toscreen << "Write operation type failed.\n";
-            return;
-        }
-        if (_write_key(_log_pointer, key) != 0) {
-            toscreen << "Write key failed.\n";
-            return;
-        }
-        if (_write_val(_log_pointer, val) != 0) {
-            toscreen << "Write val failed.\n";
-            return;
+    // Log before applying, so a change that cannot be logged is never visible.
+    token = _write_to_log(record);
+    if (token == -1) {
+        pthread_mutex_unlock(&_write_lock);
+        toscreen << "Write the operation to log failed.\n";
+        return -1;
+    }
+    pthread_rwlock_wrlock(&_rw_lock);
+    int ret = _lsm ? _lsm_put(key, ValType(), true) : SkipList<KeyType, ValType>::del(key);
+    pthread_rwlock_unlock(&_rw_lock);
+    if (ret != 0) {
+        token = _log_undo(key);
+    } else {
+        _mark_dirty(key);
+        if (_lsm) {
+            _maybe_freeze();
         }
-    } else if (tag == TAG_DEL) {
-        if (fwrite(&deltag, sizeof(int), 1, _log_pointer) != 1) {
-            toscreen << "Write operation type failed.\n";
-            return;
+    }
+    pthread_mutex_unlock(&_write_lock);
+    if (token == -1) {
+        toscreen << "Write the operation to log failed.\n";
+        return -1;
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::wait_log(long long token) {
+    if (token == -1 || _log.wait_synced(token) != 0) {
+        toscreen << "Sync the log failed.\n";
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::safe_write(const WriteBatch<KeyType, ValType>& batch) {
+    long long seq = 0;
+    int ret = async_write(batch, seq);
+    if (seq > 0 && _commit_log(seq) != 0) {
+        return -1;
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::async_write(const WriteBatch<KeyType, ValType>& batch, long long& token) {
+    token = 0;
+    if (batch._ops.empty()) {
+        return 0;
+    }
+    // Sort out of the lock, and keep the last operation of each key.
+    std::vector<BatchOp<KeyType, ValType> > ops(batch._ops);
+    std::stable_sort(ops.begin(), ops.end(), 
+        [this](const BatchOp<KeyType, ValType>& left, const BatchOp<KeyType, ValType>& right) {
+            return SkipList<KeyType, ValType>::_cmp(left.key, right.key) < 0;
+        });
+    size_t kept = 0;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (i + 1 < ops.size() && SkipList<KeyType, ValType>::_cmp(ops[i].key, ops[i + 1].key) == 0) {
+            continue;
         }
-        if (_write_key(_log_pointer, key) != 0) {
-            toscreen << "Write key failed.\n";
-            return;
+        if (kept != i) {
+            std::swap(ops[kept], ops[i]);
         }
-    } else {
-        toscreen << "Unknown operation type when writting to log: " << tag << ".\n";
+        ++kept;
+    }
+    ops.resize(kept);
+    static thread_local std::string record;
+    record.clear();
+    _encode_batch(record, 0, time(0), ops);
+    
+    // Log before applying, as async_set does.
+    pthread_mutex_lock(&_write_lock);
+    token = _write_to_log(record);
+    if (token == -1) {
+        pthread_mutex_unlock(&_write_lock);
+        toscreen << "Write the batch to log failed.\n";
+        return -1;
+    }
+    pthread_rwlock_wrlock(&_rw_lock);
+    int ret = _apply_batch(ops);
+    pthread_rwlock_unlock(&_rw_lock);
+    if (ret != 0) {
+        // Some set failed, log the state of the keys so the replay skips the failed ones.
+        token = _log_undo(ops);
     }
-    return;
+    if (_lsm) {
+        _maybe_freeze();
+    }
+    pthread_mutex_unlock(&_write_lock);
+    if (token == -1) {
+        toscreen << "Write the batch to log failed.\n";
+        return -1;
+    }
+    if (ret != 0) {
+        toscreen << "Some operations of the batch failed.\n";
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+long long SafeSL<KeyType, ValType>::_write_to_log(std::string& record) {
+    // The LSN is the first field of the payload, the CRC covers it.
+    unsigned long long lsn = ++_lsn;
+    memcpy(&record[0] + sizeof(LogRecordHeader), &lsn, sizeof(unsigned long long));
+    _seal_record(record, 0);
+    return _log.append(record.data(), record.size());
+}
+
+template <typename KeyType, typename ValType>
+long long SafeSL<KeyType, ValType>::_log_undo(const KeyType& key) {
+    // Applying fails only when allocating the node fails, the key keeps its former state.
+    static thread_local std::string record;
+    ValType val;
+    bool found = _lsm ? (_lsm_get(key, val) == 0) : (SkipList<KeyType, ValType>::get(key, val) >= 0);
+    record.clear();
+    _encode_record(record, found ? TAG_SET : TAG_DEL, 0, time(0), key, found ? val : ValType());
+    return _write_to_log(record);
+}
+
+template <typename KeyType, typename ValType>
+long long SafeSL<KeyType, ValType>::_log_undo(const std::vector<BatchOp<KeyType, ValType> >& ops) {
+    std::vector<BatchOp<KeyType, ValType> > state(ops.size());
+    for (size_t i = 0; i < ops.size(); ++i) {
+        state[i].key = ops[i].key;
+        state[i].deleted = _lsm ? (_lsm_get(ops[i].key, state[i].val) != 0) : 
+            (SkipList<KeyType, ValType>::get(ops[i].key, state[i].val) < 0);
+    }
+    std::string record;
+    _encode_batch(record, 0, time(0), state);
+    return _write_to_log(record);
+}
+
+template <typename KeyType, typename ValType>
+void SafeSL<KeyType, ValType>::_init_rw_lock(pthread_rwlock_t* lock) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+template <typename KeyType, typename ValType>
+size_t SafeSL<KeyType, ValType>::size() {
+    if (_lsm) {
+        return _lsm_scan(nullptr, [](const KeyType&, const ValType&) {
+            return true;
+        });
+    }
+    pthread_rwlock_rdlock(&_rw_lock);
+    size_t res = SkipList<KeyType, ValType>::size();
+    pthread_rwlock_unlock(&_rw_lock);
+    return res;
+}
+
+template <typename KeyType, typename ValType>
+size_t SafeSL<KeyType, ValType>::compact(size_t budget) {
+    if (_lsm) {
+        return 0;
+    }
+    pthread_mutex_lock(&_write_lock);
+    pthread_rwlock_wrlock(&_rw_lock);
+    size_t res = SkipList<KeyType, ValType>::compact(budget);
+    pthread_rwlock_unlock(&_rw_lock);
+    pthread_mutex_unlock(&_write_lock);
+    return res;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_commit_log(long long seq) {
+    if (seq == -1 || _log.commit(seq) != 0) {
+        toscreen << "Write the operation to log failed.\n";
+        return -1;
+    }
+    return 0;
 }
 
 template <typename KeyType, typename ValType>
 int SafeSL<KeyType, ValType>::restore(
     const std::string& log_file, 
     const std::string& dump_file) {
-        
-    int ret = 0;
-    long last_dump_time = 0;
-    FILE *dump = nullptr;
+    return restore(log_file, dump_file, std::vector<std::string>());
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::restore(const std::string& log_file, const std::string& dump_file,
+    const std::vector<std::string>& delta_files) {
+    pthread_mutex_lock(&_write_lock);
+    pthread_rwlock_wrlock(&_rw_lock);
+    int ret = _restore(log_file, dump_file, delta_files);
+    pthread_rwlock_unlock(&_rw_lock);
+    pthread_mutex_unlock(&_write_lock);
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_restore(const std::string& log_file, const std::string& dump_file,
+    const std::vector<std::string>& delta_files) {
     
-    // Open dump file, get the last_dump_time.
-    // Restore the status at last_dump_time.
-    if (dump_file != "NOFILE") {
-        dump = fopen(dump_file.c_str(), "rb");
+    DumpHeader header; // Segment or LSN 0 means the dump doesn't know them.
+    
+    // Restore the status at the dump, or at the tables in LSM mode.
+    if (_lsm) {
+        if (dump_file != "NOFILE") {
+            toscreen << "The dump is ignored in LSM mode, the log is replayed after the tables.\n";
+        }
+        header.segment = _table_segment;
+        header.lsn = _table_lsn;
+        _lsn = header.lsn;
+    } else if (dump_file != "NOFILE") {
+        FILE* dump = fopen(dump_file.c_str(), "rb");
         if (dump == nullptr) {
             toscreen << "Dump file: " << dump_file << " cannot be opened.\n";
-            fclose(dump);
             return -1;
         }
-        ret = fread(buffer, sizeof(long), 1, dump);
-        if (ret != 1) {
+        if (_read_dump_header(dump, header) != 0 || header.delta) {
             toscreen << "Dump file: " << dump_file << " has wrong format.\n";
             fclose(dump);
             return -1;
         }
-        memcpy(&last_dump_time, buffer, sizeof(long));
-        _parse_from_file(dump);
-    }
-    
-    // According to the logfile, modify the skiplist.
-    FILE* log = fopen(log_file.c_str(), "rb");
-    if (log == nullptr) {
-        toscreen << "Logfile: " << log_file << " cannot be opened.\n";
-    }
-    
-    // Buffers.
-    long log_time;
-    KeyType key_buffer;
-    ValType val_buffer;
-    int operation_buffer;
-    long valid_log_start = -1; // Logs before this position are expired logs.
-    unsigned long valid_datas = 0;
-    unsigned long handled_lines = 0;
-    
-    // Read logs one by one.
-    while (fread(&log_time, sizeof(long), 1, log) == 1) {
-        ++handled_lines;
-        static bool do_this_log;
-        if (log_time <= last_dump_time) { // If this log is expired, do not manipulate by this log.
-            do_this_log = false;
-        } else {
-            do_this_log = true;
+        int ret = _parse_from_file(dump, header);
+        fclose(dump);
+        if (ret != 0) {
+            toscreen << "Dump file: " << dump_file << " is broken, cannot restore.\n";
+            return -1;
         }
+        _lsn = header.lsn;
         
-        if (do_this_log && valid_log_start == -1) {
-            // The log is valid from here to the end.
-            // Logs before this position are expired.
-            valid_log_start = ftell(log) - sizeof(long);
+        // Each delta follows the former checkpoint.
+        for (size_t i = 0; i < delta_files.size(); ++i) {
+            DumpHeader delta_header;
+            FILE* delta = fopen(delta_files[i].c_str(), "rb");
+            if (delta == nullptr || _read_dump_header(delta, delta_header) != 0 || !delta_header.delta) {
+                toscreen << "Delta file: " << delta_files[i] << " cannot be read.\n";
+                if (delta != nullptr) {
+                    fclose(delta);
+                }
+                return -1;
+            }
+            if (delta_header.base_lsn != header.lsn) {
+                toscreen << "Delta file: " << delta_files[i] << " doesn't follow the former checkpoint.\n";
+                fclose(delta);
+                return -1;
+            }
+            int ret = _parse_blocks(delta, delta_header);
+            fclose(delta);
+            if (ret != 0) {
+                return -1;
+            }
+            header = delta_header;
+            _lsn = header.lsn;
         }
-        
-        if (do_this_log) {
-            ++valid_datas;
+        // Later deltas follow the restored checkpoint, the replayed keys are marked dirty.
+        if (header.lsn != 0) {
+            _dirty.clear();
+            _track_dirty = true;
+            _chain_lsn = header.lsn;
         }
-        
-        // Read operation type.
-        if (fread(&operation_buffer, sizeof(int), 1, log) != 1) {
-            toscreen << "Read the operation type failed.\n";
-            fclose(dump);
-            fclose(log);
+    }
+    
+    unsigned long handled_lines = 0;
+    unsigned long valid_datas = 0;
+    
+    // A log file written by former versions, replay it before the segments.
+    std::string legacy_records;
+    bool has_legacy = (access(log_file.c_str(), F_OK) == 0);
+    if (has_legacy && _replay_legacy_log(log_file, header.time, 
+        legacy_records, handled_lines, valid_datas) != 0) {
+        return -1;
+    }
+    unsigned long legacy_datas = valid_datas;
+    
+    // Replay the segments not covered by the dump.
+    unsigned long long first = 0;
+    unsigned long long last = 0;
+    if (LogWriter::read_manifest(log_file, first, last) == 0) {
+        if (header.segment != 0 && header.segment < first) {
+            toscreen << "Log segments after the dump were removed, cannot restore.\n";
             return -1;
         }
-        
-        // Manpulate according to the operation type.
-        if (operation_buffer == TAG_SET) {
-            // Read Key.
-            if (_read_key(log, key_buffer) != 0) {
-                fclose(dump);
-                fclose(log);
+        if (header.segment > last) {
+            toscreen << "The dump is newer than the log, maybe they are not from the same SafeSL.\n";
+        }
+        // Segments at or after the segment of the dump are all after the dump.
+        // Records with LSN are exactly filtered by the LSN of the dump.
+        ReplayFilter filter;
+        filter.min_lsn = header.lsn;
+        filter.min_time = (header.segment == 0) ? header.time : 0;
+        for (unsigned long long i = (header.segment == 0 ? first : header.segment); i <= last; ++i) {
+            std::string path = LogWriter::segment_path(log_file, i);
+            std::string data;
+            if (_read_file(path, data) != 0 || data.size() < LOG_MAGIC_BYTES) {
+                toscreen << "Log segment: " << path << " is missing or broken, cannot restore.\n";
                 return -1;
             }
-            
-            // Read Val.
-            if (_read_val(log, val_buffer) != 0) {
-                fclose(dump);
-                fclose(log);
+            if (memcmp(data.data(), LOG_MAGIC, LOG_MAGIC_BYTES) == 0) {
+                filter.has_lsn = true;
+            } else if (memcmp(data.data(), LOG_MAGIC_V2, LOG_MAGIC_BYTES) == 0) {
+                filter.has_lsn = false;
+            } else {
+                toscreen << "Log segment: " << path << " has unknown format, cannot restore.\n";
                 return -1;
             }
-            
-            // Call set.
-            // It should not be fail. Since only successful operation woudle be written to log.
-            if (do_this_log && SkipList<KeyType, ValType>::set(key_buffer, val_buffer) != 0) {
-                toscreen << "Set when restore failed. Key: " << key_buffer
-                    << " Val: " << val_buffer << ".\n";
+            size_t end = _replay_records(data, LOG_MAGIC_BYTES, filter, 
+                nullptr, handled_lines, valid_datas);
+            if (end == data.size()) {
+                continue;
             }
-        } else if (operation_buffer == TAG_DEL) {
-            // Read Key.
-            if (_read_key(log, key_buffer) != 0) {
-                fclose(dump);
-                fclose(log);
+            // Torn record, the writer stopped here. Only the last segment may be torn,
+            // records after a gap would be lost silently, and new ones appended after it.
+            if (i != last) {
+                toscreen << "Log segment: " << path << " is torn before the last segment, cannot restore.\n";
                 return -1;
             }
-            
-            // Call del.
-            if (do_this_log && SkipList<KeyType, ValType>::del(key_buffer) != 0) {
-                toscreen << "Del when restore failed. Key: " << key_buffer << ".\n";
+            toscreen << "Drop the torn tail of log segment: " << path << ", " 
+                << data.size() - end << " bytes.\n";
+            if (_log.truncate_segment(log_file, i, end) != 0) {
+                toscreen << "Truncate the log segment failed.\n";
+                return -1;
             }
-        } else {
-            toscreen << "Unknown log operation type: " << operation_buffer << ". Stop.\n";
-            --valid_datas;
-            fclose(dump);
-            fclose(log);
-            return -1;
         }
     }
     
-    // Remove the unvalid logs from the log file.
-    // Close the file.
-    if (valid_log_start == -1) { // All logs are invalid, clean the log file.
-        fclose(log);
-        log = fopen(log_file.c_str(), "wb");
-        if (log != nullptr) {
-            fclose(log);
-        }
-    } else { // Some part of logs is valid, clean the invalid part.
-        fseek(log, 0L, SEEK_END);
-        long file_size = ftell(log);
-        fseek(log, valid_log_start, SEEK_SET);
-        if (fread(buffer, file_size - valid_log_start, 1, log) == 1) {
-            fclose(log);
-            log = fopen(log_file.c_str(), "wb");
-            if (log != nullptr) {
-                fwrite(buffer, file_size - valid_log_start, 1, log);
-                fclose(log);
-            } else {
-                toscreen << "Write to log file failed.\n";
-            }
+    // Move the legacy records into the segments if nothing follows them.
+    if (has_legacy && log_file == _log_path) {
+        if (valid_datas != legacy_datas) {
+            toscreen << "Log segments are not empty, keep the legacy log: " << log_file << ".\n";
         } else {
-            toscreen << "Valid logs part read error.\n";
+            long long seq = _log.append(legacy_records.data(), legacy_records.size());
+            if (seq == -1 || _log.sync() != 0) {
+                toscreen << "Move the legacy log to segments failed.\n";
+                return -1;
+            }
+            unlink(log_file.c_str());
         }
-    }        
+    }
     
-    fclose(dump);
-    fclose(log);
     toscreen << "Restore finished. Read: " << handled_lines << " operations."
         << " Valid operation num: " << valid_datas << ".\n";
     return 0;
 }
 
 template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::_read_key(FILE* file, KeyType& key) {
-    static Binary bin_buffer; // Tag of this Binary is TAG_POINTER.
-    // Read the size of key.
-    if (fread(&bin_buffer.bytes, sizeof(size_t), 1, file) != 1) { // File is OVER.
-        return 1;
-    }
-    // Read the content of key.
-    if (fread(buffer, bin_buffer.bytes, 1, file) != 1) {
-        toscreen << "Read the key failed.\n";
-        return -1;
+size_t SafeSL<KeyType, ValType>::_replay_records(const std::string& data, size_t pos, 
+    const ReplayFilter& filter, std::string* valid_records, 
+    unsigned long& handled_lines, unsigned long& valid_datas) {
+    KeyType key_buffer;
+    ValType val_buffer;
+    unsigned long long lsn = 0;
+    long log_time;
+    Tags tag;
+    std::vector<BatchOp<KeyType, ValType> > batch;
+    
+    // Each record is checked by its length and CRC before decoding.
+    while (data.size() - pos >= sizeof(LogRecordHeader)) {
+        LogRecordHeader header;
+        memcpy(&header, data.data() + pos, sizeof(LogRecordHeader));
+        if (header.length > data.size() - pos - sizeof(LogRecordHeader) ||
+            crc32c(0, data.data() + pos + sizeof(uint32_t), 
+                sizeof(uint32_t) + header.length) != header.crc) {
+            break;
+        }
+        const char* payload = data.data() + pos + sizeof(LogRecordHeader);
+        if (_decode_record(payload, header.length, filter.has_lsn, 
+            lsn, log_time, tag, key_buffer, val_buffer, &batch) != 0) {
+            toscreen << "Undecodable log record at position: " << pos << ". Stop.\n";
+            break;
+        }
+        ++handled_lines;
+        if (filter.has_lsn ? lsn > filter.min_lsn : log_time > filter.min_time) {
+            // If this log is expired, do not manipulate by this log.
+            ++valid_datas;
+            if (tag == TAG_BATCH && _apply_batch(batch) != 0) {
+                toscreen << "Replay the batch at position: " << pos << " failed.\n";
+            } else if (tag != TAG_BATCH) {
+                _apply_record(tag, key_buffer, val_buffer);
+            }
+            // Records without LSN get new ones.
+            lsn = filter.has_lsn ? lsn : _lsn + 1;
+            if (valid_records != nullptr && tag == TAG_BATCH) {
+                _encode_batch(*valid_records, lsn, log_time, batch);
+            } else if (valid_records != nullptr) {
+                _encode_record(*valid_records, tag, lsn, log_time, key_buffer, val_buffer);
+            }
+            if (lsn > _lsn) {
+                _lsn = lsn;
+            }
+        }
+        pos += sizeof(LogRecordHeader) + header.length;
     }
-    bin_buffer.data = buffer;
-    // Convert the binary to key.
-    bin2key(key, bin_buffer);
-    return 0;
+    return pos;
 }
 
 template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::_read_val(FILE* file, ValType& val) {
-    static Binary bin_buffer; // Tag of this Binary is TAG_POINTER.
-    // Read the size of val.
-    if (fread(&bin_buffer.bytes, sizeof(size_t), 1, file) != 1) { // File is OVER.
-        return 1;
-    }
-    // Read the content of val.
-    if (fread(buffer, bin_buffer.bytes, 1, file) != 1) {
-        toscreen << "Read the val failed.\n";
+int SafeSL<KeyType, ValType>::_replay_legacy_log(const std::string& log_file, long min_time,
+    std::string& valid_records, unsigned long& handled_lines, unsigned long& valid_datas) {
+    std::string data;
+    if (_read_file(log_file, data) != 0) {
         return -1;
     }
-    bin_buffer.data = buffer;
-    // Convert the binary to key.
-    bin2val(val, bin_buffer);
-    return 0;
-}
-
-template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::_write_key(FILE* file, const KeyType& key) {
-    static Binary bin_buffer; // Tag of this Binary is TAG_COPY.
-    key2bin(key, bin_buffer);
-    if (fwrite(&bin_buffer.bytes, sizeof(size_t), 1, file) != 1 ||
-        fwrite(bin_buffer.data, bin_buffer.bytes, 1, file) != 1) {
-        toscreen << "Write key failed.\n";
-        return -1;
+    
+    // A single log file of framed records.
+    if (data.size() >= LOG_MAGIC_BYTES && memcmp(data.data(), LOG_MAGIC_V2, LOG_MAGIC_BYTES) == 0) {
+        ReplayFilter filter;
+        filter.min_time = min_time;
+        _replay_records(data, LOG_MAGIC_BYTES, filter, &valid_records, handled_lines, valid_datas);
+        return 0;
+    }
+    
+    // Record without header: [LOG_TIME][OPERATION_TAG][KEY_BYTES][KEY][VAL_BYTES][VAL].
+    // The valid records are converted to the framed format.
+    size_t pos = 0;
+    KeyType key_buffer;
+    ValType val_buffer;
+    long log_time;
+    int operation_buffer;
+    while (data.size() - pos >= sizeof(long) + sizeof(int)) {
+        memcpy(&log_time, data.data() + pos, sizeof(long));
+        memcpy(&operation_buffer, data.data() + pos + sizeof(long), sizeof(int));
+        size_t record_pos = pos;
+        pos += sizeof(long) + sizeof(int);
+        if (operation_buffer != TAG_SET && operation_buffer != TAG_DEL) {
+            toscreen << "Unknown log operation type: " << operation_buffer << ". Stop.\n";
+            break;
+        }
+        Binary bin; // Tag of this Binary is TAG_POINTER.
+        if (_read_bin(data.data(), data.size(), pos, bin) != 0) {
+            toscreen << "Read the key at position: " << record_pos << " failed. Stop.\n";
+            break;
+        }
+        if (_parse_obj(key_buffer, bin, bin2key) != 0) {
+            toscreen << "Parse the key at position: " << record_pos << " failed. Stop.\n";
+            break;
+        }
+        if (operation_buffer == TAG_SET) {
+            if (_read_bin(data.data(), data.size(), pos, bin) != 0 ||
+                _parse_obj(val_buffer, bin, bin2val) != 0) {
+                toscreen << "Read the val at position: " << record_pos << " failed. Stop.\n";
+                break;
+            }
+        }
+        ++handled_lines;
+        if (log_time > min_time) {
+            ++valid_datas;
+            _apply_record(static_cast<Tags>(operation_buffer), key_buffer, val_buffer);
+            _encode_record(valid_records, static_cast<Tags>(operation_buffer), 
+                ++_lsn, log_time, key_buffer, val_buffer);
+        }
     }
     return 0;
 }
 
 template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::_write_val(FILE* file, const ValType& val) {
-    static Binary bin_buffer; // Tag of this Binary is TAG_COPY.
-    val2bin(val, bin_buffer);
-    if (fwrite(&bin_buffer.bytes, sizeof(size_t), 1, file) != 1 ||
-        fwrite(bin_buffer.data, bin_buffer.bytes, 1, file) != 1) {
-        toscreen << "Write val failed.\n";
-        return -1;
-    }
-    return 0;
+int SafeSL<KeyType, ValType>::parallel_restore(const std::string& log_file, 
+    const std::string& dump_file, int threads, const std::vector<std::string>& delta_files) {
+    pthread_mutex_lock(&_write_lock);
+    pthread_rwlock_wrlock(&_rw_lock);
+    int ret = _parallel_restore(log_file, dump_file, threads, delta_files);
+    pthread_rwlock_unlock(&_rw_lock);
+    pthread_mutex_unlock(&_write_lock);
+    return ret;
 }
 
 template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::dump_to_file(const std::string& dump_path) {
-    FILE* dump = fopen(dump_path.c_str(), "wb");
-    if (dump == nullptr) {
-        toscreen << "Cannot open the dump file, dump failed: " << dump_path << ".\n";
-        return -1;
+int SafeSL<KeyType, ValType>::_parallel_restore(const std::string& log_file, 
+    const std::string& dump_file, int threads, const std::vector<std::string>& delta_files) {
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (threads <= 0) ? 1 : threads;
     }
-    long cur_time = time(0);
-    if (fwrite(&cur_time, sizeof(long), 1, dump) != 1) {
-        toscreen << "Write current time failed. Cannot dump to file.\n";
-        fclose(dump);
-        return -1;
+    // The bulk load needs an empty skiplist, and logs of former versions need the time filter.
+    if (_lsm || SkipList<KeyType, ValType>::_length != 0 || access(log_file.c_str(), F_OK) == 0) {
+        return _restore(log_file, dump_file, delta_files);
     }
-    long dump_num = 0;
-    for (Node<KeyType, ValType>* x = SkipList<KeyType, ValType>::_head; x != nullptr; x = x->levels[0].forward) {
-        if (x == SkipList<KeyType, ValType>::_head) {
-            continue;
+    
+    // Locate the records or blocks of the dump, only the length fields are read.
+    DumpHeader header;
+    unsigned long long dump_segment = 0; // Of the last checkpoint of the chain.
+    unsigned long long dump_lsn = 0;
+    MappedFile dump;
+    std::vector<size_t> dump_records;
+    size_t trailer = 0; // Position of the trailer after the blocks.
+    if (dump_file != "NOFILE") {
+        size_t pos = 0;
+        if (dump.map(dump_file) != 0) {
+            toscreen << "Dump file: " << dump_file << " cannot be opened.\n";
+            return -1;
         }
-        if (_write_record(dump, x->key, x->val) != 0) {
-            toscreen << "Write record failed.\n";
-            fclose(dump);
+        if (_parse_dump_header(dump.data, dump.bytes, pos, header) != 0) {
+            toscreen << "Dump file: " << dump_file << " has wrong format.\n";
             return -1;
         }
-        ++dump_num;
+        if (header.segment == 0 || header.delta) {
+            return _restore(log_file, dump_file, delta_files);
+        }
+        trailer = dump.bytes;
+        while (pos < dump.bytes) {
+            size_t start = pos;
+            bool is_trailer = false;
+            if (header.version >= 4) {
+                DumpBlockHeader block;
+                if (dump.bytes - pos < sizeof(DumpBlockHeader)) {
+                    pos = dump.bytes + 1;
+                } else {
+                    memcpy(&block, dump.data + pos, sizeof(DumpBlockHeader));
+                    pos += sizeof(DumpBlockHeader) + block.stored_bytes;
+                    is_trailer = (block.raw_bytes == 0);
+                }
+            } else {
+                Binary bin; // Tag of this Binary is TAG_POINTER.
+                if (_read_bin(dump.data, dump.bytes, pos, bin) != 0 ||
+                    _read_bin(dump.data, dump.bytes, pos, bin) != 0) {
+                    pos = dump.bytes + 1;
+                }
+            }
+            if (pos > dump.bytes) {
+                toscreen << "Dump file: " << dump_file << " is broken at position: " << start << ".\n";
+                return -1;
+            }
+            if (is_trailer) {
+                trailer = start;
+                break;
+            }
+            dump_records.push_back(start);
+        }
+        if (header.version >= 5 && trailer == dump.bytes) {
+            toscreen << "Dump file: " << dump_file << " is truncated, the trailer is missing.\n";
+            return -1;
+        }
+        dump_segment = header.segment;
+        dump_lsn = header.lsn;
     }
     
-    if (dump_num != SkipList<KeyType, ValType>::_length) {
-        toscreen << "Dump number unmatched.\n";
-        fclose(dump);
-        return -1;
-    }
-    fclose(dump);
-    toscreen << "Dump to file finished. Totally dump " << dump_num << " nodes.\n";
-    return 0;
-}
-
-template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::_write_record(FILE* file, const KeyType& key, const ValType& val) {
-    if (_write_key(file, key) != 0) {
-        return -1;
-    }
-    if (_write_val(file, val) != 0) {
-        return -1;
+    // Read each delta following the former checkpoint, deltas only have the changed keys.
+    std::vector<std::vector<std::pair<KeyType, ValType> > > delta_entries(delta_files.size());
+    std::vector<std::vector<char> > delta_deleted(delta_files.size());
+    for (size_t i = 0; dump_file != "NOFILE" && i < delta_files.size(); ++i) {
+        DumpHeader delta_header;
+        FILE* delta = fopen(delta_files[i].c_str(), "rb");
+        if (delta == nullptr || _read_dump_header(delta, delta_header) != 0 || !delta_header.delta) {
+            toscreen << "Delta file: " << delta_files[i] << " cannot be read.\n";
+            if (delta != nullptr) {
+                fclose(delta);
+            }
+            return -1;
+        }
+        if (delta_header.base_lsn != dump_lsn) {
+            toscreen << "Delta file: " << delta_files[i] << " doesn't follow the former checkpoint.\n";
+            fclose(delta);
+            return -1;
+        }
+        std::string stored;
+        std::string raw;
+        std::vector<std::pair<KeyType, ValType> > entries;
+        std::vector<char> deleted;
+        unsigned long long records = 0;
+        int ret;
+        while ((ret = _next_block(delta, delta_header, stored, raw, entries, &deleted, records)) == 0) {
+            delta_entries[i].insert(delta_entries[i].end(), entries.begin(), entries.end());
+            delta_deleted[i].insert(delta_deleted[i].end(), deleted.begin(), deleted.end());
+        }
+        fclose(delta);
+        if (ret == -1) {
+            toscreen << "Delta file: " << delta_files[i] << " is broken or truncated.\n";
+            return -1;
+        }
+        dump_segment = delta_header.segment;
+        dump_lsn = delta_header.lsn;
     }
-    return 0;
-}
-
-template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::_read_record(FILE* file, KeyType& key, ValType& val) {
-    static int ret = -10;
     
-    ret = _read_key(file, key);
-    if (ret == -1) { // Read error.
-        return -1;
-    } else if (ret == 1) { // Finish read.
-        return 1;
+    // Locate the records of the log segments after the dump.
+    unsigned long long first = 0;
+    unsigned long long last = 0;
+    std::deque<MappedFile> segments;
+    std::vector<std::pair<size_t, size_t> > records; // Segment index and position of each record.
+    std::pair<size_t, size_t> torn(0, 0); // Where the intact records end, segment 0 means none.
+    if (LogWriter::read_manifest(log_file, first, last) == 0) {
+        if (dump_segment != 0 && dump_segment < first) {
+            toscreen << "Log segments after the dump were removed, cannot restore.\n";
+            return -1;
+        }
+        for (unsigned long long i = (dump_segment == 0 ? first : dump_segment); i <= last; ++i) {
+            std::string path = LogWriter::segment_path(log_file, i);
+            segments.emplace_back();
+            MappedFile& segment = segments.back();
+            if (segment.map(path) != 0 || segment.bytes < LOG_MAGIC_BYTES) {
+                toscreen << "Log segment: " << path << " is missing or broken, cannot restore.\n";
+                return -1;
+            }
+            if (memcmp(segment.data, LOG_MAGIC_V2, LOG_MAGIC_BYTES) == 0) {
+                return _restore(log_file, dump_file, delta_files);
+            }
+            if (memcmp(segment.data, LOG_MAGIC, LOG_MAGIC_BYTES) != 0) {
+                toscreen << "Log segment: " << path << " has unknown format, cannot restore.\n";
+                return -1;
+            }
+            size_t pos = LOG_MAGIC_BYTES;
+            while (segment.bytes - pos >= sizeof(LogRecordHeader)) {
+                LogRecordHeader header;
+                memcpy(&header, segment.data + pos, sizeof(LogRecordHeader));
+                if (header.length > segment.bytes - pos - sizeof(LogRecordHeader)) {
+                    break;
+                }
+                records.push_back(std::make_pair(segments.size() - 1, pos));
+                pos += sizeof(LogRecordHeader) + header.length;
+            }
+            if (pos != segment.bytes) {
+                torn = std::make_pair(segments.size(), pos);
+                break;
+            }
+        }
+    }
+    
+    // Decode the dump in parallel chunks, each block is decoded as a whole.
+    std::vector<std::pair<KeyType, ValType> > base(header.version >= 4 ? 0 : dump_records.size());
+    std::vector<std::vector<std::pair<KeyType, ValType> > > blocks(
+        header.version >= 4 ? dump_records.size() : 0);
+    std::vector<size_t> dump_bad(threads, dump_records.size());
+    _parallel_run(threads, [&](int index) {
+        size_t end = dump_records.size() * (index + 1) / threads;
+        std::string raw;
+        for (size_t i = dump_records.size() * index / threads; i < end; ++i) {
+            size_t pos = dump_records[i];
+            if (header.version >= 4) {
+                DumpBlockHeader block;
+                memcpy(&block, dump.data + pos, sizeof(DumpBlockHeader));
+                if (_unpack_block(block, dump.data + pos + sizeof(DumpBlockHeader), raw) != 0 ||
+                    _decode_block(raw, block.entries, header.key_encoding, blocks[i]) != 0) {
+                    dump_bad[index] = i;
+                    break;
+                }
+                continue;
+            }
+            Binary bin; // Tag of this Binary is TAG_POINTER.
+            _read_bin(dump.data, dump.bytes, pos, bin);
+            int ret = _parse_obj(base[i].first, bin, bin2key);
+            _read_bin(dump.data, dump.bytes, pos, bin);
+            if (ret != 0 || _parse_obj(base[i].second, bin, bin2val) != 0) {
+                dump_bad[index] = i;
+                break;
+            }
+        }
+    });
+    size_t bad = *std::min_element(dump_bad.begin(), dump_bad.end());
+    if (bad != dump_records.size()) {
+        toscreen << "Dump file: " << dump_file << " is broken at position: " << dump_records[bad] << ".\n";
+        return -1;
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        base.insert(base.end(), blocks[i].begin(), blocks[i].end());
+        std::vector<std::pair<KeyType, ValType> >().swap(blocks[i]);
+    }
+    if (header.version >= 5) {
+        DumpBlockHeader block;
+        memcpy(&block, dump.data + trailer, sizeof(DumpBlockHeader));
+        if (_check_trailer(block, dump.data + trailer + sizeof(DumpBlockHeader), base.size()) != 0) {
+            toscreen << "Dump file: " << dump_file << " doesn't have the entries its trailer records.\n";
+            return -1;
+        }
+    }
+    // Apply the deltas in order, their keys replace or delete those of the former checkpoint.
+    for (size_t i = 0; i < delta_entries.size(); ++i) {
+        std::vector<std::pair<KeyType, ValType> > merged;
+        merged.reserve(base.size() + delta_entries[i].size());
+        size_t base_pos = 0;
+        for (size_t j = 0; j < delta_entries[i].size(); ++j) {
+            const KeyType& key = delta_entries[i][j].first;
+            while (base_pos < base.size() && SkipList<KeyType, ValType>::_cmp(base[base_pos].first, key) < 0) {
+                merged.push_back(base[base_pos++]);
+            }
+            if (base_pos < base.size() && SkipList<KeyType, ValType>::_cmp(base[base_pos].first, key) == 0) {
+                ++base_pos;
+            }
+            if (!delta_deleted[i][j]) {
+                merged.push_back(delta_entries[i][j]);
+            }
+        }
+        merged.insert(merged.end(), base.begin() + base_pos, base.end());
+        base.swap(merged);
+        std::vector<std::pair<KeyType, ValType> >().swap(delta_entries[i]);
+    }
+    
+    // Check and decode the log records in parallel chunks.
+    // A record failing the check ends the intact records.
+    // Each chunk also sorts its operations into the hash partitions of their keys,
+    // so a partition only walks its own operations later.
+    std::vector<ReplayOp> ops(records.size());
+    std::vector<size_t> first_bad(threads, records.size());
+    std::vector<std::vector<std::vector<size_t> > > chunk_parts(threads, 
+        std::vector<std::vector<size_t> >(threads));
+    _parallel_run(threads, [&](int index) {
+        size_t end = records.size() * (index + 1) / threads;
+        std::vector<BatchOp<KeyType, ValType> > batch;
+        for (size_t i = records.size() * index / threads; i < end; ++i) {
+            const char* frame = segments[records[i].first].data + records[i].second;
+            LogRecordHeader header;
+            memcpy(&header, frame, sizeof(LogRecordHeader));
+            const char* payload = frame + sizeof(LogRecordHeader);
+            ReplayOp& op = ops[i];
+            long log_time;
+            if (crc32c(0, frame + sizeof(uint32_t), sizeof(uint32_t) + header.length) != header.crc ||
+                _decode_record(payload, header.length, true, 
+                    op.lsn, log_time, op.tag, op.key, op.val, &batch) != 0) {
+                first_bad[index] = i;
+                break;
+            }
+            if (op.tag == TAG_BATCH) {
+                continue;
+            }
+            // The serialized key follows [LSN][LOG_TIME][OPERATION_TAG][KEY_BYTES].
+            size_t key_pos = sizeof(unsigned long long) + sizeof(long) + sizeof(int);
+            memcpy(&op.key_bytes, payload + key_pos, sizeof(size_t));
+            op.key_data = payload + key_pos + sizeof(size_t);
+            if (op.lsn > dump_lsn) {
+                chunk_parts[index][_hash_bytes(op.key_data, op.key_bytes) % threads].push_back(i);
+            }
+        }
+    });
+    size_t intact = *std::min_element(first_bad.begin(), first_bad.end());
+    if (intact != records.size()) {
+        torn = std::make_pair(records[intact].first + 1, records[intact].second);
+    }
+    // Only the last segment may be torn, as restore requires.
+    unsigned long long torn_segment = (dump_segment == 0 ? first : dump_segment) + torn.first - 1;
+    if (torn.first != 0 && torn_segment != last) {
+        toscreen << "Log segment: " << LogWriter::segment_path(log_file, torn_segment)
+            << " is torn before the last segment, cannot restore.\n";
+        return -1;
+    }
+    
+    // A batch must be applied as a whole, leave it to restore.
+    for (size_t i = 0; i < intact; ++i) {
+        if (ops[i].tag == TAG_BATCH) {
+            return _restore(log_file, dump_file, delta_files);
+        }
+    }
+    
+    // Each partition keeps the last operation of its keys after the dump, sorted by key.
+    // Equal keys have the same serialized bytes.
+    std::vector<std::vector<size_t> > latest(threads);
+    _parallel_run(threads, [&](int index) {
+        std::unordered_map<std::string, size_t> last_op;
+        // The chunks are in log order, so a later operation overwrites an earlier one.
+        for (int chunk = 0; chunk < threads; ++chunk) {
+            const std::vector<size_t>& part = chunk_parts[chunk][index];
+            for (size_t j = 0; j < part.size() && part[j] < intact; ++j) {
+                last_op[std::string(ops[part[j]].key_data, ops[part[j]].key_bytes)] = part[j];
+            }
+        }
+        latest[index].reserve(last_op.size());
+        for (typename std::unordered_map<std::string, size_t>::iterator it = last_op.begin();
+            it != last_op.end(); ++it) {
+            latest[index].push_back(it->second);
+        }
+        std::sort(latest[index].begin(), latest[index].end(), [&](size_t left, size_t right) {
+            return SkipList<KeyType, ValType>::_cmp(ops[left].key, ops[right].key) < 0;
+        });
+    });
+    
+    // Later deltas follow the restored checkpoint, the replayed keys are marked dirty.
+    if (dump_lsn != 0) {
+        _dirty.clear();
+        _track_dirty = true;
+        _chain_lsn = dump_lsn;
+    }
+    
+    // Merge the dump and the partitions in key order, then load them at once.
+    std::vector<std::pair<KeyType, ValType> > result;
+    result.reserve(base.size() + intact);
+    std::vector<size_t> heads(threads, 0);
+    size_t base_pos = 0;
+    unsigned long valid_datas = 0;
+    while (true) {
+        int min_part = -1;
+        for (int i = 0; i < threads; ++i) {
+            if (heads[i] < latest[i].size() && (min_part == -1 || 
+                SkipList<KeyType, ValType>::_cmp(ops[latest[i][heads[i]]].key, 
+                    ops[latest[min_part][heads[min_part]]].key) < 0)) {
+                min_part = i;
+            }
+        }
+        if (min_part == -1) {
+            break;
+        }
+        ReplayOp& op = ops[latest[min_part][heads[min_part]++]];
+        _mark_dirty(op.key);
+        while (base_pos < base.size() && 
+            SkipList<KeyType, ValType>::_cmp(base[base_pos].first, op.key) < 0) {
+            result.push_back(base[base_pos++]);
+        }
+        if (base_pos < base.size() && 
+            SkipList<KeyType, ValType>::_cmp(base[base_pos].first, op.key) == 0) {
+            ++base_pos; // Replaced or deleted.
+        }
+        if (op.tag == TAG_SET) {
+            result.push_back(std::make_pair(op.key, op.val));
+        }
+    }
+    result.insert(result.end(), base.begin() + base_pos, base.end());
+    SkipList<KeyType, ValType>::bulk_load(result.begin(), result.end());
+    
+    _lsn = dump_lsn;
+    for (size_t i = 0; i < intact; ++i) {
+        if (ops[i].lsn > dump_lsn) {
+            ++valid_datas;
+        }
+        if (ops[i].lsn > _lsn) {
+            _lsn = ops[i].lsn;
+        }
+    }
+    
+    // Drop the torn tail, as restore does.
+    if (torn.first != 0) {
+        std::string path = LogWriter::segment_path(log_file, torn_segment);
+        toscreen << "Drop the torn tail of log segment: " << path << ", " 
+            << segments[torn.first - 1].bytes - torn.second << " bytes.\n";
+        if (_log.truncate_segment(log_file, torn_segment, torn.second) != 0) {
+            toscreen << "Truncate the log segment failed.\n";
+            return -1;
+        }
+    }
+    
+    toscreen << "Parallel restore finished. Dump records: " << base.size() 
+        << ". Read: " << intact << " operations. Valid operation num: " << valid_datas 
+        << ". Threads: " << threads << ".\n";
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+template <typename Fun>
+void SafeSL<KeyType, ValType>::_parallel_run(int threads, Fun fun) {
+    std::vector<pthread_t> ids(threads);
+    std::vector<std::pair<Fun*, int> > tasks(threads, std::make_pair(&fun, 0));
+    std::vector<bool> started(threads, false);
+    for (int i = 1; i < threads; ++i) {
+        tasks[i].second = i;
+        started[i] = (pthread_create(&ids[i], nullptr, _parallel_entry<Fun>, &tasks[i]) == 0);
+    }
+    fun(0);
+    for (int i = 1; i < threads; ++i) {
+        if (started[i]) {
+            pthread_join(ids[i], nullptr);
+        } else {
+            fun(i); // Run it here if the thread cannot be created.
+        }
+    }
+}
+
+template <typename KeyType, typename ValType>
+template <typename Fun>
+void* SafeSL<KeyType, ValType>::_parallel_entry(void* task) {
+    std::pair<Fun*, int>* fun_and_index = reinterpret_cast<std::pair<Fun*, int>*>(task);
+    (*fun_and_index->first)(fun_and_index->second);
+    return nullptr;
+}
+
+template <typename KeyType, typename ValType>
+void SafeSL<KeyType, ValType>::_apply_record(Tags tag, const KeyType& key, const ValType& val) {
+    // It should not be fail. Since only successful operation woudle be written to log.
+    _mark_dirty(key);
+    if (_lsm) {
+        if (_lsm_put(key, val, tag == TAG_DEL) != 0) {
+            toscreen << "Replay when restore failed. Key: " 
+                << SkipList<KeyType, ValType>::_tostr(key) << ".\n";
+        }
+    } else if (tag == TAG_SET) {
+        int ret = SkipList<KeyType, ValType>::set(key, val);
+        if (ret == 1) {
+            // The key exists, replace it, so replaying a record twice is harmless.
+            SkipList<KeyType, ValType>::del(key);
+            ret = SkipList<KeyType, ValType>::set(key, val);
+        }
+        if (ret != 0) {
+            toscreen << "Set when restore failed. Key: " 
+                << SkipList<KeyType, ValType>::_tostr(key) << ".\n";
+        }
+    } else if (tag == TAG_DEL && SkipList<KeyType, ValType>::del(key) != 0) {
+        toscreen << "Del when restore failed. Key: " 
+            << SkipList<KeyType, ValType>::_tostr(key) << ".\n";
+    }
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_apply_batch(const std::vector<BatchOp<KeyType, ValType> >& ops) {
+    for (size_t i = 0; i < ops.size(); ++i) {
+        _mark_dirty(ops[i].key);
+    }
+    if (!_lsm) {
+        return SkipList<KeyType, ValType>::apply_sorted(ops.begin(), ops.end());
+    }
+    int ret = 0;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (_lsm_put(ops[i].key, ops[i].val, ops[i].deleted) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_read_file(const std::string& path, std::string& data) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        toscreen << "File: " << path << " cannot be opened.\n";
+        return -1;
+    }
+    fseek(file, 0L, SEEK_END);
+    data.resize(ftell(file));
+    fseek(file, 0L, SEEK_SET);
+    if (!data.empty() && fread(&data[0], data.size(), 1, file) != 1) {
+        toscreen << "Read the file: " << path << " failed.\n";
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+void SafeSL<KeyType, ValType>::_encode_record(std::string& out, Tags tag, 
+    unsigned long long lsn, long log_time, const KeyType& key, const ValType& val) {
+    // Leave the space of the header, fill it after the payload is known.
+    size_t start = out.size();
+    out.append(sizeof(LogRecordHeader), '\0');
+    int tag_int = static_cast<int>(tag);
+    out.append(reinterpret_cast<const char*>(&lsn), sizeof(unsigned long long));
+    out.append(reinterpret_cast<const char*>(&log_time), sizeof(long));
+    out.append(reinterpret_cast<const char*>(&tag_int), sizeof(int));
+    _append_obj(out, key, key2bin);
+    if (tag == TAG_SET) {
+        _append_obj(out, val, val2bin);
+    }
+    _seal_record(out, start);
+}
+
+template <typename KeyType, typename ValType>
+void SafeSL<KeyType, ValType>::_encode_batch(std::string& out, unsigned long long lsn, 
+    long log_time, const std::vector<BatchOp<KeyType, ValType> >& ops) {
+    size_t start = out.size();
+    out.append(sizeof(LogRecordHeader), '\0');
+    int tag_int = static_cast<int>(TAG_BATCH);
+    size_t op_num = ops.size();
+    out.append(reinterpret_cast<const char*>(&lsn), sizeof(unsigned long long));
+    out.append(reinterpret_cast<const char*>(&log_time), sizeof(long));
+    out.append(reinterpret_cast<const char*>(&tag_int), sizeof(int));
+    out.append(reinterpret_cast<const char*>(&op_num), sizeof(size_t));
+    for (size_t i = 0; i < ops.size(); ++i) {
+        tag_int = static_cast<int>(ops[i].deleted ? TAG_DEL : TAG_SET);
+        out.append(reinterpret_cast<const char*>(&tag_int), sizeof(int));
+        _append_obj(out, ops[i].key, key2bin);
+        if (!ops[i].deleted) {
+            _append_obj(out, ops[i].val, val2bin);
+        }
+    }
+    _seal_record(out, start);
+}
+
+template <typename KeyType, typename ValType>
+void SafeSL<KeyType, ValType>::_seal_record(std::string& out, size_t start) {
+    LogRecordHeader header;
+    header.length = out.size() - start - sizeof(LogRecordHeader);
+    memcpy(&out[start] + sizeof(uint32_t), &header.length, sizeof(uint32_t));
+    header.crc = crc32c(0, out.data() + start + sizeof(uint32_t), sizeof(uint32_t) + header.length);
+    memcpy(&out[start], &header.crc, sizeof(uint32_t));
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_decode_record(const char* payload, size_t bytes, bool has_lsn,
+    unsigned long long& lsn, long& log_time, Tags& tag, KeyType& key, ValType& val,
+    std::vector<BatchOp<KeyType, ValType> >* batch) {
+    int tag_int;
+    size_t pos = 0;
+    if (has_lsn) {
+        if (bytes < sizeof(unsigned long long)) {
+            return -1;
+        }
+        memcpy(&lsn, payload, sizeof(unsigned long long));
+        pos += sizeof(unsigned long long);
+    }
+    if (bytes - pos < sizeof(long) + sizeof(int)) {
+        return -1;
+    }
+    memcpy(&log_time, payload + pos, sizeof(long));
+    memcpy(&tag_int, payload + pos + sizeof(long), sizeof(int));
+    tag = static_cast<Tags>(tag_int);
+    pos += sizeof(long) + sizeof(int);
+    Binary bin; // Tag of this Binary is TAG_POINTER.
+    if (tag == TAG_BATCH) {
+        size_t op_num;
+        if (batch == nullptr || bytes - pos < sizeof(size_t)) {
+            return -1;
+        }
+        memcpy(&op_num, payload + pos, sizeof(size_t));
+        pos += sizeof(size_t);
+        // Each operation has at least the tag and the key length.
+        if (op_num > (bytes - pos) / (sizeof(int) + sizeof(size_t))) {
+            return -1;
+        }
+        batch->resize(op_num);
+        for (size_t i = 0; i < op_num; ++i) {
+            BatchOp<KeyType, ValType>& op = (*batch)[i];
+            if (bytes - pos < sizeof(int)) {
+                return -1;
+            }
+            memcpy(&tag_int, payload + pos, sizeof(int));
+            pos += sizeof(int);
+            if ((tag_int != TAG_SET && tag_int != TAG_DEL) ||
+                _read_bin(payload, bytes, pos, bin) != 0 || _parse_obj(op.key, bin, bin2key) != 0) {
+                return -1;
+            }
+            op.deleted = (tag_int == TAG_DEL);
+            if (!op.deleted && 
+                (_read_bin(payload, bytes, pos, bin) != 0 || _parse_obj(op.val, bin, bin2val) != 0)) {
+                return -1;
+            }
+        }
+        return pos == bytes ? 0 : -1;
+    }
+    if (_read_bin(payload, bytes, pos, bin) != 0) {
+        return -1;
+    }
+    if (_parse_obj(key, bin, bin2key) != 0) {
+        return -1;
+    }
+    if (tag == TAG_SET) {
+        if (_read_bin(payload, bytes, pos, bin) != 0 || _parse_obj(val, bin, bin2val) != 0) {
+            return -1;
+        }
+    } else if (tag != TAG_DEL) {
+        return -1;
+    }
+    return pos == bytes ? 0 : -1;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_read_bin(const char* data, size_t bytes, size_t& pos, Binary& bin) {
+    if (bytes - pos < sizeof(size_t)) {
+        return -1;
+    }
+    memcpy(&bin.bytes, data + pos, sizeof(size_t));
+    pos += sizeof(size_t);
+    if (bin.bytes > bytes - pos) {
+        return -1;
+    }
+    bin.data = const_cast<char*>(data + pos);
+    pos += bin.bytes;
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+template <typename T>
+void SafeSL<KeyType, ValType>::_append_obj(std::string& out, const T& obj, 
+    void (*to_bin)(const T&, Binary&)) {
+    if (to_bin == nullptr) {
+        // Written in place, no allocation once out has the capacity.
+        size_t bytes = Serializer<T>::size(obj);
+        out.append(reinterpret_cast<const char*>(&bytes), sizeof(size_t));
+        size_t pos = out.size();
+        out.resize(pos + bytes);
+        Serializer<T>::write(obj, &out[pos]);
+        return;
+    }
+    Binary bin;
+    to_bin(obj, bin);
+    out.append(reinterpret_cast<const char*>(&bin.bytes), sizeof(size_t));
+    out.append(reinterpret_cast<const char*>(bin.data), bin.bytes);
+}
+
+template <typename KeyType, typename ValType>
+template <typename T>
+int SafeSL<KeyType, ValType>::_parse_obj(T& obj, const Binary& bin, 
+    void (*from_bin)(T&, const Binary&)) {
+    if (from_bin == nullptr) {
+        return Serializer<T>::read(obj, reinterpret_cast<const char*>(bin.data), bin.bytes) ? 0 : -1;
+    }
+    from_bin(obj, bin);
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::dump_to_file(const std::string& dump_path) {
+    if (_lsm) {
+        toscreen << "Dump is unsupported in LSM mode, use flush_memtable.\n";
+        return -1;
+    }
+    // A running checkpoint would remove fewer segments after this dump.
+    // A checkpoint started later waits for the writer lock, so it follows this dump.
+    pthread_mutex_lock(&_checkpoint_lock);
+    if (_checkpoint_status(true) == 1) {
+        pthread_mutex_unlock(&_checkpoint_lock);
+        return -1;
+    }
+    pthread_mutex_lock(&_write_lock);
+    pthread_mutex_unlock(&_checkpoint_lock);
+    // Records of the operations before are all in the former segments.
+    unsigned long long segment = _log.roll();
+    if (segment == 0) {
+        toscreen << "Roll the log failed, dump failed.\n";
+        pthread_mutex_unlock(&_write_lock);
+        return -1;
+    }
+    const char* error = nullptr;
+    long dump_num = _write_dump(dump_path, segment, _lsn, error);
+    if (dump_num == -1) {
+        toscreen << error << " Dump to file failed: " << dump_path << ".\n";
+        pthread_mutex_unlock(&_write_lock);
+        return -1;
+    }
+    
+    // The dump covers the former segments, deltas follow it.
+    _log.remove_before(segment);
+    _dirty.clear();
+    _track_dirty = true;
+    _chain_lsn = _lsn;
+    pthread_mutex_unlock(&_write_lock);
+    toscreen << "Dump to file finished. Totally dump " << dump_num << " nodes.\n";
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::dump_incremental(const std::string& delta_path) {
+    if (_lsm) {
+        toscreen << "Dump is unsupported in LSM mode, use flush_memtable.\n";
+        return -1;
+    }
+    // The delta follows the running checkpoint if it succeeds.
+    // A checkpoint started later waits for the writer lock, so it follows this delta.
+    pthread_mutex_lock(&_checkpoint_lock);
+    _checkpoint_status(true);
+    pthread_mutex_lock(&_write_lock);
+    pthread_mutex_unlock(&_checkpoint_lock);
+    if (!_track_dirty) {
+        pthread_mutex_unlock(&_write_lock);
+        toscreen << "No checkpoint for the delta to follow, call dump_to_file first.\n";
+        return -1;
+    }
+    unsigned long long segment = _log.roll();
+    if (segment == 0) {
+        toscreen << "Roll the log failed, dump incremental failed.\n";
+        pthread_mutex_unlock(&_write_lock);
+        return -1;
+    }
+    const char* error = nullptr;
+    long dump_num = _write_dump(delta_path, segment, _lsn, error, true);
+    if (dump_num == -1) {
+        toscreen << error << " Dump incremental failed: " << delta_path << ".\n";
+        pthread_mutex_unlock(&_write_lock);
+        return -1;
+    }
+    _log.remove_before(segment);
+    _dirty.clear();
+    _chain_lsn = _lsn;
+    pthread_mutex_unlock(&_write_lock);
+    toscreen << "Dump incremental finished. Totally dump " << dump_num << " changed keys.\n";
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::checkpoint(const std::string& dump_path) {
+    if (_lsm) {
+        toscreen << "Checkpoint is unsupported in LSM mode, use flush_memtable.\n";
+        return -1;
+    }
+    // The checkpoint lock is held until the child is recorded, so only one is started.
+    pthread_mutex_lock(&_checkpoint_lock);
+    if (_checkpoint_status(false) == 1) {
+        pthread_mutex_unlock(&_checkpoint_lock);
+        toscreen << "A checkpoint is running, cannot start another.\n";
+        return -1;
+    }
+    pthread_mutex_lock(&_write_lock);
+    unsigned long long segment = _log.roll();
+    if (segment == 0) {
+        toscreen << "Roll the log failed, checkpoint failed.\n";
+        pthread_mutex_unlock(&_write_lock);
+        pthread_mutex_unlock(&_checkpoint_lock);
+        return -1;
+    }
+    // The child has the skiplist at this moment, writers continue on the copied-on-write pages.
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only this thread exists in the child, so avoid locks other threads may hold, e.g., cout.
+        const char* error = nullptr;
+        if (_write_dump(dump_path, segment, _lsn, error) == -1) {
+            ssize_t ret = write(STDERR_FILENO, error, strlen(error));
+            (void)ret;
+            _exit(1);
+        }
+        _exit(0);
+    }
+    if (pid != -1) {
+        // Deltas follow the checkpoint, they wait until it finishes.
+        _dirty.clear();
+        _track_dirty = true;
+        _chain_lsn = _lsn;
+        _checkpoint_pid = pid;
+        _checkpoint_segment = segment;
+        _checkpoint_failed = false;
+    }
+    pthread_mutex_unlock(&_write_lock);
+    pthread_mutex_unlock(&_checkpoint_lock);
+    if (pid == -1) {
+        toscreen << "Fork failed, checkpoint failed.\n";
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::checkpoint_status(bool wait) {
+    pthread_mutex_lock(&_checkpoint_lock);
+    int ret = _checkpoint_status(wait);
+    pthread_mutex_unlock(&_checkpoint_lock);
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_checkpoint_status(bool wait) {
+    if (_checkpoint_pid == 0) {
+        return _checkpoint_failed ? -1 : 0;
+    }
+    int status = 0;
+    pid_t ret = waitpid(_checkpoint_pid, &status, wait ? 0 : WNOHANG);
+    if (ret == 0) {
+        return 1; // Running.
+    }
+    _checkpoint_pid = 0;
+    if (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        toscreen << "Checkpoint failed, log segments are kept.\n";
+        _checkpoint_failed = true;
+        // The changes before the checkpoint are forgotten, a new dump is needed for deltas.
+        pthread_mutex_lock(&_write_lock);
+        _dirty.clear();
+        _track_dirty = false;
+        pthread_mutex_unlock(&_write_lock);
+        return -1;
+    }
+    // The dump covers the former segments.
+    _log.remove_before(_checkpoint_segment);
+    _checkpoint_failed = false;
+    toscreen << "Checkpoint finished, log starts from segment " << _checkpoint_segment << ".\n";
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+long SafeSL<KeyType, ValType>::_write_dump(const std::string& dump_path, 
+    unsigned long long segment, unsigned long long lsn, const char*& error, bool delta) {
+    // Write to a temporary file, so a crash won't break the former dump.
+    std::string temp_path = dump_path + ".tmp";
+    FILE* dump = fopen(temp_path.c_str(), "wb");
+    if (dump == nullptr) {
+        error = "Cannot open the temporary dump file.";
+        return -1;
+    }
+    DumpHeader header;
+    header.time = time(0);
+    header.segment = segment;
+    header.lsn = lsn;
+    header.key_encoding = _key_encoding();
+    header.delta = delta;
+    header.base_lsn = _chain_lsn;
+    if (_write_dump_header(dump, header) != 0) {
+        error = "Write the dump header failed.";
+        fclose(dump);
+        return -1;
+    }
+    long dump_num = 0;
+    std::string scratch;
+    BlockBuilder block;
+    block.tagged = delta;
+    if (delta) {
+        // The dirty keys are in order, the unexisting ones are written as tombstones.
+        typename std::set<KeyType, KeyLess>::const_iterator it;
+        for (it = _dirty.begin(); it != _dirty.end(); ++it) {
+            Node<KeyType, ValType>* x = SkipList<KeyType, ValType>::_find(*it);
+            if (x == nullptr || x->deleted) {
+                _add_entry(block, *it, ValType(), scratch, true);
+            } else {
+                _add_entry(block, *it, x->val, scratch);
+            }
+            if (block.raw.size() >= DUMP_BLOCK_BYTES && _flush_block(dump, block) != 0) {
+                error = "Write block failed.";
+                fclose(dump);
+                return -1;
+            }
+            ++dump_num;
+        }
+    }
+    for (Node<KeyType, ValType>* x = SkipList<KeyType, ValType>::_head; !delta && x != nullptr; x = x->levels[0].forward) {
+        if (x == SkipList<KeyType, ValType>::_head || x->deleted) {
+            continue;
+        }
+        _add_entry(block, x->key, x->val, scratch);
+        if (block.raw.size() >= DUMP_BLOCK_BYTES && _flush_block(dump, block) != 0) {
+            error = "Write block failed.";
+            fclose(dump);
+            return -1;
+        }
+        ++dump_num;
+    }
+    if (_flush_block(dump, block) != 0 || _flush_trailer(dump, dump_num) != 0) {
+        error = "Write block failed.";
+        fclose(dump);
+        return -1;
+    }
+    
+    if (!delta && dump_num != static_cast<long>(SkipList<KeyType, ValType>::size())) {
+        error = "Dump number unmatched.";
+        fclose(dump);
+        return -1;
+    }
+    if (_finish_dump(dump, temp_path, dump_path, error) != 0) {
+        return -1;
+    }
+    return dump_num;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_write_dump_header(FILE* file, const DumpHeader& header) {
+    if (fwrite(header.delta ? DELTA_MAGIC : DUMP_MAGIC, DUMP_MAGIC_BYTES, 1, file) != 1 ||
+        fwrite(&header.time, sizeof(long), 1, file) != 1 ||
+        fwrite(&header.segment, sizeof(unsigned long long), 1, file) != 1 ||
+        fwrite(&header.lsn, sizeof(unsigned long long), 1, file) != 1 ||
+        fwrite(&header.key_encoding, sizeof(uint32_t), 1, file) != 1) {
+        return -1;
+    }
+    if (header.delta && fwrite(&header.base_lsn, sizeof(unsigned long long), 1, file) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_finish_dump(FILE* file, const std::string& temp_path, 
+    const std::string& dump_path, const char*& error) {
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        error = "Sync the dump file failed.";
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    if (rename(temp_path.c_str(), dump_path.c_str()) != 0) {
+        error = "Rename the dump file failed.";
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_read_dump_header(FILE* file, DumpHeader& header) {
+    char data[DUMP_MAGIC_BYTES + sizeof(long) + 3 * sizeof(unsigned long long) + sizeof(uint32_t)];
+    size_t bytes = fread(data, 1, sizeof(data), file);
+    size_t pos = 0;
+    if (_parse_dump_header(data, bytes, pos, header) != 0) {
+        return -1;
+    }
+    return fseek(file, pos, SEEK_SET);
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_parse_dump_header(const char* data, size_t bytes, size_t& pos,
+    DumpHeader& header) {
+    header = DumpHeader();
+    if (bytes < DUMP_MAGIC_BYTES) {
+        return -1;
+    }
+    if (memcmp(data, DUMP_MAGIC, DUMP_MAGIC_BYTES) == 0) {
+        header.version = 5;
+    } else if (memcmp(data, DELTA_MAGIC, DUMP_MAGIC_BYTES) == 0) {
+        header.version = 5;
+        header.delta = true;
+    } else if (memcmp(data, DUMP_MAGIC_V4, DUMP_MAGIC_BYTES) == 0) {
+        header.version = 4;
+    } else if (memcmp(data, DELTA_MAGIC_V1, DUMP_MAGIC_BYTES) == 0) {
+        header.version = 4;
+        header.delta = true;
+    } else if (memcmp(data, DUMP_MAGIC_V3, DUMP_MAGIC_BYTES) == 0) {
+        header.version = 3;
+    } else if (memcmp(data, DUMP_MAGIC_V2, DUMP_MAGIC_BYTES) == 0) {
+        header.version = 2;
+    } else {
+        // Dump of former versions only begins with the time.
+        header.version = 1;
+        memcpy(&header.time, data, sizeof(long));
+        pos = sizeof(long);
+        return 0;
+    }
+    size_t header_bytes = DUMP_MAGIC_BYTES + sizeof(long) + sizeof(unsigned long long) +
+        (header.version >= 3 ? sizeof(unsigned long long) : 0) + 
+        (header.version >= 4 ? sizeof(uint32_t) : 0) + (header.delta ? sizeof(unsigned long long) : 0);
+    if (bytes < header_bytes) {
+        return -1;
+    }
+    pos = DUMP_MAGIC_BYTES;
+    memcpy(&header.time, data + pos, sizeof(long));
+    pos += sizeof(long);
+    memcpy(&header.segment, data + pos, sizeof(unsigned long long));
+    pos += sizeof(unsigned long long);
+    if (header.version >= 3) {
+        memcpy(&header.lsn, data + pos, sizeof(unsigned long long));
+        pos += sizeof(unsigned long long);
+    }
+    if (header.version >= 4) {
+        memcpy(&header.key_encoding, data + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        if (header.key_encoding != KEY_PREFIX && header.key_encoding != KEY_DELTA) {
+            return -1;
+        }
+    }
+    if (header.delta) {
+        memcpy(&header.base_lsn, data + pos, sizeof(unsigned long long));
+        pos += sizeof(unsigned long long);
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+void SafeSL<KeyType, ValType>::_add_entry(BlockBuilder& block, 
+    const KeyType& key, const ValType& val, std::string& scratch, bool deleted) {
+    // Each restart point begins with a whole key.
+    bool restart = (block.entries % DUMP_RESTART_INTERVAL == 0);
+    if (restart) {
+        block.restarts.push_back(block.raw.size());
+    }
+    if (_key_encoding() == KEY_DELTA) {
+        // [ZIGZAG_DELTA] of the integer key.
+        unsigned long long value = IntegerKey<KeyType>::to_u64(key);
+        long long delta = static_cast<long long>(value - (restart ? 0 : block.last_int));
+        append_varint(block.raw, (static_cast<unsigned long long>(delta) << 1) ^ (delta >> 63));
+        block.last_int = value;
+    } else {
+        // [SHARED][UNSHARED][KEY_SUFFIX] against the former key.
+        scratch.clear();
+        _append_obj(scratch, key, key2bin);
+        const char* key_data = scratch.data() + sizeof(size_t);
+        size_t key_bytes = scratch.size() - sizeof(size_t);
+        size_t shared = 0;
+        if (!restart) {
+            while (shared < key_bytes && shared < block.last_key.size() && 
+                block.last_key[shared] == key_data[shared]) {
+                ++shared;
+            }
+        }
+        append_varint(block.raw, shared);
+        append_varint(block.raw, key_bytes - shared);
+        block.raw.append(key_data + shared, key_bytes - shared);
+        block.last_key.assign(key_data, key_bytes);
+    }
+    // [VAL_BYTES][VAL], or [VAL_BYTES * 2 + DELETED][VAL] in tagged blocks.
+    if (block.tagged && deleted) {
+        append_varint(block.raw, 1);
+        ++block.entries;
+        return;
+    }
+    scratch.clear();
+    _append_obj(scratch, val, val2bin);
+    size_t val_bytes = scratch.size() - sizeof(size_t);
+    append_varint(block.raw, block.tagged ? val_bytes * 2 : val_bytes);
+    block.raw.append(scratch, sizeof(size_t), std::string::npos);
+    ++block.entries;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_flush_block(FILE* file, BlockBuilder& block) {
+    if (block.entries == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < block.restarts.size(); ++i) {
+        block.raw.append(reinterpret_cast<const char*>(&block.restarts[i]), sizeof(uint32_t));
+    }
+    uint32_t restart_num = block.restarts.size();
+    block.raw.append(reinterpret_cast<const char*>(&restart_num), sizeof(uint32_t));
+    
+    // Keep it raw if compressing doesn't help.
+    block.stored.clear();
+    lz_compress(block.raw.data(), block.raw.size(), block.stored);
+    const std::string& body = (block.stored.size() < block.raw.size()) ? block.stored : block.raw;
+    DumpBlockHeader header;
+    header.stored_bytes = body.size();
+    header.raw_bytes = block.raw.size();
+    header.entries = block.entries;
+    header.crc = crc32c(0, &header.stored_bytes, sizeof(DumpBlockHeader) - sizeof(uint32_t));
+    header.crc = crc32c(header.crc, body.data(), body.size());
+    int ret = (fwrite(&header, sizeof(DumpBlockHeader), 1, file) == 1 &&
+        fwrite(body.data(), body.size(), 1, file) == 1) ? 0 : -1;
+    
+    block.raw.clear();
+    block.restarts.clear();
+    block.last_key.clear();
+    block.entries = 0;
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_unpack_block(const DumpBlockHeader& header, const char* body, 
+    std::string& raw) {
+    uint32_t crc = crc32c(0, &header.stored_bytes, sizeof(DumpBlockHeader) - sizeof(uint32_t));
+    if (crc32c(crc, body, header.stored_bytes) != header.crc || 
+        header.stored_bytes > header.raw_bytes) {
+        return -1;
+    }
+    if (header.stored_bytes == header.raw_bytes) {
+        raw.assign(body, header.stored_bytes);
+        return 0;
+    }
+    raw.resize(header.raw_bytes);
+    return lz_decompress(body, header.stored_bytes, &raw[0], raw.size());
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_flush_trailer(FILE* file, unsigned long long records) {
+    DumpBlockHeader header;
+    header.stored_bytes = sizeof(unsigned long long);
+    header.raw_bytes = 0;
+    header.entries = 0;
+    header.crc = crc32c(0, &header.stored_bytes, sizeof(DumpBlockHeader) - sizeof(uint32_t));
+    header.crc = crc32c(header.crc, &records, sizeof(unsigned long long));
+    return (fwrite(&header, sizeof(DumpBlockHeader), 1, file) == 1 &&
+        fwrite(&records, sizeof(unsigned long long), 1, file) == 1) ? 0 : -1;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_check_trailer(const DumpBlockHeader& header, const char* body, 
+    unsigned long long records) {
+    if (header.raw_bytes != 0 || header.entries != 0 || header.stored_bytes != sizeof(unsigned long long)) {
+        return -1;
+    }
+    uint32_t crc = crc32c(0, &header.stored_bytes, sizeof(DumpBlockHeader) - sizeof(uint32_t));
+    unsigned long long stored_records;
+    memcpy(&stored_records, body, sizeof(unsigned long long));
+    if (crc32c(crc, body, header.stored_bytes) != header.crc || stored_records != records) {
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_decode_block(const std::string& raw, uint32_t entries, 
+    uint32_t key_encoding, std::vector<std::pair<KeyType, ValType> >& out, std::vector<char>* deleted) {
+    uint32_t restart_num;
+    if (raw.size() < sizeof(uint32_t)) {
+        return -1;
     }
+    memcpy(&restart_num, raw.data() + raw.size() - sizeof(uint32_t), sizeof(uint32_t));
+    if (restart_num > (raw.size() - sizeof(uint32_t)) / sizeof(uint32_t)) {
+        return -1;
+    }
+    size_t end = raw.size() - sizeof(uint32_t) * (restart_num + 1);
+    const char* restarts = raw.data() + end;
     
-    if (_read_val(file, val) != 0) { // Read error.
+    std::string key_bytes;
+    unsigned long long last_int = 0;
+    size_t pos = 0;
+    Binary bin; // Tag of this Binary is TAG_POINTER.
+    for (uint32_t i = 0; i < entries; ++i) {
+        bool restart = (i % DUMP_RESTART_INTERVAL == 0);
+        if (restart) {
+            uint32_t offset;
+            if (i / DUMP_RESTART_INTERVAL >= restart_num) {
+                return -1;
+            }
+            memcpy(&offset, restarts + sizeof(uint32_t) * (i / DUMP_RESTART_INTERVAL), sizeof(uint32_t));
+            if (offset != pos) {
+                return -1;
+            }
+        }
+        out.push_back(std::pair<KeyType, ValType>());
+        std::pair<KeyType, ValType>& entry = out.back();
+        if (key_encoding == KEY_DELTA) {
+            unsigned long long zigzag;
+            if (read_varint(raw.data(), end, pos, zigzag) != 0) {
+                return -1;
+            }
+            long long delta = static_cast<long long>(zigzag >> 1) ^ -static_cast<long long>(zigzag & 1);
+            last_int = (restart ? 0 : last_int) + static_cast<unsigned long long>(delta);
+            IntegerKey<KeyType>::from_u64(entry.first, last_int);
+        } else {
+            unsigned long long shared;
+            unsigned long long unshared;
+            if (read_varint(raw.data(), end, pos, shared) != 0 ||
+                read_varint(raw.data(), end, pos, unshared) != 0 ||
+                shared > key_bytes.size() || (restart && shared != 0) || unshared > end - pos) {
+                return -1;
+            }
+            key_bytes.resize(shared);
+            key_bytes.append(raw.data() + pos, unshared);
+            pos += unshared;
+            bin.bytes = key_bytes.size();
+            bin.data = &key_bytes[0];
+            if (_parse_obj(entry.first, bin, bin2key) != 0) {
+                return -1;
+            }
+        }
+        unsigned long long val_bytes;
+        if (read_varint(raw.data(), end, pos, val_bytes) != 0) {
+            return -1;
+        }
+        if (deleted != nullptr) {
+            deleted->push_back(static_cast<char>(val_bytes & 1));
+            if (val_bytes & 1) {
+                continue;
+            }
+            val_bytes >>= 1;
+        }
+        if (val_bytes > end - pos) {
+            return -1;
+        }
+        bin.bytes = val_bytes;
+        bin.data = const_cast<char*>(raw.data() + pos);
+        pos += val_bytes;
+        if (_parse_obj(entry.second, bin, bin2val) != 0) {
+            return -1;
+        }
+    }
+    return pos == end ? 0 : -1;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_read_record(FILE* file, KeyType& key, ValType& val, 
+    std::string& scratch) {
+    Binary bin; // Tag of this Binary is TAG_POINTER.
+    // Read the size of key.
+    if (fread(&bin.bytes, sizeof(size_t), 1, file) != 1) { // File is OVER.
+        return 1;
+    }
+    scratch.resize(bin.bytes);
+    if (bin.bytes != 0 && fread(&scratch[0], bin.bytes, 1, file) != 1) {
+        toscreen << "Read the key failed.\n";
+        return -1;
+    }
+    bin.data = &scratch[0];
+    if (_parse_obj(key, bin, bin2key) != 0) {
+        toscreen << "Parse the key failed.\n";
         return -1;
     }
     
+    if (fread(&bin.bytes, sizeof(size_t), 1, file) != 1) {
+        toscreen << "Read the val failed.\n";
+        return -1;
+    }
+    scratch.resize(bin.bytes);
+    if (bin.bytes != 0 && fread(&scratch[0], bin.bytes, 1, file) != 1) {
+        toscreen << "Read the val failed.\n";
+        return -1;
+    }
+    bin.data = &scratch[0];
+    if (_parse_obj(val, bin, bin2val) != 0) {
+        toscreen << "Parse the val failed.\n";
+        return -1;
+    }
     return 0; // Read OK, and the file has more content.
 }
 
@@ -393,29 +1847,38 @@ int SafeSL<KeyType, ValType>::parse_from_file(const std::string& dump_path) {
         toscreen << "Cannot open the dump file: " << dump_path << ", parse from file failed.\n";
         return -1;
     }
-    if (fseek(dump, sizeof(long), SEEK_SET) != 0) { // Locate to data part.
-        toscreen << "Locate after the time of dump file failed.\n";
+    DumpHeader header;
+    if (_read_dump_header(dump, header) != 0) { // Locate to data part.
+        toscreen << "Read the header of dump file failed.\n";
+        fclose(dump);
         return -1;
     }
     
-    int ret = _parse_from_file(dump);
+    pthread_mutex_lock(&_write_lock);
+    pthread_rwlock_wrlock(&_rw_lock);
+    int ret = _parse_from_file(dump, header);
+    pthread_rwlock_unlock(&_rw_lock);
+    pthread_mutex_unlock(&_write_lock);
     fclose(dump);
     return ret;
 }
 
 template <typename KeyType, typename ValType>
-int SafeSL<KeyType, ValType>::_parse_from_file(FILE* file) {
+int SafeSL<KeyType, ValType>::_parse_from_file(FILE* file, const DumpHeader& header) {
     if (file == nullptr) {
         toscreen << "Fun: _parse_from_file received an empty file.\n";
         return -1;
     }
-    static KeyType key_buffer;
-    static ValType val_buffer;
-    static int ret;
-    static long record_num;
+    if (header.version >= 4) {
+        return _parse_blocks(file, header);
+    }
+    KeyType key_buffer;
+    ValType val_buffer;
+    std::string scratch;
+    int ret;
+    long record_num = -1;
     
-    record_num = -1;
-    for (ret = 0; ret == 0; ret = _read_record(file, key_buffer, val_buffer)) {
+    for (ret = 0; ret == 0; ret = _read_record(file, key_buffer, val_buffer, scratch)) {
         if (record_num == -1) { // The first loop.
             ++record_num;
             continue;
@@ -436,6 +1899,686 @@ int SafeSL<KeyType, ValType>::_parse_from_file(FILE* file) {
     return 0;
 }
 
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_parse_blocks(FILE* file, const DumpHeader& header) {
+    std::string stored;
+    std::string raw;
+    std::vector<std::pair<KeyType, ValType> > entries;
+    std::vector<char> deleted;
+    unsigned long long record_num = 0;
+    unsigned long long read_num = 0;
+    
+    // One block is in memory at a time, its entries are in key order.
+    int ret;
+    while ((ret = _next_block(file, header, stored, raw, entries, 
+        header.delta ? &deleted : nullptr, read_num)) == 0) {
+        if (header.delta) {
+            for (size_t i = 0; i < entries.size(); ++i) {
+                if (deleted[i]) {
+                    SkipList<KeyType, ValType>::del(entries[i].first);
+                } else {
+                    _apply_record(TAG_SET, entries[i].first, entries[i].second);
+                }
+            }
+        } else if (SkipList<KeyType, ValType>::bulk_load(entries.begin(), entries.end()) != entries.size()) {
+            toscreen << "Set data failed when parsing from file.\n";
+            return -1;
+        }
+        record_num += entries.size();
+    }
+    if (ret == -1) {
+        toscreen << "Block after " << record_num << " records is broken or truncated, or the trailer is missing.\n";
+        return -1;
+    }
+    
+    toscreen << "Parse from file finish. Total records num: " << record_num << ".\n";
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_next_block(FILE* file, const DumpHeader& header, std::string& stored,
+    std::string& raw, std::vector<std::pair<KeyType, ValType> >& entries, std::vector<char>* deleted,
+    unsigned long long& records) {
+    DumpBlockHeader block;
+    size_t bytes = fread(&block, 1, sizeof(DumpBlockHeader), file);
+    if (bytes == 0) {
+        // Since version 5 the file ends with the trailer, otherwise it's cut between the blocks.
+        return (header.version >= 5) ? -1 : 1;
+    }
+    stored.resize(block.stored_bytes);
+    if (bytes != sizeof(DumpBlockHeader) || 
+        (block.stored_bytes != 0 && fread(&stored[0], block.stored_bytes, 1, file) != 1)) {
+        return -1;
+    }
+    if (block.raw_bytes == 0) {
+        return (_check_trailer(block, stored.data(), records) == 0) ? 1 : -1;
+    }
+    entries.clear();
+    if (deleted != nullptr) {
+        deleted->clear();
+    }
+    if (_unpack_block(block, stored.data(), raw) != 0 ||
+        _decode_block(raw, block.entries, header.key_encoding, entries, deleted) != 0) {
+        return -1;
+    }
+    records += entries.size();
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::compact_deltas(const std::string& dump_path,
+    const std::vector<std::string>& delta_paths, const std::string& new_dump_path) {
+    // One cursor for the dump and each delta, later files are newer.
+    struct Cursor {
+        FILE* file;
+        DumpHeader header;
+        std::vector<std::pair<KeyType, ValType> > entries;
+        std::vector<char> deleted;
+        size_t pos;
+        unsigned long long records; // Entries read from the file.
+        Cursor() : file(nullptr), pos(0), records(0) {}
+    };
+    std::vector<Cursor> cursors(delta_paths.size() + 1);
+    std::string stored;
+    std::string raw;
+    // Load the next nonempty block when the cursor is at the end of the former one.
+    // Return 0 means OK, 1 means the file is over, -1 means error.
+    auto fill = [&](Cursor& cursor) {
+        int ret = 0;
+        while (ret == 0 && cursor.pos == cursor.entries.size()) {
+            cursor.pos = 0;
+            ret = _next_block(cursor.file, cursor.header, stored, raw, cursor.entries, 
+                cursor.header.delta ? &cursor.deleted : nullptr, cursor.records);
+        }
+        if (ret != 0) {
+            cursor.entries.clear();
+        }
+        return ret;
+    };
+    
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < cursors.size(); ++i) {
+        const std::string& path = (i == 0) ? dump_path : delta_paths[i - 1];
+        Cursor& cursor = cursors[i];
+        cursor.file = fopen(path.c_str(), "rb");
+        if (cursor.file == nullptr || _read_dump_header(cursor.file, cursor.header) != 0 ||
+            cursor.header.version < 4 || cursor.header.delta != (i != 0) ||
+            (i != 0 && cursor.header.base_lsn != cursors[i - 1].header.lsn)) {
+            toscreen << "File: " << path << " isn't a checkpoint of blocks following the former one.\n";
+            ret = -1;
+        } else if (fill(cursor) == -1) {
+            toscreen << "File: " << path << " has broken blocks.\n";
+            ret = -1;
+        }
+    }
+    
+    // The new dump is at the last delta.
+    std::string temp_path = new_dump_path + ".tmp";
+    FILE* dump = nullptr;
+    DumpHeader header = cursors.back().header;
+    header.key_encoding = _key_encoding();
+    header.delta = false;
+    if (ret == 0) {
+        dump = fopen(temp_path.c_str(), "wb");
+        if (dump == nullptr || _write_dump_header(dump, header) != 0) {
+            toscreen << "Cannot write the new dump: " << temp_path << ".\n";
+            ret = -1;
+        }
+    }
+    
+    // Merge from the first keys, the newest file wins for equal keys.
+    long dump_num = 0;
+    std::string scratch;
+    BlockBuilder block;
+    while (ret == 0) {
+        size_t newest = cursors.size();
+        for (size_t i = 0; i < cursors.size(); ++i) {
+            if (cursors[i].pos < cursors[i].entries.size() && (newest == cursors.size() ||
+                SkipList<KeyType, ValType>::_cmp(cursors[i].entries[cursors[i].pos].first, 
+                cursors[newest].entries[cursors[newest].pos].first) <= 0)) {
+                newest = i;
+            }
+        }
+        if (newest == cursors.size()) {
+            break;
+        }
+        Cursor& winner = cursors[newest];
+        KeyType key = winner.entries[winner.pos].first;
+        if (!winner.header.delta || !winner.deleted[winner.pos]) {
+            _add_entry(block, key, winner.entries[winner.pos].second, scratch);
+            ++dump_num;
+            if (block.raw.size() >= DUMP_BLOCK_BYTES && _flush_block(dump, block) != 0) {
+                toscreen << "Write block of the new dump failed.\n";
+                ret = -1;
+            }
+        }
+        for (size_t i = 0; ret == 0 && i < cursors.size(); ++i) {
+            if (cursors[i].pos < cursors[i].entries.size() && 
+                SkipList<KeyType, ValType>::_cmp(cursors[i].entries[cursors[i].pos].first, key) == 0) {
+                ++cursors[i].pos;
+                if (fill(cursors[i]) == -1) {
+                    toscreen << "File " << i << " of the chain has broken blocks.\n";
+                    ret = -1;
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < cursors.size(); ++i) {
+        if (cursors[i].file != nullptr) {
+            fclose(cursors[i].file);
+        }
+    }
+    if (ret == 0 && (_flush_block(dump, block) != 0 || _flush_trailer(dump, dump_num) != 0)) {
+        toscreen << "Write block of the new dump failed.\n";
+        ret = -1;
+    }
+    const char* error = nullptr;
+    if (ret == 0 && _finish_dump(dump, temp_path, new_dump_path, error) != 0) {
+        toscreen << error << " Compact deltas failed.\n";
+        unlink(temp_path.c_str());
+        return -1;
+    }
+    if (ret != 0) {
+        if (dump != nullptr) {
+            fclose(dump);
+            unlink(temp_path.c_str());
+        }
+        return -1;
+    }
+    toscreen << "Compact deltas finished. Totally dump " << dump_num << " nodes.\n";
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::use_lsm(size_t memtable_entries, int merge_width) {
+    if (_lsm) {
+        toscreen << "LSM mode is already used.\n";
+        return -1;
+    }
+    if (SkipList<KeyType, ValType>::_length != 0) {
+        toscreen << "LSM mode must be used before any data is set.\n";
+        return -1;
+    }
+    _memtable_entries = (memtable_entries == 0) ? 1 : memtable_entries;
+    _merge_width = (merge_width < 2) ? 2 : merge_width;
+    if (_load_tables() != 0) {
+        return -1;
+    }
+    _lsn = _table_lsn;
+    _lsm = true;
+    if (pthread_create(&_compactor, nullptr, _compact_loop, this) != 0) {
+        toscreen << "Create the compaction thread failed.\n";
+        _lsm = false;
+        _tables.clear();
+        return -1;
+    }
+    _compactor_running = true;
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::flush_memtable() {
+    if (!_lsm) {
+        return -1;
+    }
+    pthread_mutex_lock(&_write_lock);
+    if (_frozen != nullptr) {
+        // Wait for the former frozen memtable first, retry it if its flush failed.
+        pthread_mutex_lock(&_tables_lock);
+        _flush_pending = true;
+        pthread_cond_broadcast(&_tables_cond);
+        pthread_mutex_unlock(&_write_lock);
+        while (_flush_pending) {
+            pthread_cond_wait(&_tables_cond, &_tables_lock);
+        }
+        pthread_mutex_unlock(&_tables_lock);
+        pthread_mutex_lock(&_write_lock);
+    }
+    if (_frozen != nullptr) {
+        pthread_mutex_unlock(&_write_lock);
+        toscreen << "The former memtable cannot be flushed.\n";
+        return -1;
+    }
+    if (SkipList<KeyType, ValType>::_length == 0) {
+        pthread_mutex_unlock(&_write_lock);
+        return 0;
+    }
+    int ret = _freeze();
+    pthread_mutex_unlock(&_write_lock);
+    if (ret != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&_tables_lock);
+    while (_flush_pending) {
+        pthread_cond_wait(&_tables_cond, &_tables_lock);
+    }
+    pthread_mutex_unlock(&_tables_lock);
+    pthread_mutex_lock(&_write_lock);
+    ret = (_frozen == nullptr) ? 0 : -1;
+    pthread_mutex_unlock(&_write_lock);
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+size_t SafeSL<KeyType, ValType>::table_num() {
+    pthread_mutex_lock(&_tables_lock);
+    size_t num = _tables.size();
+    pthread_mutex_unlock(&_tables_lock);
+    return num;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_lsm_put(const KeyType& key, const ValType& val, bool deleted) {
+    Node<KeyType, ValType>* x = SkipList<KeyType, ValType>::_find(key);
+    if (x == nullptr) {
+        if (SkipList<KeyType, ValType>::_insert(key, val, 0) != 0) {
+            return -1;
+        }
+        if (deleted) {
+            SkipList<KeyType, ValType>::_find(key)->deleted = true;
+            ++SkipList<KeyType, ValType>::_tombstones;
+        }
+        return 0;
+    }
+    // Overwrite in place, the tables below are hidden either way.
+    SkipList<KeyType, ValType>::_bytes -= SkipList<KeyType, ValType>::_node_bytes(x);
+    if (x->deleted && !deleted) {
+        --SkipList<KeyType, ValType>::_tombstones;
+    } else if (!x->deleted && deleted) {
+        ++SkipList<KeyType, ValType>::_tombstones;
+    }
+    x->deleted = deleted;
+    x->val = deleted ? ValType() : val;
+    SkipList<KeyType, ValType>::_bytes += SkipList<KeyType, ValType>::_node_bytes(x);
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_lsm_get(const KeyType& key, ValType& val) {
+    bool deleted = false;
+    std::vector<std::shared_ptr<SSTable<KeyType, ValType> > > tables;
+    pthread_rwlock_rdlock(&_rw_lock);
+    int found = SkipList<KeyType, ValType>::find(key, val, deleted);
+    if (found == 0 && _frozen != nullptr) {
+        found = _frozen->find(key, val, deleted);
+    }
+    if (found == 0) {
+        // The copied list keeps the tables open even if they are merged meanwhile.
+        pthread_mutex_lock(&_tables_lock);
+        tables = _tables;
+        pthread_mutex_unlock(&_tables_lock);
+    }
+    pthread_rwlock_unlock(&_rw_lock);
+    for (size_t i = 0; found == 0 && i < tables.size(); ++i) {
+        found = tables[i]->get(key, val, deleted);
+        if (found == -1) {
+            toscreen << "Read the table failed: " << tables[i]->path() << ".\n";
+        }
+    }
+    return (found == 1 && !deleted) ? 0 : -1;
+}
+
+template <typename KeyType, typename ValType>
+template <typename Visitor>
+size_t SafeSL<KeyType, ValType>::_lsm_scan(const KeyType* begin, Visitor visitor) {
+    typedef SkipList<KeyType, ValType> Memtable;
+    // Hold the read lock to the end, so the memtables and the copied tables stay consistent.
+    pthread_rwlock_rdlock(&_rw_lock);
+    pthread_mutex_lock(&_tables_lock);
+    std::vector<std::shared_ptr<SSTable<KeyType, ValType> > > tables = _tables;
+    pthread_mutex_unlock(&_tables_lock);
+    
+    // The sources from new to old: the memtable, the frozen memtable, then the tables.
+    Memtable* lists[2] = {this, _frozen};
+    Node<KeyType, ValType>* nodes[2] = {nullptr, nullptr};
+    for (int i = 0; i < 2; ++i) {
+        if (lists[i] != nullptr) {
+            nodes[i] = (begin == nullptr) ? lists[i]->first_node() : lists[i]->lower_bound(*begin);
+        }
+    }
+    std::vector<SSTableCursor<KeyType, ValType> > cursors;
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < tables.size(); ++i) {
+        cursors.push_back(SSTableCursor<KeyType, ValType>(tables[i].get()));
+        ret = (begin == nullptr) ? cursors.back().seek_first() : cursors.back().seek(*begin);
+    }
+    
+    long long now = Memtable::now_ms();
+    size_t visited = 0;
+    while (ret == 0) {
+        // The smallest key, the newest source wins for equal keys.
+        const KeyType* key = nullptr;
+        const ValType* val = nullptr;
+        bool deleted = false;
+        for (int i = 0; i < 2; ++i) {
+            if (nodes[i] != nullptr && (key == nullptr || Memtable::_cmp(nodes[i]->key, *key) < 0)) {
+                key = &nodes[i]->key;
+                val = &nodes[i]->val;
+                deleted = nodes[i]->deleted || 
+                    (nodes[i]->expire_time != 0 && nodes[i]->expire_time <= now);
+            }
+        }
+        for (size_t i = 0; i < cursors.size(); ++i) {
+            if (cursors[i].valid() && (key == nullptr || Memtable::_cmp(cursors[i].key(), *key) < 0)) {
+                key = &cursors[i].key();
+                val = &cursors[i].val();
+                deleted = cursors[i].deleted();
+            }
+        }
+        if (key == nullptr) {
+            break;
+        }
+        if (!deleted) {
+            ++visited;
+            if (!visitor(*key, *val)) {
+                break;
+            }
+        }
+        // Move every source past the key, the key is copied since its source moves.
+        KeyType current = *key;
+        for (int i = 0; i < 2; ++i) {
+            if (nodes[i] != nullptr && Memtable::_cmp(nodes[i]->key, current) == 0) {
+                nodes[i] = nodes[i]->levels[0].forward;
+            }
+        }
+        for (size_t i = 0; ret == 0 && i < cursors.size(); ++i) {
+            if (cursors[i].valid() && Memtable::_cmp(cursors[i].key(), current) == 0) {
+                ret = cursors[i].next();
+            }
+        }
+    }
+    pthread_rwlock_unlock(&_rw_lock);
+    if (ret != 0) {
+        toscreen << "Read the table failed, the scan ends early.\n";
+    }
+    return visited;
+}
+
+template <typename KeyType, typename ValType>
+void SafeSL<KeyType, ValType>::_maybe_freeze() {
+    if (static_cast<size_t>(SkipList<KeyType, ValType>::_length) < _memtable_entries) {
+        return;
+    }
+    if (_frozen == nullptr) {
+        _freeze();
+        return;
+    }
+    // The memtable grows until the former one is flushed, retry it if the flush failed.
+    pthread_mutex_lock(&_tables_lock);
+    if (!_flush_pending) {
+        _flush_pending = true;
+        pthread_cond_broadcast(&_tables_cond);
+    }
+    pthread_mutex_unlock(&_tables_lock);
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_freeze() {
+    // Records of the frozen memtable are all in the former segments.
+    unsigned long long segment = _log.roll();
+    if (segment == 0) {
+        toscreen << "Roll the log failed, the memtable is not frozen.\n";
+        return -1;
+    }
+    SkipList<KeyType, ValType>* frozen = new SkipList<KeyType, ValType>(SkipList<KeyType, ValType>::_cmp, 
+        SkipList<KeyType, ValType>::_tostr, SkipList<KeyType, ValType>::_level_capacity);
+    pthread_rwlock_wrlock(&_rw_lock);
+    frozen->swap(*this);
+    _frozen = frozen;
+    pthread_rwlock_unlock(&_rw_lock);
+    _frozen_segment = segment;
+    _frozen_lsn = _lsn;
+    pthread_mutex_lock(&_tables_lock);
+    _flush_pending = true;
+    pthread_cond_broadcast(&_tables_cond);
+    pthread_mutex_unlock(&_tables_lock);
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_flush_frozen() {
+    pthread_mutex_lock(&_tables_lock);
+    unsigned long long id = _next_table++;
+    pthread_mutex_unlock(&_tables_lock);
+    
+    // Writers never touch the frozen memtable, so it's read without locks.
+    std::string path = _table_path(id);
+    int ret = 0;
+    {
+        SSTableWriter<KeyType, ValType> writer(this, path);
+        _frozen->walk([&](const KeyType& key, const ValType& val, bool deleted) {
+            ret = writer.add(key, val, deleted);
+            return ret == 0;
+        });
+        if (ret == 0) {
+            ret = writer.finish();
+        }
+    }
+    std::shared_ptr<SSTable<KeyType, ValType> > table(new SSTable<KeyType, ValType>(this, path, id, 0));
+    if (ret == 0 && table->open() != 0) {
+        ret = -1;
+    }
+    
+    pthread_mutex_lock(&_tables_lock);
+    if (ret == 0) {
+        _tables.insert(_tables.begin(), table);
+        unsigned long long former_segment = _table_segment;
+        unsigned long long former_lsn = _table_lsn;
+        _table_segment = _frozen_segment;
+        _table_lsn = _frozen_lsn;
+        ret = _write_tables();
+        if (ret != 0) {
+            _tables.erase(_tables.begin());
+            _table_segment = former_segment;
+            _table_lsn = former_lsn;
+        }
+    }
+    if (ret != 0) {
+        // The frozen memtable is kept, the next full memtable retries.
+        table->remove_on_close();
+        _flush_pending = false;
+        pthread_cond_broadcast(&_tables_cond);
+        pthread_mutex_unlock(&_tables_lock);
+        toscreen << "Flush the memtable failed.\n";
+        return -1;
+    }
+    pthread_mutex_unlock(&_tables_lock);
+    
+    pthread_mutex_lock(&_write_lock);
+    pthread_rwlock_wrlock(&_rw_lock);
+    delete _frozen;
+    _frozen = nullptr;
+    pthread_rwlock_unlock(&_rw_lock);
+    pthread_mutex_unlock(&_write_lock);
+    
+    pthread_mutex_lock(&_tables_lock);
+    _flush_pending = false;
+    pthread_cond_broadcast(&_tables_cond);
+    pthread_mutex_unlock(&_tables_lock);
+    
+    // The table covers the former segments.
+    _log.remove_before(_table_segment);
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_merge_tables() {
+    typedef std::shared_ptr<SSTable<KeyType, ValType> > TablePtr;
+    // Tiers don't increase from old to new, so the tables of a tier are adjacent.
+    pthread_mutex_lock(&_tables_lock);
+    size_t end = _tables.size();
+    size_t begin = end;
+    while (end > 0) {
+        begin = end - 1;
+        while (begin > 0 && _tables[begin - 1]->tier() == _tables[end - 1]->tier()) {
+            --begin;
+        }
+        if (end - begin >= static_cast<size_t>(_merge_width)) {
+            break;
+        }
+        end = begin;
+    }
+    if (end == 0) {
+        pthread_mutex_unlock(&_tables_lock);
+        return 0;
+    }
+    // The oldest tables of the tier.
+    begin = end - _merge_width;
+    std::vector<TablePtr> group(_tables.begin() + begin, _tables.begin() + end);
+    // Nothing older is hidden by the tombstones if the oldest table is merged.
+    bool drop_tombstones = (end == _tables.size());
+    unsigned long long id = _next_table++;
+    pthread_mutex_unlock(&_tables_lock);
+    
+    // Merge from the first keys, the newest table wins for equal keys.
+    std::string path = _table_path(id);
+    int ret = 0;
+    {
+        SSTableWriter<KeyType, ValType> writer(this, path);
+        std::vector<SSTableCursor<KeyType, ValType> > cursors;
+        for (size_t i = 0; i < group.size(); ++i) {
+            cursors.push_back(SSTableCursor<KeyType, ValType>(group[i].get()));
+            ret |= cursors.back().seek_first();
+        }
+        while (ret == 0) {
+            size_t min = cursors.size();
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                if (cursors[i].valid() && (min == cursors.size() || 
+                    SkipList<KeyType, ValType>::_cmp(cursors[i].key(), cursors[min].key()) < 0)) {
+                    min = i;
+                }
+            }
+            if (min == cursors.size()) {
+                break;
+            }
+            if (!drop_tombstones || !cursors[min].deleted()) {
+                ret = writer.add(cursors[min].key(), cursors[min].val(), cursors[min].deleted());
+            }
+            KeyType key = cursors[min].key();
+            for (size_t i = 0; ret == 0 && i < cursors.size(); ++i) {
+                if (cursors[i].valid() && SkipList<KeyType, ValType>::_cmp(cursors[i].key(), key) == 0) {
+                    ret = cursors[i].next();
+                }
+            }
+        }
+        if (ret == 0) {
+            ret = writer.finish();
+        }
+    }
+    TablePtr table(new SSTable<KeyType, ValType>(this, path, id, group[0]->tier() + 1));
+    if (ret == 0 && table->open() != 0) {
+        ret = -1;
+    }
+    
+    // New tables may be flushed meanwhile, the group is found by the id.
+    pthread_mutex_lock(&_tables_lock);
+    if (ret == 0) {
+        size_t pos = 0;
+        while (_tables[pos]->id() != group[0]->id()) {
+            ++pos;
+        }
+        _tables.erase(_tables.begin() + pos, _tables.begin() + pos + group.size());
+        _tables.insert(_tables.begin() + pos, table);
+        ret = _write_tables();
+        if (ret != 0) {
+            _tables.erase(_tables.begin() + pos);
+            _tables.insert(_tables.begin() + pos, group.begin(), group.end());
+        }
+    }
+    if (ret != 0) {
+        table->remove_on_close();
+        pthread_mutex_unlock(&_tables_lock);
+        toscreen << "Merge the tables failed.\n";
+        return -1;
+    }
+    // The files are removed after the readers release them.
+    for (size_t i = 0; i < group.size(); ++i) {
+        group[i]->remove_on_close();
+    }
+    pthread_mutex_unlock(&_tables_lock);
+    return 1;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_write_tables() {
+    // SAFESL_TABLES, next, segment, lsn, then [table ID TIER] from new to old.
+    char line[128];
+    std::string content = "SAFESL_TABLES\n";
+    snprintf(line, sizeof(line), "next %llu\nsegment %llu\nlsn %llu\n", 
+        _next_table, _table_segment, _table_lsn);
+    content += line;
+    for (size_t i = 0; i < _tables.size(); ++i) {
+        snprintf(line, sizeof(line), "table %llu %d\n", _tables[i]->id(), _tables[i]->tier());
+        content += line;
+    }
+    if (LogWriter::replace_file(_log_path + ".tables", content) != 0) {
+        toscreen << "Replace the table manifest failed.\n";
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SafeSL<KeyType, ValType>::_load_tables() {
+    std::string path = _log_path + ".tables";
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        return 0; // No table yet.
+    }
+    char title[32] = {0};
+    if (fscanf(file, "%31s next %llu segment %llu lsn %llu", 
+        title, &_next_table, &_table_segment, &_table_lsn) != 4 ||
+        strcmp(title, "SAFESL_TABLES") != 0) {
+        toscreen << "Table manifest: " << path << " has wrong format.\n";
+        fclose(file);
+        return -1;
+    }
+    unsigned long long id;
+    int tier;
+    while (fscanf(file, " table %llu %d", &id, &tier) == 2) {
+        std::shared_ptr<SSTable<KeyType, ValType> > table(
+            new SSTable<KeyType, ValType>(this, _table_path(id), id, tier));
+        if (table->open() != 0) {
+            fclose(file);
+            _tables.clear();
+            return -1;
+        }
+        _tables.push_back(table);
+    }
+    fclose(file);
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+std::string SafeSL<KeyType, ValType>::_table_path(unsigned long long id) const {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".table.%08llu", id);
+    return _log_path + suffix;
+}
+
+template <typename KeyType, typename ValType>
+void* SafeSL<KeyType, ValType>::_compact_loop(void* safesl) {
+    SafeSL& sl = *reinterpret_cast<SafeSL*>(safesl);
+    pthread_mutex_lock(&sl._tables_lock);
+    while (!sl._compactor_stop) {
+        // Flushing goes first, the memtable grows until it's done.
+        if (sl._flush_pending) {
+            pthread_mutex_unlock(&sl._tables_lock);
+            sl._flush_frozen();
+            pthread_mutex_lock(&sl._tables_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&sl._tables_lock);
+        int merged = sl._merge_tables();
+        pthread_mutex_lock(&sl._tables_lock);
+        if (merged != 1 && !sl._flush_pending && !sl._compactor_stop) {
+            pthread_cond_wait(&sl._tables_cond, &sl._tables_lock);
+        }
+    }
+    pthread_mutex_unlock(&sl._tables_lock);
+    return nullptr;
+}
+
 } // End namespace skiplist.
 
 #endif // End ifndef _SAFESL_HPP_.
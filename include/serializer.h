@@ -0,0 +1,74 @@
+// Serializer of SafeSL.
+// Writes keys and vals straight into the output buffer, without a Binary in between.
+// Trivially copyable types are written as their bytes, std::string as its chars with the last '\0'.
+// Specialize it for other types:
+//     template <>
+//     struct Serializer<MyType> {
+//         static const bool enabled = true;
+//         static size_t size(const MyType& obj); // Bytes to write.
+//         static void write(const MyType& obj, char* out); // Write size(obj) bytes to out.
+//         static bool read(MyType& obj, const char* data, size_t bytes); // Return false if broken.
+//     };
+
+#ifndef _SERIALIZER_H_
+#define _SERIALIZER_H_
+
+#include <string.h>
+#include <string>
+#include <type_traits>
+
+namespace skiplist {
+
+template <typename T, bool = std::is_trivially_copyable<T>::value>
+struct Serializer {
+    static const bool enabled = false;
+    static size_t size(const T&) {
+        return 0;
+    }
+    static void write(const T&, char*) {}
+    static bool read(T&, const char*, size_t) {
+        return false;
+    }
+};
+
+// The bytes of the object, with no heap allocation.
+template <typename T>
+struct Serializer<T, true> {
+    static const bool enabled = true;
+    static size_t size(const T&) {
+        return sizeof(T);
+    }
+    static void write(const T& obj, char* out) {
+        memcpy(out, &obj, sizeof(T));
+    }
+    static bool read(T& obj, const char* data, size_t bytes) {
+        if (bytes != sizeof(T)) {
+            return false;
+        }
+        memcpy(&obj, data, sizeof(T));
+        return true;
+    }
+};
+
+// The chars with the last '\0', the same as the converters in the user guide.
+template <>
+struct Serializer<std::string, false> {
+    static const bool enabled = true;
+    static size_t size(const std::string& obj) {
+        return obj.size() + 1;
+    }
+    static void write(const std::string& obj, char* out) {
+        memcpy(out, obj.c_str(), obj.size() + 1);
+    }
+    static bool read(std::string& obj, const char* data, size_t bytes) {
+        if (bytes == 0 || data[bytes - 1] != '\0') {
+            return false;
+        }
+        obj.assign(data, bytes - 1);
+        return true;
+    }
+};
+
+} // End namespace skiplist.
+
+#endif // End ifndef _SERIALIZER_H_.
@@ -6,6 +6,8 @@
 #define _SKIPLIST_H_
 
 #include <string>
+#include <set>
+#include <utility>
 
 #define toscreen std::cout<<__FILE__<<", "<<__LINE__<<": "
 
@@ -17,6 +19,13 @@ const int DEFAULT_LEVEL = 32;
 
 namespace skiplist {
 
+// How to choose the entry to remove when the memory limit is reached.
+enum EvictPolicy {
+    EVICT_NONE, // Do not evict, set fails when the limit is reached.
+    EVICT_SMALLEST, // Evict the entry with the smallest key.
+    EVICT_CLOCK // Approximate LRU, evict the entry not referenced since the clock hand passed.
+};
+
 template <typename KeyType, typename ValType>
 class Node;
 template <typename KeyType, typename ValType>
@@ -42,10 +51,21 @@ public:
     
     ValType val; // Value.
     KeyType key; // Key.
+    long long expire_time; // Absolute expiring time in milliseconds, 0 means never expire.
+    bool referenced; // CLOCK bit, set when the node is read.
+    bool deleted; // Tombstone, the node is deleted but not unlinked yet.
     Node* backward; // The backward pointer.
     Level<KeyType, ValType> *levels; // All levels.
 };
 
+// A set or delete of SkipList::apply_sorted.
+template <typename KeyType, typename ValType>
+struct BatchOp {
+    KeyType key;
+    ValType val; // Unused by delete.
+    bool deleted; // Delete the key instead of setting it.
+};
+
 template <typename KeyType, typename ValType>
 class SkipList {
 public:
@@ -62,6 +82,28 @@ public:
      */
     int set(const KeyType& key, const ValType& value);
     
+    /**
+     * Append the entries in ascending key order, e.g., from a dump.
+     * The path to the tail is kept, so each entry is linked without searching.
+     * Entries not larger than the tail, or with a memory limit set, fall back to set.
+     * The iterator points to a pair of key and val.
+     * Return the number of entries loaded.
+     */
+    template <typename Iterator>
+    size_t bulk_load(Iterator begin, Iterator end);
+    
+    /**
+     * Apply the sets and deletes of ascending keys in one pass.
+     * Each search starts from the path to the former key instead of the head,
+     * since the nodes before that path are not moved by the former operations.
+     * Set replaces the existing val and clears its TTL, deleting an unexisting key is ignored.
+     * Keys not larger than the former one, or with a memory limit set, are searched from the head.
+     * The iterator points to a BatchOp, and the former one must still be valid.
+     * Return 0 means success, -1 means some set failed.
+     */
+    template <typename Iterator>
+    int apply_sorted(Iterator begin, Iterator end);
+    
     /**
      * Get.
      * Return the steps between the beginning to the key.
@@ -72,17 +114,150 @@ public:
     
     /**
      * Delete.
+     * With lazy delete, it only marks the node as a tombstone after one lookup,
+     * the node is unlinked and freed by compact later.
      * Return 0 means success, -1 means unexisting key.
      */
     int del(const KeyType& key);
     
+    /**
+     * Enable or disable lazy delete.
+     * Disabling it won't unlink the existing tombstones, call compact to do that.
+     */
+    void use_lazy_delete(bool flag) {
+        _lazy_delete = flag;
+    }
+    
+    /**
+     * Unlink and free the tombstones, walking at most budget nodes on the 0th level.
+     * Each call continues from where the last call stopped, and restarts from
+     * the beginning after reaching the end.
+     * Return the number of removed tombstones.
+     */
+    size_t compact(size_t budget);
+    
+    /**
+     * Return the number of tombstones waiting for compact.
+     */
+    size_t tombstones() {
+        return _tombstones;
+    }
+    
+    /**
+     * Find the node of the key, tombstones included, without touching the CLOCK bit.
+     * Return 1 if the key has a node and deleted tells if it's a tombstone, 0 if not.
+     */
+    int find(const KeyType& key, ValType& val, bool& deleted);
+    
+    /**
+     * Return the first node whose key >= key, tombstones and expired ones included.
+     * Walk on by levels[0].forward, e.g., to merge several skiplists in key order.
+     * nullptr means no such node.
+     */
+    Node<KeyType, ValType>* lower_bound(const KeyType& key);
+    
+    /**
+     * Return the first node like lower_bound, nullptr means empty.
+     */
+    Node<KeyType, ValType>* first_node() {
+        return _head->levels[0].forward;
+    }
+    
+    /**
+     * Visit all nodes in order, tombstones included.
+     * The visitor is called as visitor(key, val, deleted) and returns false to stop.
+     * Return the number of visited nodes.
+     */
+    template <typename Visitor>
+    size_t walk(Visitor visitor);
+    
+    /**
+     * Exchange the entries with another skiplist.
+     * The settings, e.g., the memory limit, the expiring index and lazy delete, are not exchanged.
+     * Each side indexes and counts the entries it gets by its own settings.
+     */
+    void swap(SkipList& other);
+    
+    /**
+     * Visit the entries whose key >= begin in order.
+     * It seeks once, then walks the 0th level.
+     * The visitor is called as visitor(key, val) and returns false to stop.
+     * Return the number of visited entries.
+     */
+    template <typename Visitor>
+    size_t scan(const KeyType& begin, Visitor visitor);
+    
+    /**
+     * Visit the entries whose key starts with prefix in order.
+     * It stops at the first key without the prefix, so the compare function
+     * must order keys lexicographically.
+     * KeyType must be string-like, having size() and compare(pos, len, str).
+     * Return the number of visited entries.
+     */
+    template <typename Visitor>
+    size_t prefix_scan(const KeyType& prefix, Visitor visitor);
+    
+    /**
+     * Set with a time to live.
+     * The entry expires ttl_ms milliseconds later, ttl_ms <= 0 means never expire.
+     * An expired entry is treated as unexisting, so setting it again succeeds.
+     * Return 0 success, -1 failed, 1 already existing.
+     */
+    int set_ttl(const KeyType& key, const ValType& value, long long ttl_ms);
+    
+    /**
+     * Change the expiring time of an existing key.
+     * @param expire_time: Absolute time in milliseconds, 0 means never expire.
+     * Return 0 success, -1 unexisting key.
+     */
+    int expire_at(const KeyType& key, long long expire_time);
+    
+    /**
+     * Remove at most budget expired entries, so each call costs bounded time.
+     * With the expire index, only expired entries are visited.
+     * Without it, budget nodes are checked from where the last call stopped.
+     * Return the number of removed entries.
+     */
+    size_t expire_some(size_t budget);
+    
+    /**
+     * Enable or disable the time-ordered index of the expiring entries.
+     * It costs O(logN) more for each set/del of an expiring entry.
+     */
+    void use_expire_index(bool flag);
+    
+    /**
+     * Limit the memory used by this skiplist.
+     * When a set goes beyond the limit, entries are evicted by the policy inline.
+     * @param max_entries: The maximum elements numbers, 0 means no limit.
+     * @param max_bytes: The maximum bytes of all nodes, 0 means no limit.
+     * @param entry_bytes: Return the extra heap bytes owned by key and val,
+     *     nullptr means only the node itself is counted.
+     */
+    void set_memory_limit(size_t max_entries, size_t max_bytes = 0, 
+        EvictPolicy policy = EVICT_CLOCK,
+        size_t (*entry_bytes)(const KeyType&, const ValType&) = nullptr);
+    
+    /**
+     * Return the bytes used by all nodes, counted as set_memory_limit describes.
+     */
+    size_t memory_usage() {
+        return _bytes;
+    }
+    
     /**
      * Return the elements numbers.
+     * Expired entries which have not been removed are also counted, tombstones are not.
      */
     size_t size() {
-        return _length;
+        return _length - _tombstones;
     }
     
+    /**
+     * Current time in milliseconds, the clock used by expiring time.
+     */
+    static long long now_ms();
+    
     virtual ~SkipList();
     
 protected:
@@ -94,9 +269,87 @@ protected:
     int (*_cmp)(const KeyType&, const KeyType&); // Compare function, used for sorting.
     std::string (*_tostr)(const KeyType&); // Function to show the key.
     
+    // Expiring entries ordered by (expire_time, node).
+    std::set<std::pair<long long, Node<KeyType, ValType>*> > _expire_index;
+    bool _use_expire_index;
+    Node<KeyType, ValType>* _expire_cursor; // Where the next expire_some without index starts.
+    
+    // Memory limit.
+    size_t _bytes; // Bytes used by all nodes.
+    size_t _max_entries; // 0 means no limit.
+    size_t _max_bytes; // 0 means no limit.
+    EvictPolicy _evict_policy;
+    size_t (*_entry_bytes)(const KeyType&, const ValType&);
+    Node<KeyType, ValType>* _clock_hand; // The next node checked by EVICT_CLOCK.
+    
+    // Lazy delete.
+    bool _lazy_delete;
+    int _tombstones; // The number of tombstones, they are counted by _length.
+    KeyType _compact_key; // The next compact starts from this key.
+    bool _compact_resume; // If false, the next compact starts from the beginning.
+    
     // Generate random level from 1 to _level_capacity.
     // Smaller number has more possibility to appear.
     int _random_level();
+    
+    // Set the spans of the last nodes of bulk_load, rank[i] is the rank of last[i].
+    void _fix_tail_spans(Node<KeyType, ValType>** last, int* rank);
+    
+    // Return the node of the key, tombstones included, nullptr means unexisting.
+    Node<KeyType, ValType>* _find(const KeyType& key);
+    
+    // Insert the key with the expiring time.
+    int _insert(const KeyType& key, const ValType& value, long long expire_time);
+    
+    // Link a new node of the key after update[i] at each level, rank[i] is the rank of update[i].
+    // update and rank are set for the new levels. Return 0 means success, -1 means failed.
+    int _link(Node<KeyType, ValType>** update, int* rank, 
+        const KeyType& key, const ValType& value, long long expire_time);
+    
+    // Replace the val and the expiring time of an existing node, a dead one is revived.
+    // The memory limit is applied as _link does. Return 0 means success, -1 means the node is unchanged.
+    int _replace(Node<KeyType, ValType>* x, const ValType& value, long long expire_time);
+    
+    // Return true if the node has expired at time now.
+    bool _expired(const Node<KeyType, ValType>* x, long long now) const {
+        return x->expire_time != 0 && x->expire_time <= now;
+    }
+    
+    // Return true if x is a tombstone or has expired, get and scan skip it.
+    bool _dead(const Node<KeyType, ValType>* x, long long now) const {
+        return x->deleted || _expired(x, now);
+    }
+    
+    // Change the expiring time of x and keep the expire index updated.
+    void _set_expire_time(Node<KeyType, ValType>* x, long long expire_time);
+    
+    // Bytes of the node x counted by the memory limit.
+    size_t _node_bytes(const Node<KeyType, ValType>* x) const {
+        size_t res = sizeof(Node<KeyType, ValType>) + sizeof(Level<KeyType, ValType>) * _level_capacity;
+        return _entry_bytes == nullptr ? res : res + _entry_bytes(x->key, x->val);
+    }
+    
+    // Count the bytes of all nodes again, e.g., after the way of counting changed.
+    void _count_bytes();
+    
+    // Return true if the memory limit is exceeded.
+    bool _over_limit() const {
+        return (_max_entries != 0 && static_cast<size_t>(_length) > _max_entries) ||
+            (_max_bytes != 0 && _bytes > _max_bytes);
+    }
+    
+    // Evict nodes until the memory limit is satisfied. Node keep won't be evicted.
+    void _evict(Node<KeyType, ValType>* keep);
+    
+    // Called before the node of the key is evicted, subclasses track the removal here.
+    virtual void _on_evict(const KeyType&) {}
+    
+    // Find the node x and remove it.
+    void _del_node(Node<KeyType, ValType>* x);
+    
+    // Unlink x from all levels and free it.
+    // update[i] is the last node before x at level i.
+    void _remove(Node<KeyType, ValType>* x, Node<KeyType, ValType>** update);
 };
 
 } // End namespace skiplist.
@@ -7,6 +7,7 @@
 
 #include <cstdlib>
 #include <ctime>
+#include <chrono>
 #include <iostream>
 #include "skiplist.h"
 
@@ -18,7 +19,7 @@ namespace skiplist {
 template <typename KeyType, typename ValType>
 Node<KeyType, ValType>::Node(int level_in, Node* backward_in,
     const KeyType& key_in, const ValType& val_in)
-    : backward(backward_in), key(key_in), val(val_in) {
+    : backward(backward_in), key(key_in), val(val_in), expire_time(0), referenced(false), deleted(false) {
     levels = new(std::nothrow) Level<KeyType, ValType>[level_in]; // Allocate level size's levels.
     if (levels == nullptr) {
         toscreen << "Allocate for new levels failed.\n";
@@ -32,6 +33,9 @@ Node<KeyType, ValType>::Node(int level_in) {
         toscreen << "Allocate for new levels failed.\n";
     }
     backward = nullptr; // No back node.
+    expire_time = 0;
+    referenced = false;
+    deleted = false;
 }
 
 template <typename KeyType, typename ValType>  
@@ -46,7 +50,11 @@ Node<KeyType, ValType>::~Node() {
 template <typename KeyType, typename ValType>  
 SkipList<KeyType, ValType>::SkipList(int (*cmp_fun)(const KeyType&, const KeyType&), 
     std::string (*key_to_str)(const KeyType&), int level_in) : 
-    _tostr(key_to_str), _cmp(cmp_fun), _level_capacity(level_in) {
+    _tostr(key_to_str), _cmp(cmp_fun), _level_capacity(level_in),
+    _use_expire_index(false), _expire_cursor(nullptr),
+    _bytes(0), _max_entries(0), _max_bytes(0), _evict_policy(EVICT_NONE),
+    _entry_bytes(nullptr), _clock_hand(nullptr),
+    _lazy_delete(false), _tombstones(0), _compact_resume(false) {
     _length = 0; // Has 0 nodes in total.
     _level = 1; // The head node has 1 level.
     
@@ -84,6 +92,16 @@ SkipList<KeyType, ValType>::~SkipList() {
 
 template <typename KeyType, typename ValType>
 int SkipList<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
+    return _insert(key, value, 0);
+}
+
+template <typename KeyType, typename ValType>
+int SkipList<KeyType, ValType>::set_ttl(const KeyType& key, const ValType& value, long long ttl_ms) {
+    return _insert(key, value, ttl_ms > 0 ? now_ms() + ttl_ms : 0);
+}
+
+template <typename KeyType, typename ValType>
+int SkipList<KeyType, ValType>::_insert(const KeyType& key, const ValType& value, long long expire_time) {
     // At the level n, it should pass node update[n] to reach the key.
     Node<KeyType, ValType>* update[_level_capacity];
     
@@ -107,6 +125,10 @@ int SkipList<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
         while (x->levels[i].forward != nullptr && 
             _cmp(x->levels[i].forward->key, key) <= 0) {
             if (_cmp(x->levels[i].forward->key, key) == 0) {
+                if (_dead(x->levels[i].forward, now_ms())) {
+                    // The existing one is deleted or expired, reuse its node.
+                    return _replace(x->levels[i].forward, value, expire_time);
+                }
                 // This skiplist already has this key.
                 toscreen << "Key: " << _tostr(key) << " already exists, set key failed.\n";
                 return 1;
@@ -118,7 +140,12 @@ int SkipList<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
         // At level i, the search path passes node x.
         update[i] = x;
     }
-    
+    return _link(update, rank, key, value, expire_time);
+}
+
+template <typename KeyType, typename ValType>
+int SkipList<KeyType, ValType>::_link(Node<KeyType, ValType>** update, int* rank, 
+    const KeyType& key, const ValType& value, long long expire_time) {
     // Randomly find a level, this time, we construt new index below this level.
     int new_node_level = _random_level();
     if (_level < new_node_level) {
@@ -135,7 +162,7 @@ int SkipList<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
     }
     
     // Generate new node for stroaging this key.
-    x = new(std::nothrow) Node<KeyType, ValType>(_level_capacity, nullptr, key, value);
+    Node<KeyType, ValType>* x = new(std::nothrow) Node<KeyType, ValType>(_level_capacity, nullptr, key, value);
     if (x == nullptr) {
         toscreen << "Insert key: " << _tostr(key) << "failed since allocating memory failed.\n";
         return -1;
@@ -165,10 +192,194 @@ int SkipList<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
     }
     
     ++_length;
+    _bytes += _node_bytes(x);
+    _set_expire_time(x, expire_time);
+    
+    if (_over_limit()) {
+        if (_evict_policy == EVICT_NONE) {
+            toscreen << "Insert key: " << _tostr(key) << " failed since the memory limit is reached.\n";
+            _del_node(x);
+            return -1;
+        }
+        _evict(x);
+    }
     
     return 0;
 }
 
+template <typename KeyType, typename ValType>
+int SkipList<KeyType, ValType>::_replace(Node<KeyType, ValType>* x, const ValType& value, long long expire_time) {
+    // Keep the former state, so the node is restored if the limit refuses the new val.
+    bool was_dead = _dead(x, now_ms());
+    bool was_deleted = x->deleted;
+    long long former_expire_time = x->expire_time;
+    size_t former_bytes = _node_bytes(x);
+    ValType former_val(value);
+    std::swap(x->val, former_val);
+    if (was_deleted) {
+        x->deleted = false;
+        --_tombstones;
+    }
+    _bytes = _bytes - former_bytes + _node_bytes(x);
+    _set_expire_time(x, expire_time);
+    
+    if (_over_limit()) {
+        if (_evict_policy == EVICT_NONE) {
+            toscreen << "Set key: " << _tostr(x->key) << " failed since the memory limit is reached.\n";
+            _bytes = _bytes - _node_bytes(x) + former_bytes;
+            std::swap(x->val, former_val);
+            _set_expire_time(x, former_expire_time);
+            if (was_deleted) {
+                x->deleted = true;
+                ++_tombstones;
+            }
+            return -1;
+        }
+        _evict(x);
+    }
+    if (was_dead) {
+        // A revived node hasn't been referenced yet.
+        __atomic_store_n(&x->referenced, false, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+template <typename Iterator>
+int SkipList<KeyType, ValType>::apply_sorted(Iterator begin, Iterator end) {
+    // finger[i] is the last node before the former key at level i, and rank[i] is its rank.
+    Node<KeyType, ValType>* finger[_level_capacity];
+    int rank[_level_capacity];
+    for (int i = 0; i < _level_capacity; ++i) {
+        finger[i] = _head;
+        rank[i] = 0;
+    }
+    int ret = 0;
+    Iterator former = end;
+    for (Iterator it = begin; it != end; ++it) {
+        if (_max_entries != 0 || _max_bytes != 0 || 
+            (former != end && _cmp(former->key, it->key) >= 0)) {
+            // Eviction or an unordered key changes the path.
+            for (int i = 0; i < _level_capacity; ++i) {
+                finger[i] = _head;
+                rank[i] = 0;
+            }
+        }
+        former = it;
+    
+        // At each level, continue from the former path if it's ahead.
+        Node<KeyType, ValType>* x = _head;
+        int steps = 0;
+        for (int i = _level - 1; i >= 0; --i) {
+            if (rank[i] > steps) {
+                x = finger[i];
+                steps = rank[i];
+            }
+            while (x->levels[i].forward != nullptr && 
+                _cmp(x->levels[i].forward->key, it->key) < 0) {
+                steps += x->levels[i].span;
+                x = x->levels[i].forward;
+            }
+            finger[i] = x;
+            rank[i] = steps;
+        }
+    
+        x = x->levels[0].forward;
+        bool found = (x != nullptr && _cmp(x->key, it->key) == 0);
+        if (it->deleted) {
+            if (!found) {
+                continue;
+            }
+            if (!_lazy_delete) {
+                _remove(x, finger);
+            } else if (!x->deleted) {
+                x->deleted = true;
+                ++_tombstones;
+            }
+        } else if (found) {
+            if (_replace(x, it->val, 0) != 0) {
+                ret = -1;
+            }
+        } else if (_link(finger, rank, it->key, it->val, 0) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+template <typename Iterator>
+size_t SkipList<KeyType, ValType>::bulk_load(Iterator begin, Iterator end) {
+    // last[i] is the last node at level i, and rank[i] is its rank.
+    Node<KeyType, ValType>* last[_level_capacity];
+    int rank[_level_capacity];
+    bool path_valid = false;
+    size_t loaded = 0;
+    
+    for (Iterator it = begin; it != end; ++it) {
+        if (_max_entries != 0 || _max_bytes != 0 || 
+            (_tail != nullptr && _cmp(it->first, _tail->key) <= 0)) {
+            // Eviction or an unordered key changes the path.
+            if (path_valid) {
+                _fix_tail_spans(last, rank);
+            }
+            if (_insert(it->first, it->second, 0) == 0) {
+                ++loaded;
+            }
+            path_valid = false;
+            continue;
+        }
+        if (!path_valid) {
+            Node<KeyType, ValType>* x = _head;
+            int steps = 0;
+            for (int i = _level_capacity - 1; i >= 0; --i) {
+                while (i < _level && x->levels[i].forward != nullptr) {
+                    steps += x->levels[i].span;
+                    x = x->levels[i].forward;
+                }
+                last[i] = x;
+                rank[i] = steps;
+            }
+            path_valid = true;
+        }
+        
+        int new_node_level = _random_level();
+        Node<KeyType, ValType>* x = new(std::nothrow) Node<KeyType, ValType>(
+            _level_capacity, nullptr, it->first, it->second);
+        if (x == nullptr) {
+            toscreen << "Load key: " << _tostr(it->first) << " failed since allocating memory failed.\n";
+            break;
+        }
+        if (_level < new_node_level) {
+            _level = new_node_level;
+        }
+        ++_length;
+        for (int i = 0; i < new_node_level; ++i) {
+            last[i]->levels[i].forward = x;
+            last[i]->levels[i].span = _length - rank[i];
+            last[i] = x;
+            rank[i] = _length;
+        }
+        x->backward = _tail;
+        _tail = x;
+        _bytes += _node_bytes(x);
+        ++loaded;
+    }
+    
+    if (path_valid) {
+        _fix_tail_spans(last, rank);
+    }
+    return loaded;
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::_fix_tail_spans(Node<KeyType, ValType>** last, int* rank) {
+    // The span of the last node at each level reaches the end of the list, as _insert leaves it.
+    for (int i = 0; i < _level; ++i) {
+        last[i]->levels[i].span = _length - rank[i];
+    }
+}
+
 template <typename KeyType, typename ValType>
 int SkipList<KeyType, ValType>::get(const KeyType& key, ValType& val) {
     // Temporary pointer.
@@ -183,7 +394,15 @@ int SkipList<KeyType, ValType>::get(const KeyType& key, ValType& val) {
             _cmp(x->levels[i].forward->key, key) <= 0) {
             rank += x->levels[i].span; // Update the steps.
             if (_cmp(x->levels[i].forward->key, key) == 0) {
-                // Founded.
+                if (_dead(x->levels[i].forward, now_ms())) {
+                    // Deleted or expired, it will be removed later.
+                    return -1;
+                }
+                // Founded. Only CLOCK needs the bit, so readers don't write the node otherwise.
+                // Readers under a shared lock may set it together, so it's written atomically.
+                if (_evict_policy == EVICT_CLOCK) {
+                    __atomic_store_n(&x->levels[i].forward->referenced, true, __ATOMIC_RELAXED);
+                }
                 val = x->levels[i].forward->val;
                 return rank;
             }
@@ -195,11 +414,150 @@ int SkipList<KeyType, ValType>::get(const KeyType& key, ValType& val) {
     return -1;
 }
 
+template <typename KeyType, typename ValType>
+Node<KeyType, ValType>* SkipList<KeyType, ValType>::_find(const KeyType& key) {
+    Node<KeyType, ValType>* x = _head;
+    for (int i = _level - 1; i >= 0; --i) {
+        while (x->levels[i].forward != nullptr && _cmp(x->levels[i].forward->key, key) < 0) {
+            x = x->levels[i].forward;
+        }
+    }
+    x = x->levels[0].forward;
+    if (x != nullptr && _cmp(x->key, key) == 0) {
+        return x;
+    }
+    return nullptr;
+}
+
+template <typename KeyType, typename ValType>
+int SkipList<KeyType, ValType>::find(const KeyType& key, ValType& val, bool& deleted) {
+    Node<KeyType, ValType>* x = _find(key);
+    if (x == nullptr) {
+        return 0;
+    }
+    deleted = x->deleted;
+    if (!deleted) {
+        val = x->val;
+    }
+    return 1;
+}
+
+template <typename KeyType, typename ValType>
+Node<KeyType, ValType>* SkipList<KeyType, ValType>::lower_bound(const KeyType& key) {
+    Node<KeyType, ValType>* x = _head;
+    for (int i = _level - 1; i >= 0; --i) {
+        while (x->levels[i].forward != nullptr && _cmp(x->levels[i].forward->key, key) < 0) {
+            x = x->levels[i].forward;
+        }
+    }
+    return x->levels[0].forward;
+}
+
+template <typename KeyType, typename ValType>
+template <typename Visitor>
+size_t SkipList<KeyType, ValType>::walk(Visitor visitor) {
+    size_t visited = 0;
+    for (Node<KeyType, ValType>* x = _head->levels[0].forward; x != nullptr; x = x->levels[0].forward) {
+        ++visited;
+        if (!visitor(x->key, x->val, x->deleted)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::swap(SkipList& other) {
+    std::swap(_head, other._head);
+    std::swap(_tail, other._tail);
+    std::swap(_length, other._length);
+    std::swap(_level, other._level);
+    std::swap(_level_capacity, other._level_capacity);
+    _expire_index.swap(other._expire_index);
+    std::swap(_expire_cursor, other._expire_cursor);
+    std::swap(_bytes, other._bytes);
+    std::swap(_clock_hand, other._clock_hand);
+    std::swap(_tombstones, other._tombstones);
+    std::swap(_compact_key, other._compact_key);
+    std::swap(_compact_resume, other._compact_resume);
+    // The settings stay, an index or a count made by the other settings is made again.
+    if (_use_expire_index != other._use_expire_index) {
+        use_expire_index(_use_expire_index);
+        other.use_expire_index(other._use_expire_index);
+    }
+    if (_entry_bytes != other._entry_bytes) {
+        _count_bytes();
+        other._count_bytes();
+    }
+}
+
+template <typename KeyType, typename ValType>
+template <typename Visitor>
+size_t SkipList<KeyType, ValType>::scan(const KeyType& begin, Visitor visitor) {
+    // Find the last node whose key < begin.
+    Node<KeyType, ValType>* x = _head;
+    for (int i = _level - 1; i >= 0; --i) {
+        while (x->levels[i].forward != nullptr &&
+            _cmp(x->levels[i].forward->key, begin) < 0) {
+            x = x->levels[i].forward;
+        }
+    }
+    // Walk the 0th level.
+    long long now = now_ms();
+    size_t visited = 0;
+    for (x = x->levels[0].forward; x != nullptr; x = x->levels[0].forward) {
+        if (_dead(x, now)) {
+            continue;
+        }
+        ++visited;
+        if (!visitor(x->key, x->val)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+template <typename KeyType, typename ValType>
+template <typename Visitor>
+size_t SkipList<KeyType, ValType>::prefix_scan(const KeyType& prefix, Visitor visitor) {
+    size_t visited = 0;
+    scan(prefix, [&](const KeyType& key, const ValType& val) {
+        if (key.compare(0, prefix.size(), prefix) != 0) {
+            // Out of the prefix range.
+            return false;
+        }
+        ++visited;
+        return static_cast<bool>(visitor(key, val));
+    });
+    return visited;
+}
+
 template <typename KeyType, typename ValType>
 int SkipList<KeyType, ValType>::del(const KeyType& key) {
+    if (_lazy_delete) {
+        // One lookup, no relinking.
+        Node<KeyType, ValType>* x = _head;
+        for (int i = _level - 1; i >= 0; --i) {
+            while (x->levels[i].forward != nullptr &&
+                _cmp(x->levels[i].forward->key, key) <= 0) {
+                x = x->levels[i].forward;
+            }
+            if (x != _head && _cmp(x->key, key) == 0) {
+                break;
+            }
+        }
+        if (x == _head || _cmp(x->key, key) != 0 || x->deleted) {
+            // Not found.
+            return -1;
+        }
+        x->deleted = true;
+        ++_tombstones;
+        return 0;
+    }
+    
     Node<KeyType, ValType>* update[_level_capacity]; // Record the path to the key at each level.
     Node<KeyType, ValType>* x = _head; // Temporary node.
-    for (int i = _level; i >= 0; --i) {
+    for (int i = _level - 1; i >= 0; --i) {
         while (x->levels[i].forward != nullptr && 
             _cmp(x->levels[i].forward->key, key) < 0) {
             x = x->levels[i].forward;    
@@ -212,6 +570,26 @@ int SkipList<KeyType, ValType>::del(const KeyType& key) {
         return -1;
     }
     // Found the key.
+    _remove(x, update);
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::_del_node(Node<KeyType, ValType>* x) {
+    Node<KeyType, ValType>* update[_level_capacity];
+    Node<KeyType, ValType>* y = _head;
+    for (int i = _level - 1; i >= 0; --i) {
+        while (y->levels[i].forward != nullptr && y->levels[i].forward != x &&
+            _cmp(y->levels[i].forward->key, x->key) < 0) {
+            y = y->levels[i].forward;
+        }
+        update[i] = y;
+    }
+    _remove(x, update);
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::_remove(Node<KeyType, ValType>* x, Node<KeyType, ValType>** update) {
     // Update the former node.
     for (int i = 0; i < _level; ++i) {
         if (update[i]->levels[i].forward == x) {
@@ -227,13 +605,195 @@ int SkipList<KeyType, ValType>::del(const KeyType& key) {
     } else {
         _tail = x->backward;
     }
+    // Move the cursors away from x.
+    if (_expire_cursor == x) {
+        _expire_cursor = x->levels[0].forward;
+    }
+    if (_clock_hand == x) {
+        _clock_hand = x->levels[0].forward;
+    }
+    if (x->deleted) {
+        --_tombstones;
+    }
+    _set_expire_time(x, 0);
+    _bytes -= _node_bytes(x);
     // Update the length.
     --_length;
     // Free the memory.
     delete x;
+}
+
+template <typename KeyType, typename ValType>
+size_t SkipList<KeyType, ValType>::compact(size_t budget) {
+    if (_tombstones == 0) {
+        _compact_resume = false;
+        return 0;
+    }
+    // Find the last node before the start position at each level.
+    Node<KeyType, ValType>* update[_level_capacity];
+    Node<KeyType, ValType>* x = _head;
+    for (int i = _level - 1; i >= 0; --i) {
+        while (_compact_resume && x->levels[i].forward != nullptr &&
+            _cmp(x->levels[i].forward->key, _compact_key) < 0) {
+            x = x->levels[i].forward;
+        }
+        update[i] = x;
+    }
+    // Sweep the 0th level, update[i] keeps being the last node before x at level i.
+    size_t removed = 0;
+    x = update[0]->levels[0].forward;
+    for (size_t visited = 0; x != nullptr && visited < budget; ++visited) {
+        Node<KeyType, ValType>* next = x->levels[0].forward;
+        if (x->deleted) {
+            _remove(x, update);
+            ++removed;
+        } else {
+            // A node at level i is also at all lower levels.
+            for (int i = 0; i < _level && update[i]->levels[i].forward == x; ++i) {
+                update[i] = x;
+            }
+        }
+        x = next;
+    }
+    _compact_resume = (x != nullptr);
+    if (_compact_resume) {
+        _compact_key = x->key;
+    }
+    return removed;
+}
+
+template <typename KeyType, typename ValType>
+int SkipList<KeyType, ValType>::expire_at(const KeyType& key, long long expire_time) {
+    Node<KeyType, ValType>* x = _head;
+    for (int i = _level - 1; i >= 0; --i) {
+        while (x->levels[i].forward != nullptr &&
+            _cmp(x->levels[i].forward->key, key) < 0) {
+            x = x->levels[i].forward;
+        }
+    }
+    x = x->levels[0].forward;
+    if (x == nullptr || _cmp(x->key, key) != 0 || _dead(x, now_ms())) {
+        return -1;
+    }
+    _set_expire_time(x, expire_time);
     return 0;
 }
 
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::_set_expire_time(Node<KeyType, ValType>* x, long long expire_time) {
+    if (_use_expire_index && x->expire_time != 0) {
+        _expire_index.erase(std::make_pair(x->expire_time, x));
+    }
+    x->expire_time = expire_time;
+    if (_use_expire_index && expire_time != 0) {
+        _expire_index.insert(std::make_pair(expire_time, x));
+    }
+}
+
+template <typename KeyType, typename ValType>
+size_t SkipList<KeyType, ValType>::expire_some(size_t budget) {
+    long long now = now_ms();
+    size_t removed = 0;
+    if (_use_expire_index) {
+        // Only the front of the index can be expired.
+        while (removed < budget && !_expire_index.empty() &&
+            _expire_index.begin()->first <= now) {
+            _del_node(_expire_index.begin()->second);
+            ++removed;
+        }
+        return removed;
+    }
+    // Check the nodes one by one, continue from the last position.
+    for (size_t i = 0; i < budget && _length > 0; ++i) {
+        if (_expire_cursor == nullptr) {
+            _expire_cursor = _head->levels[0].forward;
+        }
+        Node<KeyType, ValType>* x = _expire_cursor;
+        _expire_cursor = x->levels[0].forward;
+        if (_expired(x, now)) {
+            _del_node(x);
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::use_expire_index(bool flag) {
+    _expire_index.clear();
+    _use_expire_index = flag;
+    if (!flag) {
+        return;
+    }
+    for (Node<KeyType, ValType>* x = _head->levels[0].forward; x != nullptr; x = x->levels[0].forward) {
+        if (x->expire_time != 0) {
+            _expire_index.insert(std::make_pair(x->expire_time, x));
+        }
+    }
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::_count_bytes() {
+    _bytes = 0;
+    for (Node<KeyType, ValType>* x = _head->levels[0].forward; x != nullptr; x = x->levels[0].forward) {
+        _bytes += _node_bytes(x);
+    }
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::set_memory_limit(size_t max_entries, size_t max_bytes, 
+    EvictPolicy policy, size_t (*entry_bytes)(const KeyType&, const ValType&)) {
+    _max_entries = max_entries;
+    _max_bytes = max_bytes;
+    _evict_policy = policy;
+    // Recount the bytes since the way of counting may change.
+    _entry_bytes = entry_bytes;
+    _count_bytes();
+    if (_over_limit() && _evict_policy != EVICT_NONE) {
+        _evict(nullptr);
+    }
+}
+
+template <typename KeyType, typename ValType>
+void SkipList<KeyType, ValType>::_evict(Node<KeyType, ValType>* keep) {
+    long long now = now_ms();
+    while (_over_limit() && _length > (keep == nullptr ? 0 : 1)) {
+        Node<KeyType, ValType>* victim = nullptr;
+        if (_evict_policy == EVICT_SMALLEST) {
+            victim = _head->levels[0].forward;
+            if (victim == keep) {
+                victim = victim->levels[0].forward;
+            }
+        } else {
+            // Move the clock hand, each referenced node gets a second chance.
+            // Every node passed has its bit cleared, so it's amortized O(1) per eviction.
+            while (victim == nullptr) {
+                if (_clock_hand == nullptr) {
+                    _clock_hand = _head->levels[0].forward;
+                }
+                Node<KeyType, ValType>* x = _clock_hand;
+                _clock_hand = x->levels[0].forward;
+                if (x == keep) {
+                    continue;
+                }
+                if (__atomic_load_n(&x->referenced, __ATOMIC_RELAXED) && !_dead(x, now)) {
+                    __atomic_store_n(&x->referenced, false, __ATOMIC_RELAXED);
+                    continue;
+                }
+                victim = x;
+            }
+        }
+        _on_evict(victim->key);
+        _del_node(victim);
+    }
+}
+
+template <typename KeyType, typename ValType>
+long long SkipList<KeyType, ValType>::now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
 template <typename KeyType, typename ValType>
 int SkipList<KeyType, ValType>::_random_level() {
     static bool first_time = true;
@@ -7,42 +7,89 @@
 
 #include <stdio.h>
 #include <iostream>
+#include <vector>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <semaphore.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
 
 #define toscreen std::cout<<__FILE__<<", "<<__LINE__<<": "
 
 namespace {
 
 const size_t DEFAULT_LEVEL = 32;
-const size_t INITIALIZE_CAPACITY = 1;
-const char* CHECKSUM_STRING = "012345678";
+const size_t SLAB_BYTES = 4096; // Slots of a height are carved from the node heap by slabs of this size.
+const size_t INITIALIZE_SLABS = 1;
+const size_t MAX_EXTENTS = 48; // Each extent is at least as large as all former ones.
+const size_t EXTENT_SHIFT = 40; // Node position: [EXTENT][OFFSET IN THE EXTENT OF 40 BITS].
+const size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024; // Extents are rounded to it with SMSL_HINT_HUGETLB.
+const size_t BLOB_CLASSES = 128; // Size classes of the blob heap, the largest one is 128GB.
+const char* CHECKSUM_STRING = "SMSLEXTS5"; // Segments of the former layout are formatted again.
 
 }; // End anoyomous namespace.
 
 namespace smsl {
 
+// Where the skiplist lives.
+enum SmslBackend {
+    SMSL_SYSV, // SysV shared memory keyed by ftok(shm_path), the extents are private segments.
+    SMSL_SHM, // POSIX shared memory named by shm_path, see shm_open. Limited by /dev/shm instead of shmmax.
+    SMSL_FILE, // A regular file at shm_path mapped by MAP_SHARED, it survives reboots after sync.
+    SMSL_MEMFD // Anonymous memory file, shared with the processes forked later. shm_path is only its name.
+};
+
+// Hints of the mapping, OR them together.
+enum SmslHint {
+    SMSL_HINT_HUGETLB = 1, // Explicit huge pages, SMSL_SYSV and SMSL_MEMFD only, they must be reserved.
+    SMSL_HINT_THP = 2, // madvise(MADV_HUGEPAGE), transparent huge pages for the mapped extents.
+    SMSL_HINT_RANDOM = 4 // madvise(MADV_RANDOM), searches jump around, don't read ahead the file pages.
+};
+
 struct SmslData {
     char checksum[10]; // Check if this part is a created data.
     size_t length; // Elements numbers.
-    size_t capacity; // The number of elements that the allocated memory can storage.
+    size_t capacity; // Bytes of the node heap in all extents.
+    size_t heap_used; // Bytes of the last extent carved into slabs.
+    size_t extents; // Number of extents of the node heap.
+    size_t extent_bytes[MAX_EXTENTS]; // Bytes of each extent.
+    int extent_ids[MAX_EXTENTS]; // Shmid of each extent with SMSL_SYSV, the first one is this segment.
+    size_t extent_offsets[MAX_EXTENTS]; // Offset of each extent in the file with the other backends.
+    size_t file_bytes; // Bytes of the file, the next extent is appended there.
     size_t tail; // Position of the tail node.
     size_t level_capacity; // The allowed maximum levels.
     size_t level; // The maximum levels of all nodes.
+    size_t max_length; // The maximum elements numbers, 0 means no limit.
+    pthread_mutex_t write_lock; // Robust and process shared, serializes set and del of all processes.
+    uint64_t sequence; // Odd while a writer is changing the skiplist, get retries on it.
+    size_t free_blobs[BLOB_CLASSES]; // Head of the free blob list of each size class, 0 means empty.
 
     /**
      * Data structure:
-     *     1. SmslNode[capacity + 1]:
-     *           KeyType, ValType, size_t, SmslLevel[level_capacity].
-     *     2. size_t space_status[capacity + 1].
-     *     3. size_t next_free_space.
-     *     4. size_t space_status_index[capacity + 1];
+     *     1. size_t free_slots[level_capacity + 1]:
+     *           Head of the free slot list of each height, 0 means empty.
+     *     2. The first extent of the node heap:
+     *           The head node of level_capacity levels at offset 0, then slabs.
+     *           A slab only has slots of one height:
+     *           KeyType, ValType, size_t, size_t, SmslLevel[height].
+     * The slabs of the blob heap are carved the same way, a slab only has blobs of one size class.
+     * The other extents only hold slabs. They are private shared_memory segments
+     * attached by their shmids, or later ranges of the file grown by ftruncate.
+     * A node is addressed by its extent and its offset, so the heap grows
+     * by adding an extent, the existing ones never move.
+     * A node only carries the levels it uses, most nodes have 1 or 2 levels,
+     * so a slot is much smaller than one of level_capacity levels, and the tall nodes
+     * visited by every search are packed in few pages.
      */
     // This place storages the data.
 };
@@ -53,12 +100,26 @@ struct SmslLevel {
     size_t span;
 };
 
+// Variable-length bytes, a key or a val of Smsl<SmslBlob, ...>.
+// Set copies the bytes into the blob heap of the segment and the entry only keeps their position,
+// so the memory of an entry follows its length. The bytes are freed with the entry.
+// The compare function, the scan visitor and get see data pointing at the bytes in this process.
+struct SmslBlob {
+    SmslBlob() : pos(0), bytes(0), data(nullptr) {}
+    SmslBlob(const void* data_in, size_t bytes_in) :
+        pos(0), bytes(bytes_in), data(static_cast<const char*>(data_in)) {}
+    size_t pos; // Position of the bytes in the blob heap, 0 means they are only at data.
+    size_t bytes;
+    const char* data;
+};
+
 template <typename KeyType, typename ValType>
 struct SmslNode {
-    SmslNode() : backward(0) {}
+    SmslNode() : backward(0), height(0) {}
     KeyType key;
     ValType val;
-    size_t backward;
+    size_t backward; // Next free slot of the same height when the slot is free.
+    size_t height; // Levels of the node, tells the slab class when it's freed.
 
     // This place storages the levels.
 
@@ -70,9 +131,14 @@ public:
     /**
      * Construct function. 2 functions needed.
      * @param shm_path: Same shm_path will reflect the same data part.
+     * @param resume: Use the existing skiplist, or format the storage. Except SMSL_SYSV,
+     *     formatting fails while another process has the storage attached.
+     * @param backend: See SmslBackend, all processes of a skiplist must use the same one.
+     * @param hints: SmslHint flags.
      */
     Smsl(const std::string& shm_path, int (*cmp_fun)(const KeyType&, const KeyType&),
-        std::string (*key_to_str)(const KeyType&), bool resume = true, int level_in = DEFAULT_LEVEL);
+        std::string (*key_to_str)(const KeyType&), bool resume = true, int level_in = DEFAULT_LEVEL,
+        SmslBackend backend = SMSL_SYSV, int hints = 0);
     virtual ~Smsl();
 
     /**
@@ -86,6 +152,8 @@ public:
      * Return the steps between the beginning to the key.
      * If not existing, return -1.
      * If not successful, variable val won't be modified.
+     * A SmslBlob val is copied out of the segment, its data is valid until the next get of this thread.
+     * It takes no lock, the search is retried if a writer of any process changed the skiplist meanwhile.
      */
     int get(const KeyType& key, ValType& val);
 
@@ -95,11 +163,28 @@ public:
      */
     int del(const KeyType& key);
 
+    /**
+     * Visit the entries whose key >= begin in order.
+     * The visitor is called as visitor(key, val) and returns false to stop.
+     * The visitor runs under the writer lock, it must not call set or del, and it should
+     * not block. Copy a bounded batch, stop, and scan again from its last key instead.
+     * Return the number of visited entries.
+     */
+    template <typename Visitor>
+    size_t scan(const KeyType& begin, Visitor visitor);
+
+    /**
+     * Write the dirty pages back to the file with msync, only SMSL_FILE reaches the disk.
+     * Sync when no set or del is running, then the file restarts instantly from that state,
+     * even after a reboot. Return 0 means success.
+     */
+    int sync();
+    
     /**
      * Return the elements numbers.
      */
     size_t size() {
-        return _data->length;
+        return __atomic_load_n(&_data->length, __ATOMIC_RELAXED);
     }
 
     /**
@@ -109,35 +194,128 @@ public:
         _quit_clean = flag;
     }
 
+    /**
+     * Limit the elements numbers, 0 means no limit.
+     * When a set goes beyond the limit, the smallest key is evicted inline,
+     * so the shared memory stops growing instead of expanding until shmget fails.
+     * The limit is kept in the shared memory, it binds all attached processes and it's resumed.
+     */
+    void set_max_length(size_t max_length) {
+        __atomic_store_n(&_data->max_length, max_length, __ATOMIC_RELAXED);
+    }
+
 private:
     SmslData* _data; // The data position.
+    char* _extents[MAX_EXTENTS]; // Where each extent is attached in this process.
+    size_t _extent_bytes[MAX_EXTENTS]; // Bytes of each attached extent, they never change.
+    size_t _attached; // Number of extents attached in this process.
+    pthread_mutex_t _attach_lock; // Serializes attaching the extents in this process.
     int (*_cmp)(const KeyType&, const KeyType&); // Compare function, used for sorting.
     std::string (*_key2str)(const KeyType&); // Function to show the key.
     std::string _shmpath; // The path of the shared_memory.
     int _shmid; // The id of the shared_memory.
+    SmslBackend _backend;
+    int _hints;
+    int _fd; // The mapped file of the backends except SMSL_SYSV.
+    size_t _mapped_bytes; // Bytes of the first extent mapped in this process.
     bool _quit_clean; // If true, it will free the shared memory at distruction method.
+    
+    /**
+     * The layout cached on attach, so the hot paths don't derive it from _data.
+     */
+    size_t* _free_slots; // Free slot list heads, right after SmslData.
+    SmslNode<KeyType, ValType>* _head; // The head node, at offset 0 of the first extent.
+    size_t _level_capacity;
 
     /**
      * Functions to find the correct pointer in data.
      * If allowed, it is recommended that these functions be inline functions.
      * These functions will be called frequently, inline is better.
      */
-    SmslNode<KeyType, ValType>*  _get_node(size_t node_pos);
+    SmslNode<KeyType, ValType>*  _get_node(size_t node_pos); // nullptr if its extent cannot be attached.
+    int _attach_extents(); // Attach the extents added by other processes. Return 0 means OK.
+    int _attach_extents_locked();
+    SmslNode<KeyType, ValType>* _peek_node(size_t node_pos, size_t level_num); // nullptr if out of the heap.
+    char* _get_bytes(size_t pos); // Like _get_node. The writers attach all extents in _lock.
+    char* _peek_bytes(size_t pos, size_t bytes);
+    
+    /**
+     * Functions of the backends.
+     * Function: _open_storage maps the first extent, of at least bytes if it's created.
+     * The file stays locked exclusively until the constructor formats or resumes it,
+     * alone tells if no other process had it. It's always false for SMSL_SYSV.
+     * Function: _map_extent maps a recorded extent, _add_extent creates one and records it.
+     */
+    SmslData* _open_storage(size_t bytes, bool resume, size_t& mapped_bytes, bool& alone);
+    char* _map_extent(size_t extent, size_t bytes);
+    char* _add_extent(size_t bytes);
+    void _advise(char* base, size_t bytes);
+    size_t _round_page(size_t bytes);
+    std::string _shm_name(); // The name given to shm_open.
     SmslLevel* _get_level(size_t node_pos, size_t level_num);
     SmslLevel* _get_level(SmslNode<KeyType, ValType>* node, size_t level_num);
 
     /**
      * Functions to allocate and deallocate a node.
-     * Function: _allocate_new_space considers the space is enough.
-     * It won't check whether the shared_memory space has margin.
-     */
-    size_t* _get_space_status();
-    size_t* _get_next_free_space();
-    size_t* _get_space_status_index();
-    size_t _allocate_new_space(const KeyType&, const ValType&, size_t backward);
-    int _expansion();
+     * Function: _allocate_new_space takes a free slot of the height,
+     * or carves a new slab from the last extent, adding an extent if it's full.
+     * It returns 0 if no extent can be added, the existing data is kept.
+     */
+    void _cache_layout(size_t level_capacity);
+    static size_t _slot_bytes(size_t height);
+    static size_t _segment_bytes(size_t level_capacity, size_t first_extent_bytes);
+    size_t _allocate_new_space(const KeyType&, const ValType&, size_t backward, size_t height);
+    size_t _carve(size_t bytes); // Take bytes from the last extent, adding an extent if it's full.
+    int _expansion(size_t need_bytes);
     void _free_node(size_t node_pos);
 
+    /**
+     * Functions of the blob heap, only the SmslBlob overloads do more than copying.
+     * Function: _store copies the bytes into a blob of their size class, _release frees it.
+     * Function: _view points data at the bytes, it returns nullptr if a concurrent writer
+     * made the blob stale. _load is _view for get, the bytes are copied out of the segment.
+     */
+    static size_t _blob_class(size_t bytes, size_t& class_bytes);
+    template <typename T>
+    int _store(T& slot, const T& obj) {
+        slot = obj;
+        return 0;
+    }
+    int _store(SmslBlob& slot, const SmslBlob& obj);
+    template <typename T>
+    void _release(T&) {}
+    void _release(SmslBlob& slot);
+    template <typename T>
+    const T* _view(const T& stored, T&) {
+        return &stored;
+    }
+    const SmslBlob* _view(const SmslBlob& stored, SmslBlob& local);
+    template <typename T>
+    bool _load(const T& stored, T& out) {
+        out = stored;
+        return true;
+    }
+    bool _load(const SmslBlob& stored, SmslBlob& out);
+    
+    /**
+     * Functions of the concurrency control.
+     * Function: _set and _del change the skiplist, the caller holds the writer lock.
+     * Function: _search is one try of get, it returns -2 if the skiplist changed meanwhile.
+     * Function: _begin_write and _end_write make the sequence odd and then even again.
+     * Function: _repair rebuilds the skiplist from its 0th level after a writer died.
+     * Function: _init_write_lock makes the writer lock robust and shared by the processes.
+     */
+    int _set(const KeyType& key, const ValType& value);
+    int _del(const KeyType& key);
+    int _search(const KeyType& key, ValType& val, uint64_t sequence);
+    int _lock(); // Return 0 means locked, -1 means failed and the lock isn't held.
+    void _init_write_lock();
+    void _unlock();
+    void _begin_write();
+    void _end_write();
+    void _wait_writer(size_t attempt);
+    void _repair();
+    
     /**
      * Tool functions.
      */
@@ -12,9 +12,35 @@ namespace smsl {
 
 template <typename KeyType, typename ValType>
 Smsl<KeyType, ValType>::~Smsl() {
-    if (_shmid != -1 && _quit_clean) {
+    if (_data == nullptr) {
+        return;
+    }
+    if (_quit_clean) {
         toscreen << "Clean the shared_memory.\n";
-        shmctl(_shmid, IPC_RMID, nullptr);
+    }
+    pthread_mutex_destroy(&_attach_lock);
+    if (_backend == SMSL_SYSV) {
+        for (size_t i = 1; i < _attached; ++i) {
+            shmdt(_extents[i]);
+        }
+        for (size_t i = 1; _quit_clean && i < _data->extents; ++i) {
+            shmctl(_data->extent_ids[i], IPC_RMID, nullptr);
+        }
+        shmdt(_data);
+        if (_quit_clean) {
+            shmctl(_shmid, IPC_RMID, nullptr);
+        }
+        return;
+    }
+    for (size_t i = 1; i < _attached; ++i) {
+        munmap(_extents[i], _data->extent_bytes[i]);
+    }
+    munmap(_data, _mapped_bytes);
+    close(_fd);
+    if (_quit_clean && _backend == SMSL_FILE) {
+        unlink(_shmpath.c_str());
+    } else if (_quit_clean && _backend == SMSL_SHM) {
+        shm_unlink(_shm_name().c_str());
     }
 }
 
@@ -22,78 +48,126 @@ template <typename KeyType, typename ValType>
 Smsl<KeyType, ValType>::Smsl(const std::string& shm_path,
     int (*cmp_fun)(const KeyType&, const KeyType&),
     std::string (*key_to_str)(const KeyType&),
-    bool resume, int level_in) :
+    bool resume, int level_in, SmslBackend backend, int hints) :
     _cmp(cmp_fun), _key2str(key_to_str), _shmpath(shm_path), 
-    _quit_clean(false), _shmid(-1), _data(nullptr) {
+    _quit_clean(false), _shmid(-1), _backend(backend), _hints(hints), _fd(-1), _mapped_bytes(0),
+    _data(nullptr), _attached(0) {
+    pthread_mutex_init(&_attach_lock, nullptr);
     // Get or create the shared_memory.
-    key_t shm_key = ftok(shm_path.c_str(), 666);
-    if (shm_key == (key_t)-1) {
-        toscreen << "Get shm_key failed.\n";
-        return;
-    } else {
-        toscreen << "Got shm_key: " << (int)shm_key << ".\n";
-    }
-    size_t node_bytes = sizeof(SmslNode<KeyType, ValType>) + sizeof(SmslLevel) * level_in;
-    size_t total_bytes = sizeof(SmslData) + node_bytes * (INITIALIZE_CAPACITY + 1);
-    total_bytes += sizeof(size_t) * (INITIALIZE_CAPACITY * 2 + 3);
-    _shmid = shmget(shm_key, total_bytes, IPC_CREAT | 0666); // total_bytes is the minimum space needed.
-    if (_shmid == -1) {
-        toscreen << "Get shmid failed.\n";
-        perror("shmget");
-        return;
-    } else {
-        toscreen << "Got shmid: " << _shmid << ".\n";
-    }
-    _data = (SmslData*)shmat(_shmid, (void*)0, 0);
-    if (_data == (void*)-1) {
-        toscreen << "Get logic data address failed.\n";
-        perror("shmat");
+    size_t initial_capacity = _slot_bytes(level_in) + SLAB_BYTES * INITIALIZE_SLABS;
+    bool alone = false;
+    _data = _open_storage(_segment_bytes(level_in, initial_capacity), resume, _mapped_bytes, alone);
+    if (_data == nullptr) {
+        pthread_mutex_destroy(&_attach_lock);
         return;
     }
-
+    _free_slots = reinterpret_cast<size_t*>(reinterpret_cast<char*>(_data) + sizeof(SmslData));
+    
     // Check if the shared memory is a created data.
     _data->checksum[9] = '\0';
-    if (resume && strcmp(_data->checksum, CHECKSUM_STRING) == 0) {
+    bool created = (strcmp(_data->checksum, CHECKSUM_STRING) == 0);
+    if (resume && created) {
+        _cache_layout(_data->level_capacity);
+        if (_attach_extents() != 0) {
+            toscreen << "Attach the extents failed.\n";
+            pthread_mutex_destroy(&_attach_lock);
+            _data = nullptr;
+            if (_fd != -1) {
+                close(_fd);
+                _fd = -1;
+            }
+            return;
+        }
+        if (alone) {
+            // No process is attached, the owner of the writer lock recorded in the file may be
+            // a thread of the former boot, which the robust mutex cannot detect.
+            _init_write_lock();
+            if (_data->sequence % 2 == 1) {
+                toscreen << "The former writer died, repair the skiplist.\n";
+                _repair();
+            }
+        }
+        if (_fd != -1) {
+            flock(_fd, LOCK_SH);
+        }
         toscreen << "Successfully initializing from existing skiplist. "
                   << "Elements num: " << _data->length << ".\n";
         return;
     }
-
-    // Format the memory.
-    strncpy(_data->checksum, CHECKSUM_STRING, 9);
+    
+    // Format the memory, the extents of the former skiplist are freed.
+    // The file of the other backends was truncated when opening.
+    for (size_t i = 1; created && _backend == SMSL_SYSV && i < _data->extents; ++i) {
+        shmctl(_data->extent_ids[i], IPC_RMID, nullptr);
+    }
+    _data->checksum[0] = '\0';
     _data->length = 0;
     _data->level = 1;
     _data->level_capacity = level_in;
+    _data->max_length = 0;
     _data->tail = 0;
-    _data->capacity = INITIALIZE_CAPACITY;
+    _data->capacity = _mapped_bytes - _segment_bytes(level_in, 0); // The rounded up part is also used.
+    _data->heap_used = _slot_bytes(level_in);
+    _data->extents = 1;
+    _data->extent_bytes[0] = _data->capacity;
+    _data->extent_ids[0] = _shmid;
+    _data->extent_offsets[0] = 0;
+    _data->file_bytes = _mapped_bytes;
+    _data->sequence = 0;
+    _cache_layout(level_in);
+    _init_write_lock();
     // Initialize the head node.
     SmslNode<KeyType, ValType>* head = _get_node(0);
     head->backward = 0;
+    head->height = level_in;
     SmslLevel* head_levels = _get_level(head, 0);
     new(head_levels) SmslLevel[level_in];
     // Initialize the space allocator info.
-    for (size_t i = 0; i <= INITIALIZE_CAPACITY; ++i) {
-        _get_space_status()[i] = i;
-        _get_space_status_index()[i] = i;
+    for (size_t i = 0; i <= (size_t)level_in; ++i) {
+        _free_slots[i] = 0;
     }
-    (*_get_next_free_space()) = 1;
-
+    for (size_t i = 0; i < BLOB_CLASSES; ++i) {
+        _data->free_blobs[i] = 0;
+    }
+    // The checksum goes last, a segment formatted partly is never resumed.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    strncpy(_data->checksum, CHECKSUM_STRING, 9);
+    // Let the other processes attach it.
+    if (_fd != -1) {
+        flock(_fd, LOCK_SH);
+    }
+    
     toscreen << "Successfully initializing a new skiplist.\n";
 }
 
 template <typename KeyType, typename ValType>
 int Smsl<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
-    size_t update[_data->level_capacity];
-    size_t rank[_data->level_capacity];
-    size_t x = 0;
+    if (_lock() != 0) {
+        return -1;
+    }
+    int ret = _set(key, value);
+    _unlock();
+    return ret;
+}
 
-    if (_data->length == _data->capacity) {
-        if (_expansion() != 0) {
-            toscreen << "The memory cannot storage more nodes, set failed.\n";
-            return -2;
-        }
+template <typename KeyType, typename ValType>
+int Smsl<KeyType, ValType>::del(const KeyType& key) {
+    if (_lock() != 0) {
+        return -1;
     }
+    int ret = _del(key);
+    _unlock();
+    return ret;
+}
 
+template <typename KeyType, typename ValType>
+int Smsl<KeyType, ValType>::_set(const KeyType& key, const ValType& value) {
+    size_t update[_level_capacity];
+    size_t rank[_level_capacity];
+    size_t x = 0;
+    SmslNode<KeyType, ValType>* x_node = _head;
+    KeyType local_key;
+    
     // Find the path to reach the key at each level.
     for (int64_t i = _data->level - 1; i >= 0; --i) {
         if (i == _data->level - 1) {
@@ -101,11 +175,12 @@ int Smsl<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
         } else {
             rank[i] = rank[i + 1];
         }
-
+    
         // Search until the i th level's node has a bigger key.
-        while (_get_level(x, i)->forward != 0) {
-            SmslNode<KeyType, ValType>* forward_node = _get_node(_get_level(x, i)->forward);
-            int cmp_res = _cmp(forward_node->key, key);
+        SmslLevel* x_level = _get_level(x_node, i);
+        while (x_level->forward != 0) {
+            SmslNode<KeyType, ValType>* forward_node = _get_node(x_level->forward);
+            int cmp_res = _cmp(*_view(forward_node->key, local_key), key);
             if (cmp_res == 0) {
                 // Already having the key.
                 return 1;
@@ -114,8 +189,10 @@ int Smsl<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
                 // X's forward is out range, do not pass by x's forward.
                 break;
             }
-            rank[i] += _get_level(x, i)->span;
-            x = _get_level(x, i)->forward;
+            rank[i] += x_level->span;
+            x = x_level->forward;
+            x_node = forward_node;
+            x_level = _get_level(x_node, i);
         }
 
         // Find the node, where it should pass to reach the key at level i.
@@ -123,7 +200,16 @@ int Smsl<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
     }
 
     // Generate a level behind which the new index be constructed.
+    // The slot only has these levels, allocate it before changing anything.
+    // Readers retry if they overlap from here to the end of the change.
+    _begin_write();
     size_t new_node_level = _random_level();
+    x = _allocate_new_space(key, value, 0, new_node_level);
+    if (x == 0) {
+        _end_write();
+        toscreen << "The memory cannot storage more nodes, set failed.\n";
+        return -2;
+    }
     if (_data->level < new_node_level) {
         for (size_t i = _data->level; i < new_node_level; ++i) {
             rank[i] = 0;
@@ -134,8 +220,6 @@ int Smsl<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
     }
 
     // Put the new node at the correct place.
-    x = _allocate_new_space(key, value, 0);
-    toscreen << "New element pos: " << x << std::endl;
     for (size_t i = 0; i < new_node_level; ++i) {
         _get_level(x, i)->forward = _get_level(update[i], i)->forward;
         _get_level(update[i], i)->forward = x;
@@ -152,20 +236,37 @@ int Smsl<KeyType, ValType>::set(const KeyType& key, const ValType& value) {
         _data->tail = x;
     }
     ++_data->length;
+    _end_write();
+    
+    // Evict the smallest key except the new one.
+    size_t max_length = __atomic_load_n(&_data->max_length, __ATOMIC_RELAXED);
+    if (max_length != 0 && _data->length > max_length) {
+        size_t victim = _get_level((size_t)0, 0)->forward;
+        if (victim == x) {
+            victim = _get_level(x, 0)->forward;
+        }
+        KeyType victim_key = *_view(_get_node(victim)->key, local_key);
+        _del(victim_key);
+    }
     return 0;
 }
 
 template <typename KeyType, typename ValType>
-int Smsl<KeyType, ValType>::del(const KeyType& key) {
-    size_t update[_data->level_capacity];
+int Smsl<KeyType, ValType>::_del(const KeyType& key) {
+    size_t update[_level_capacity];
     size_t x = 0;
-
+    SmslNode<KeyType, ValType>* x_node = _head;
+    KeyType local_key;
+    
     // Find the path to reach key.
-    for (int64_t i = _data->level; i >=0; --i) {
-        while (_get_level(x, i)->forward != 0) {
-            SmslNode<KeyType, ValType>* forward_node = _get_node(_get_level(x, i)->forward);
-            if (_cmp(forward_node->key, key) < 0) {
-                x = _get_level(x, i)->forward;
+    for (int64_t i = _data->level - 1; i >=0; --i) {
+        SmslLevel* x_level = _get_level(x_node, i);
+        while (x_level->forward != 0) {
+            SmslNode<KeyType, ValType>* forward_node = _get_node(x_level->forward);
+            if (_cmp(*_view(forward_node->key, local_key), key) < 0) {
+                x = x_level->forward;
+                x_node = forward_node;
+                x_level = _get_level(x_node, i);
             } else {
                 break;
             }
@@ -173,12 +274,13 @@ int Smsl<KeyType, ValType>::del(const KeyType& key) {
         update[i] = x;
     }
     x = _get_level(x, 0)->forward;
-    if (x == 0 || _cmp(_get_node(x)->key, key) != 0) {
+    if (x == 0 || _cmp(*_view(_get_node(x)->key, local_key), key) != 0) {
         // No this key.
         return -1;
     }
 
     // Update the former node of the key.
+    _begin_write();
     for (size_t i = 0; i < _data->level; ++i) {
         if (_get_level(update[i], i)->forward == x) {
             _get_level(update[i], i)->span += _get_level(x, i)->span - 1;
@@ -192,36 +294,107 @@ int Smsl<KeyType, ValType>::del(const KeyType& key) {
     if (_get_level(x, 0)->forward != 0) {
         _get_node(_get_level(x, 0)->forward)->backward = _get_node(x)->backward;
     } else {
-        _data->tail = x;
+        _data->tail = _get_node(x)->backward;
     }
 
     // Update the length.
     --_data->length;
 
-    // Free the memory of x.
+    // Free the memory of x, a reader still on it sees the same levels until it's reused.
     _free_node(x);
+    _end_write();
     return 0;
 }
 
 template <typename KeyType, typename ValType>
 int Smsl<KeyType, ValType>::get(const KeyType& key, ValType& val) {
+    ValType found_val;
+    for (size_t attempt = 1; ; ++attempt) {
+        uint64_t sequence = __atomic_load_n(&_data->sequence, __ATOMIC_ACQUIRE);
+        if (sequence % 2 == 1) {
+            // A writer is changing the skiplist.
+            _wait_writer(attempt);
+            continue;
+        }
+        int rank = _search(key, found_val, sequence);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (rank != -2 && __atomic_load_n(&_data->sequence, __ATOMIC_RELAXED) == sequence) {
+            if (rank != -1) {
+                val = found_val;
+            }
+            return rank;
+        }
+    }
+}
+
+template <typename KeyType, typename ValType>
+template <typename Visitor>
+size_t Smsl<KeyType, ValType>::scan(const KeyType& begin, Visitor visitor) {
+    if (_lock() != 0) {
+        return 0;
+    }
+    // Find the last node whose key < begin.
     size_t x = 0;
+    KeyType local_key;
+    ValType local_val;
+    for (int64_t i = _data->level - 1; i >= 0; --i) {
+        while (_get_level(x, i)->forward != 0 &&
+            _cmp(*_view(_get_node(_get_level(x, i)->forward)->key, local_key), begin) < 0) {
+            x = _get_level(x, i)->forward;
+        }
+    }
+    // Walk the 0th level.
+    size_t visited = 0;
+    for (x = _get_level(x, 0)->forward; x != 0; x = _get_level(x, 0)->forward) {
+        ++visited;
+        SmslNode<KeyType, ValType>* node = _get_node(x);
+        if (!visitor(*_view(node->key, local_key), *_view(node->val, local_val))) {
+            break;
+        }
+    }
+    _unlock();
+    return visited;
+}
+
+template <typename KeyType, typename ValType>
+int Smsl<KeyType, ValType>::_search(const KeyType& key, ValType& val, uint64_t sequence) {
+    // A concurrent writer may leave any node stale, check each one before reading it,
+    // and give up once the sequence moves so a stale cycle cannot trap the reader.
+    SmslNode<KeyType, ValType>* x_node = _head;
+    KeyType local_key;
     int rank = 0;
-    for (int64_t i = _data->level - 1; i >= 0 ; --i) {
-        while (_get_level(x, i)->forward != 0) {
-            SmslNode<KeyType, ValType>* forward_node = _get_node(_get_level(x, i)->forward);
-            int cmp_res = _cmp(forward_node->key, key);
+    size_t steps = 0;
+    size_t level = _data->level;
+    if (level > _level_capacity) {
+        return -2;
+    }
+    for (int64_t i = level - 1; i >= 0 ; --i) {
+        while (true) {
+            SmslLevel* x_level = _get_level(x_node, i);
+            size_t forward = x_level->forward;
+            if (forward == 0) {
+                break;
+            }
+            SmslNode<KeyType, ValType>* forward_node = _peek_node(forward, i);
+            if (forward_node == nullptr ||
+                (++steps % 64 == 0 && __atomic_load_n(&_data->sequence, __ATOMIC_ACQUIRE) != sequence)) {
+                return -2;
+            }
+            const KeyType* forward_key = _view(forward_node->key, local_key);
+            if (forward_key == nullptr) {
+                return -2;
+            }
+            int cmp_res = _cmp(*forward_key, key);
             if (cmp_res > 0) {
                 // Try next level.
                 break;
             }
-            rank += _get_level(x, i)->span;
+            rank += x_level->span;
             if (cmp_res == 0) {
                 // Found.
-                val = _get_node(_get_level(x, i)->forward)->val;
-                return rank;
+                return _load(forward_node->val, val) ? rank : -2;
             }
-            x = _get_level(x, i)->forward;
+            x_node = forward_node;
         }
     }
     // Not found.
@@ -229,135 +402,579 @@ int Smsl<KeyType, ValType>::get(const KeyType& key, ValType& val) {
 }
 
 template <typename KeyType, typename ValType>
-size_t* Smsl<KeyType, ValType>::_get_space_status() {
-    char* pos = reinterpret_cast<char*>(_data);
-    pos += sizeof(SmslData);
-    size_t node_size = sizeof(SmslNode<KeyType, ValType>) + sizeof(SmslLevel) * _data->level_capacity;
-    pos += node_size * (_data->capacity + 1);
-    return reinterpret_cast<size_t*>(pos);
+int Smsl<KeyType, ValType>::_lock() {
+    int ret = pthread_mutex_lock(&_data->write_lock);
+    if (ret != 0 && ret != EOWNERDEAD) {
+        toscreen << "Lock the skiplist failed: " << ret << ".\n";
+        return -1;
+    }
+    // The writer may reach any node, attach the extents added by other processes first.
+    if (__atomic_load_n(&_data->extents, __ATOMIC_ACQUIRE) > _attached && _attach_extents() != 0) {
+        // Without them a dead writer cannot be repaired either, the lock becomes unrecoverable.
+        toscreen << "Attach the extents failed, the skiplist is not changed.\n";
+        pthread_mutex_unlock(&_data->write_lock);
+        return -1;
+    }
+    if (ret == EOWNERDEAD) {
+        // The former writer died holding the lock, maybe in the middle of a change.
+        toscreen << "The former writer died, repair the skiplist.\n";
+        _repair();
+        pthread_mutex_consistent(&_data->write_lock);
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_init_write_lock() {
+    // The writer lock is shared by the processes, and it's released if its owner dies.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&_data->write_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_unlock() {
+    pthread_mutex_unlock(&_data->write_lock);
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_begin_write() {
+    __atomic_store_n(&_data->sequence, _data->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_end_write() {
+    __atomic_store_n(&_data->sequence, _data->sequence + 1, __ATOMIC_RELEASE);
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_wait_writer(size_t attempt) {
+    if (attempt % 1024 != 0) {
+        sched_yield();
+        return;
+    }
+    // Waited long, the writer may be dead. Taking the lock repairs the skiplist in that case.
+    if (_lock() == 0) {
+        _unlock();
+    }
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_repair() {
+    // The 0th level is always linked or unlinked by one store, so it's intact.
+    // Rebuild the other levels, the spans, the backward links and the counters from it.
+    size_t level_capacity = _data->level_capacity;
+    size_t last[level_capacity]; // The last node reaching each level.
+    size_t last_rank[level_capacity];
+    size_t x = _get_level((size_t)0, 0)->forward;
+    for (size_t i = 0; i < level_capacity; ++i) {
+        last[i] = 0;
+        last_rank[i] = 0;
+        _get_level((size_t)0, i)->forward = 0;
+    }
+    size_t length = 0;
+    size_t level = 1;
+    size_t prev = 0;
+    while (x != 0) {
+        SmslNode<KeyType, ValType>* node = _get_node(x);
+        size_t next = _get_level(node, 0)->forward;
+        ++length;
+        node->backward = prev;
+        for (size_t i = 0; i < node->height; ++i) {
+            _get_level(last[i], i)->forward = x;
+            _get_level(last[i], i)->span = length - last_rank[i];
+            last[i] = x;
+            last_rank[i] = length;
+        }
+        level = (node->height > level) ? node->height : level;
+        prev = x;
+        x = next;
+    }
+    for (size_t i = 0; i < level_capacity; ++i) {
+        _get_level(last[i], i)->forward = 0;
+        _get_level(last[i], i)->span = length - last_rank[i];
+    }
+    _data->length = length;
+    _data->level = level;
+    _data->tail = prev;
+    // Let the readers go on, a slot taken or freed in the middle is only leaked.
+    if (_data->sequence % 2 == 1) {
+        _end_write();
+    }
+}
+
+template <typename KeyType, typename ValType>
+SmslNode<KeyType, ValType>* Smsl<KeyType, ValType>::_peek_node(size_t node_pos, size_t level_num) {
+    return reinterpret_cast<SmslNode<KeyType, ValType>*>(_peek_bytes(node_pos, _slot_bytes(level_num + 1)));
+}
+
+template <typename KeyType, typename ValType>
+char* Smsl<KeyType, ValType>::_peek_bytes(size_t pos, size_t bytes) {
+    size_t extent = pos >> EXTENT_SHIFT;
+    size_t offset = pos & ((static_cast<size_t>(1) << EXTENT_SHIFT) - 1);
+    if (extent >= __atomic_load_n(&_attached, __ATOMIC_ACQUIRE) &&
+        (extent >= MAX_EXTENTS || extent >= _data->extents || _attach_extents() != 0)) {
+        return nullptr;
+    }
+    if (bytes > _extent_bytes[extent] || offset > _extent_bytes[extent] - bytes) {
+        return nullptr;
+    }
+    return _extents[extent] + offset;
 }
 
 template <typename KeyType, typename ValType>
-size_t* Smsl<KeyType, ValType>::_get_next_free_space() {
-    char* pos = reinterpret_cast<char*>(_get_space_status());
-    pos += sizeof(size_t) * (_data->capacity + 1);
-    return reinterpret_cast<size_t*>(pos);
+void Smsl<KeyType, ValType>::_cache_layout(size_t level_capacity) {
+    // The head node starts the first extent, right after the free lists.
+    _level_capacity = level_capacity;
+    _extents[0] = reinterpret_cast<char*>(_free_slots + level_capacity + 1);
+    _extent_bytes[0] = _data->extent_bytes[0];
+    _head = reinterpret_cast<SmslNode<KeyType, ValType>*>(_extents[0]);
+    _attached = 1;
 }
 
 template <typename KeyType, typename ValType>
-size_t* Smsl<KeyType, ValType>::_get_space_status_index() {
-    char* pos = reinterpret_cast<char*>(_get_next_free_space());
-    return reinterpret_cast<size_t*>(pos + sizeof(size_t));
+size_t Smsl<KeyType, ValType>::_slot_bytes(size_t height) {
+    size_t bytes = sizeof(SmslNode<KeyType, ValType>) + sizeof(SmslLevel) * height;
+    size_t align = alignof(SmslNode<KeyType, ValType>);
+    return (bytes + align - 1) / align * align;
 }
 
 template <typename KeyType, typename ValType>
-size_t Smsl<KeyType, ValType>::_allocate_new_space(const KeyType& key, const ValType& val, size_t backward) {
-    size_t* new_space = _get_next_free_space();
-    size_t* space_status = _get_space_status();
-    SmslNode<KeyType, ValType>* new_node = _get_node(space_status[*new_space]);
-    new_node->key = key;
-    new_node->val = val;
+size_t Smsl<KeyType, ValType>::_segment_bytes(size_t level_capacity, size_t first_extent_bytes) {
+    return sizeof(SmslData) + sizeof(size_t) * (level_capacity + 1) + first_extent_bytes;
+}
+
+template <typename KeyType, typename ValType>
+size_t Smsl<KeyType, ValType>::_allocate_new_space(const KeyType& key, const ValType& val, 
+    size_t backward, size_t height) {
+    size_t* free_slots = _free_slots;
+    if (free_slots[height] == 0) {
+        // Carve a slab of this height, its slots are linked into the free list.
+        size_t slot_bytes = _slot_bytes(height);
+        size_t slots = (slot_bytes >= SLAB_BYTES) ? 1 : SLAB_BYTES / slot_bytes;
+        size_t slab = _carve(slot_bytes * slots);
+        if (slab == 0) {
+            return 0;
+        }
+        for (size_t i = slots; i > 0; --i) {
+            size_t slot = slab + slot_bytes * (i - 1);
+            _get_node(slot)->backward = free_slots[height];
+            free_slots[height] = slot;
+        }
+    }
+    size_t slot = free_slots[height];
+    SmslNode<KeyType, ValType>* new_node = _get_node(slot);
+    // The slot stays free if the key or the val cannot be stored.
+    if (new_node == nullptr || _store(new_node->key, key) != 0) {
+        return 0;
+    }
+    if (_store(new_node->val, val) != 0) {
+        _release(new_node->key);
+        return 0;
+    }
+    free_slots[height] = new_node->backward;
     new_node->backward = backward;
-    new(_get_level(new_node, 0)) SmslLevel[_data->level_capacity];
-    ++(*new_space);
-    return space_status[*new_space - 1];
+    new_node->height = height;
+    new(_get_level(new_node, 0)) SmslLevel[height];
+    return slot;
+}
+
+template <typename KeyType, typename ValType>
+size_t Smsl<KeyType, ValType>::_carve(size_t bytes) {
+    // The rest of a full extent is left unused, a slab never spans extents.
+    size_t align = alignof(SmslNode<KeyType, ValType>);
+    size_t offset = (_data->heap_used + align - 1) / align * align;
+    if (offset + bytes > _data->extent_bytes[_data->extents - 1]) {
+        if (_expansion(bytes) != 0) {
+            return 0;
+        }
+        offset = 0;
+    }
+    // Take the slab first, if the writer dies while linking it, the rest is only leaked.
+    _data->heap_used = offset + bytes;
+    return ((_data->extents - 1) << EXTENT_SHIFT) + offset;
+}
+
+template <typename KeyType, typename ValType>
+size_t Smsl<KeyType, ValType>::_blob_class(size_t bytes, size_t& class_bytes) {
+    // 16, 32, 48, 64, then 4 classes for each doubling, so a blob wastes at most a quarter.
+    if (bytes <= 64) {
+        size_t blob_class = (bytes == 0) ? 0 : (bytes - 1) / 16;
+        class_bytes = (blob_class + 1) * 16;
+        return blob_class;
+    }
+    size_t group = 0;
+    while ((static_cast<size_t>(128) << group) < bytes) {
+        ++group;
+    }
+    size_t base = static_cast<size_t>(64) << group;
+    size_t step = base / 4;
+    size_t sub = (bytes - base - 1) / step;
+    class_bytes = base + step * (sub + 1);
+    return 4 + group * 4 + sub;
 }
 
 template <typename KeyType, typename ValType>
-int Smsl<KeyType, ValType>::_expansion() {
-    if (_shmid == -1) {
-        toscreen << "No existing shared memory. Expansion failed.\n";
+int Smsl<KeyType, ValType>::_store(SmslBlob& slot, const SmslBlob& obj) {
+    slot.pos = 0;
+    slot.bytes = obj.bytes;
+    slot.data = nullptr;
+    if (obj.bytes == 0) {
+        return 0;
+    }
+    size_t class_bytes = 0;
+    size_t blob_class = _blob_class(obj.bytes, class_bytes);
+    if (blob_class >= BLOB_CLASSES) {
+        toscreen << "The blob of " << obj.bytes << " bytes is too large.\n";
         return -1;
     }
-    // Calculate current shared_memory size.
-    size_t level_capacity = _data->level_capacity;
-    size_t cur_capacity = _data->capacity;
-    size_t node_size = sizeof(SmslNode<KeyType, ValType>) + sizeof(SmslLevel) * level_capacity;
-    size_t shared_size = sizeof(SmslData);
-    shared_size += (cur_capacity + 1) * node_size;
-    shared_size += ((cur_capacity + 1) * 2 + 1) * sizeof(size_t);
-    // Allocate a temporary memory to storage the data of shared_memory.
-    char* temp_mem = (char*)malloc(shared_size);
-    if (temp_mem == nullptr) {
-        toscreen << "Cannot allocate temporary memory. Expansion failed.\n";
+    size_t* free_blobs = _data->free_blobs;
+    if (free_blobs[blob_class] == 0) {
+        // Carve a slab of this class like the nodes, a large blob takes a slab of its own.
+        size_t blobs = (class_bytes >= SLAB_BYTES) ? 1 : SLAB_BYTES / class_bytes;
+        size_t slab = _carve(class_bytes * blobs);
+        if (slab == 0) {
+            return -1;
+        }
+        for (size_t i = blobs; i > 0; --i) {
+            size_t blob = slab + class_bytes * (i - 1);
+            *reinterpret_cast<size_t*>(_get_bytes(blob)) = free_blobs[blob_class];
+            free_blobs[blob_class] = blob;
+        }
+    }
+    // A free blob starts with the position of the next free one.
+    size_t blob = free_blobs[blob_class];
+    char* pos = _get_bytes(blob);
+    if (pos == nullptr) {
         return -1;
     }
-    memcpy(temp_mem, _data, shared_size);
-    // Clean the existing shared_memory.
-    if (shmctl(_shmid, IPC_RMID, NULL) != 0) {
-        toscreen << "Free the existing shared_memory failed. Expansion failed.\n";
-        free(temp_mem);
+    free_blobs[blob_class] = *reinterpret_cast<size_t*>(pos);
+    memcpy(pos, obj.data, obj.bytes);
+    slot.pos = blob;
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_release(SmslBlob& slot) {
+    if (slot.pos == 0) {
+        return;
+    }
+    size_t class_bytes = 0;
+    size_t blob_class = _blob_class(slot.bytes, class_bytes);
+    *reinterpret_cast<size_t*>(_get_bytes(slot.pos)) = _data->free_blobs[blob_class];
+    _data->free_blobs[blob_class] = slot.pos;
+}
+
+template <typename KeyType, typename ValType>
+const SmslBlob* Smsl<KeyType, ValType>::_view(const SmslBlob& stored, SmslBlob& local) {
+    local = stored;
+    local.data = (stored.bytes == 0) ? "" : _peek_bytes(stored.pos, stored.bytes);
+    return (local.data == nullptr) ? nullptr : &local;
+}
+
+template <typename KeyType, typename ValType>
+bool Smsl<KeyType, ValType>::_load(const SmslBlob& stored, SmslBlob& out) {
+    // Copy the bytes out, another process may free the blob once get returns.
+    static thread_local std::string buffer;
+    SmslBlob local;
+    if (_view(stored, local) == nullptr) {
+        return false;
+    }
+    buffer.assign(local.data, local.bytes);
+    out = local;
+    out.data = buffer.data();
+    return true;
+}
+
+template <typename KeyType, typename ValType>
+int Smsl<KeyType, ValType>::_expansion(size_t need_bytes) {
+    if (_data->extents == MAX_EXTENTS) {
+        toscreen << "Too many extents. Expansion failed.\n";
         return -1;
     }
-    // Calculate the new shared_memory size.
-    size_t new_size = shared_size;
-    new_size += cur_capacity * node_size;
-    new_size += cur_capacity * 2 * sizeof(size_t);
-    // Get new shared_memory.
-    key_t shm_key = ftok(_shmpath.c_str(), 666);
-    if (shm_key == (key_t)-1) {
-        toscreen << "Get key failed. Expansion failed.\n";
-        free(temp_mem);
+    // The new extent is as large as all former ones, so the capacity doubles.
+    size_t bytes = (_data->capacity > need_bytes) ? _data->capacity : need_bytes;
+    bytes = _round_page(bytes);
+    pthread_mutex_lock(&_attach_lock);
+    if (_attach_extents_locked() != 0) {
+        pthread_mutex_unlock(&_attach_lock);
         return -1;
-    } else {
-        toscreen << "Got key: " << (int)shm_key << ".\n";
     }
-    _shmid = shmget(shm_key, new_size, IPC_CREAT | 0666);
-    if (_shmid == -1) {
-        // If you want to handle this emergency to save the data, write the logic here.
-        toscreen << "Sign up for new shared_memory failed. Expansion failed and all data was lost.\n";
-        free(temp_mem);
+    char* base = _add_extent(bytes);
+    if (base == nullptr) {
+        pthread_mutex_unlock(&_attach_lock);
+        toscreen << "Add an extent failed. Expansion failed, the existing data is kept.\n";
         return -1;
     }
-    _data = (SmslData*)shmat(_shmid, (void*)0, 0);
-    if (_data == nullptr) {
-        toscreen << "Got the pointer of new shared_memory failed. Expansion failed and all data was lost.\n";
-        free(temp_mem);
+    // Publish the extent, the existing extents are untouched.
+    // The readers of other processes check the extent number before attaching it.
+    _extents[_data->extents] = base;
+    _extent_bytes[_data->extents] = bytes;
+    _data->extent_bytes[_data->extents] = bytes;
+    __atomic_store_n(&_data->extents, _data->extents + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&_attached, _data->extents, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_attach_lock);
+    _data->capacity += bytes;
+    _data->heap_used = 0;
+    toscreen << "Successfully expand the shared_memory, new capacity: " << _data->capacity << " bytes.\n";
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int Smsl<KeyType, ValType>::_attach_extents() {
+    pthread_mutex_lock(&_attach_lock);
+    int ret = _attach_extents_locked();
+    pthread_mutex_unlock(&_attach_lock);
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int Smsl<KeyType, ValType>::_attach_extents_locked() {
+    size_t extents = __atomic_load_n(&_data->extents, __ATOMIC_ACQUIRE);
+    if (extents > MAX_EXTENTS) {
         return -1;
     }
-    // Restore the temporary data to new shared_memory.
-    char* des_p = reinterpret_cast<char*>(_data);
-    char* src_p = temp_mem;
-    memcpy(des_p, src_p, sizeof(SmslData) + node_size * (cur_capacity + 1));
-    des_p += sizeof(SmslData) + node_size * (cur_capacity + 1) + node_size * cur_capacity;
-    src_p += sizeof(SmslData) + node_size * (cur_capacity + 1);
-    memcpy(des_p, src_p, sizeof(size_t) * (cur_capacity + 1));
-    for (size_t i = cur_capacity + 1; i <= cur_capacity * 2; ++i) {
-        (reinterpret_cast<size_t*>(des_p))[i] = i;
-    }
-    des_p += sizeof(size_t) * (cur_capacity * 2 + 1);
-    src_p += sizeof(size_t) * (cur_capacity + 1);
-    memcpy(des_p, src_p, sizeof(size_t) * (cur_capacity + 2));
-    des_p += sizeof(size_t);
-    for (size_t i = cur_capacity + 1; i <= cur_capacity * 2; ++i) {
-        (reinterpret_cast<size_t*>(des_p))[i] = i;
-    }
-    _data->capacity = cur_capacity * 2;
-    // Finish.
-    free(temp_mem);
-    toscreen << "Successfully expand the shared_memory, new capacity: " << cur_capacity * 2 << ".\n";
+    while (_attached < extents) {
+        char* base = _map_extent(_attached, _data->extent_bytes[_attached]);
+        if (base == nullptr) {
+            toscreen << "Attach extent: " << _attached << " failed.\n";
+            return -1;
+        }
+        // Readers of this process use the extent without the lock once it's counted.
+        _extents[_attached] = base;
+        _extent_bytes[_attached] = _data->extent_bytes[_attached];
+        __atomic_store_n(&_attached, _attached + 1, __ATOMIC_RELEASE);
+    }
     return 0;
 }
 
+template <typename KeyType, typename ValType>
+int Smsl<KeyType, ValType>::sync() {
+    if (_data == nullptr || _attach_extents() != 0) {
+        return -1;
+    }
+    if (_backend == SMSL_SYSV) {
+        return 0;
+    }
+    int ret = msync(_data, _mapped_bytes, MS_SYNC);
+    for (size_t i = 1; ret == 0 && i < _attached; ++i) {
+        ret = msync(_extents[i], _data->extent_bytes[i], MS_SYNC);
+    }
+    if (ret != 0) {
+        toscreen << "Sync the skiplist to: " << _shmpath << " failed.\n";
+        perror("msync");
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+SmslData* Smsl<KeyType, ValType>::_open_storage(size_t bytes, bool resume, size_t& mapped_bytes, bool& alone) {
+    bytes = _round_page(bytes);
+    alone = false;
+    if (_backend == SMSL_SYSV) {
+        key_t shm_key = ftok(_shmpath.c_str(), 666);
+        if (shm_key == (key_t)-1) {
+            toscreen << "Get shm_key failed.\n";
+            return nullptr;
+        } else {
+            toscreen << "Got shm_key: " << (int)shm_key << ".\n";
+        }
+        int flags = IPC_CREAT | 0666;
+        if (_hints & SMSL_HINT_HUGETLB) {
+            flags |= SHM_HUGETLB;
+        }
+        _shmid = shmget(shm_key, bytes, flags); // bytes is the minimum space needed.
+        if (_shmid == -1) {
+            toscreen << "Get shmid failed.\n";
+            perror("shmget");
+            return nullptr;
+        } else {
+            toscreen << "Got shmid: " << _shmid << ".\n";
+        }
+        void* base = shmat(_shmid, (void*)0, 0);
+        struct shmid_ds info;
+        if (base == (void*)-1 || shmctl(_shmid, IPC_STAT, &info) != 0) {
+            toscreen << "Get logic data address failed.\n";
+            perror("shmat");
+            return nullptr;
+        }
+        mapped_bytes = info.shm_segsz;
+        _advise(reinterpret_cast<char*>(base), mapped_bytes);
+        return reinterpret_cast<SmslData*>(base);
+    }
+    
+    if (_backend == SMSL_SHM) {
+        _fd = shm_open(_shm_name().c_str(), O_RDWR | O_CREAT, 0666);
+    } else if (_backend == SMSL_FILE) {
+        _fd = open(_shmpath.c_str(), O_RDWR | O_CREAT, 0666);
+    } else {
+        _fd = memfd_create(_shmpath.c_str(), (_hints & SMSL_HINT_HUGETLB) ? MFD_HUGETLB : 0);
+    }
+    if (_fd == -1) {
+        toscreen << "Open the storage: " << _shmpath << " failed.\n";
+        perror("open");
+        return nullptr;
+    }
+    // Each attached process holds a shared lock of the file. Only a process alone with
+    // the file may format it, truncating a file mapped by others kills them by SIGBUS.
+    // Others wait for the shared lock, so they attach once the skiplist is formatted.
+    alone = (flock(_fd, LOCK_EX | LOCK_NB) == 0);
+    if (!alone && flock(_fd, LOCK_SH) != 0) {
+        toscreen << "Lock the storage: " << _shmpath << " failed.\n";
+        perror("flock");
+        close(_fd);
+        _fd = -1;
+        return nullptr;
+    }
+    // An existing skiplist keeps its first extent, otherwise start from an empty file.
+    SmslData header;
+    struct stat info;
+    bool existing = (fstat(_fd, &info) == 0 && (size_t)info.st_size >= sizeof(SmslData) &&
+        pread(_fd, &header, sizeof(SmslData), 0) == (ssize_t)sizeof(SmslData) &&
+        strncmp(header.checksum, CHECKSUM_STRING, 9) == 0);
+    if (!alone && !(resume && existing)) {
+        toscreen << "The storage: " << _shmpath << " is attached by other processes, cannot format it.\n";
+        close(_fd);
+        _fd = -1;
+        return nullptr;
+    }
+    if (resume && existing) {
+        bytes = _round_page(_segment_bytes(header.level_capacity, header.extent_bytes[0]));
+    } else if (ftruncate(_fd, 0) != 0 || ftruncate(_fd, bytes) != 0) {
+        toscreen << "Resize the storage: " << _shmpath << " failed.\n";
+        perror("ftruncate");
+        close(_fd);
+        _fd = -1;
+        return nullptr;
+    }
+    void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (base == MAP_FAILED) {
+        toscreen << "Map the storage: " << _shmpath << " failed.\n";
+        perror("mmap");
+        close(_fd);
+        _fd = -1;
+        return nullptr;
+    }
+    mapped_bytes = bytes;
+    _advise(reinterpret_cast<char*>(base), mapped_bytes);
+    return reinterpret_cast<SmslData*>(base);
+}
+
+template <typename KeyType, typename ValType>
+char* Smsl<KeyType, ValType>::_map_extent(size_t extent, size_t bytes) {
+    void* base = nullptr;
+    if (_backend == SMSL_SYSV) {
+        base = shmat(_data->extent_ids[extent], (void*)0, 0);
+        if (base == (void*)-1) {
+            perror("shmat");
+            return nullptr;
+        }
+    } else {
+        base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, _data->extent_offsets[extent]);
+        if (base == MAP_FAILED) {
+            perror("mmap");
+            return nullptr;
+        }
+    }
+    _advise(reinterpret_cast<char*>(base), bytes);
+    return reinterpret_cast<char*>(base);
+}
+
+template <typename KeyType, typename ValType>
+char* Smsl<KeyType, ValType>::_add_extent(size_t bytes) {
+    size_t extent = _data->extents;
+    if (_backend == SMSL_SYSV) {
+        int flags = IPC_CREAT | 0666;
+        if (_hints & SMSL_HINT_HUGETLB) {
+            flags |= SHM_HUGETLB;
+        }
+        int id = shmget(IPC_PRIVATE, bytes, flags);
+        if (id == -1) {
+            perror("shmget");
+            return nullptr;
+        }
+        _data->extent_ids[extent] = id;
+        char* base = _map_extent(extent, bytes);
+        if (base == nullptr) {
+            shmctl(id, IPC_RMID, nullptr);
+        }
+        return base;
+    }
+    // Append the extent to the file, the mapped extents stay where they are.
+    _data->extent_offsets[extent] = _data->file_bytes;
+    if (ftruncate(_fd, _data->file_bytes + bytes) != 0) {
+        perror("ftruncate");
+        return nullptr;
+    }
+    char* base = _map_extent(extent, bytes);
+    if (base == nullptr) {
+        if (ftruncate(_fd, _data->file_bytes) != 0) {
+            perror("ftruncate");
+        }
+        return nullptr;
+    }
+    _data->file_bytes += bytes;
+    return base;
+}
+
+template <typename KeyType, typename ValType>
+void Smsl<KeyType, ValType>::_advise(char* base, size_t bytes) {
+    if ((_hints & SMSL_HINT_THP) && madvise(base, bytes, MADV_HUGEPAGE) != 0) {
+        toscreen << "Advise transparent huge pages failed.\n";
+    }
+    if ((_hints & SMSL_HINT_RANDOM) && madvise(base, bytes, MADV_RANDOM) != 0) {
+        toscreen << "Advise random access failed.\n";
+    }
+}
+
+template <typename KeyType, typename ValType>
+size_t Smsl<KeyType, ValType>::_round_page(size_t bytes) {
+    size_t page = (_hints & SMSL_HINT_HUGETLB) ? HUGE_PAGE_BYTES : sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+template <typename KeyType, typename ValType>
+std::string Smsl<KeyType, ValType>::_shm_name() {
+    // One leading slash and no others.
+    std::string name = "/";
+    for (size_t i = 0; i < _shmpath.size(); ++i) {
+        if (_shmpath[i] != '/' || i != 0) {
+            name += (_shmpath[i] == '/') ? '_' : _shmpath[i];
+        }
+    }
+    return name;
+}
+
 template <typename KeyType, typename ValType>
 void Smsl<KeyType, ValType>::_free_node(size_t node_pos) {
-    size_t* next_space = _get_next_free_space();
-    size_t* space_status = _get_space_status();
-    size_t* space_status_index = _get_space_status_index();
-    size_t node_pos_index = space_status_index[node_pos];
-    std::swap(space_status[node_pos_index], space_status[*next_space - 1]);
-    space_status_index[node_pos] = *next_space - 1;
-    space_status_index[space_status[node_pos]] = node_pos;
-    --(*next_space);
+    // Return the slot to the free list of its height.
+    size_t* free_slots = _free_slots;
+    SmslNode<KeyType, ValType>* node = _get_node(node_pos);
+    _release(node->key);
+    _release(node->val);
+    node->backward = free_slots[node->height];
+    free_slots[node->height] = node_pos;
 }
 
 template <typename KeyType, typename ValType>
 SmslNode<KeyType, ValType>*  Smsl<KeyType, ValType>::_get_node(size_t node_pos) {
-    char* pos = reinterpret_cast<char*>(&_data->level);
-    pos += sizeof(size_t);
-    size_t node_size = sizeof(SmslNode<KeyType, ValType>) + sizeof(SmslLevel) * _data->level_capacity;
-    pos += node_pos * node_size;
-    return reinterpret_cast<SmslNode<KeyType, ValType>*>(pos);
+    return reinterpret_cast<SmslNode<KeyType, ValType>*>(_get_bytes(node_pos));
+}
+
+template <typename KeyType, typename ValType>
+char* Smsl<KeyType, ValType>::_get_bytes(size_t pos) {
+    size_t extent = pos >> EXTENT_SHIFT;
+    if (extent >= __atomic_load_n(&_attached, __ATOMIC_ACQUIRE) &&
+        (extent >= MAX_EXTENTS || _attach_extents() != 0 || extent >= _attached)) {
+        // Added by another process, but it cannot be attached.
+        return nullptr;
+    }
+    return _extents[extent] + (pos & ((static_cast<size_t>(1) << EXTENT_SHIFT) - 1));
 }
 
 template <typename KeyType, typename ValType>
@@ -379,8 +996,8 @@ size_t Smsl<KeyType, ValType>::_random_level() {
         first_time = false;
         std::srand(std::time(nullptr));
     }
-    int res = 1;
-    while ((std::rand() % 2 == 0) && res < _data->level_capacity) {
+    size_t res = 1;
+    while ((std::rand() % 2 == 0) && res < _level_capacity) {
         ++res;
     }
     return res;
@@ -4,6 +4,8 @@
 #ifndef _SKCLIENT_H_
 #define _SKCLIENT_H_
 
+#include <vector>
+#include <utility>
 #include "smslserver.h"
 
 using namespace std;
@@ -31,6 +33,12 @@ public:
      * DEL.
      */
     int del(const string& key);
+    
+    /**
+     * SCAN, get all entries whose key starts with the prefix in key order.
+     * @return The number of entries, -1 means failed.
+     */
+    int prefix_scan(const string& prefix, vector<pair<string, string> >& res);
 
 private:
     int _call_server(const Msg& request, Msg& response);
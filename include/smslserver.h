@@ -13,6 +13,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <queue>
+#include <vector>
 #include "smsl.hpp"
 
 namespace {
@@ -20,17 +21,23 @@ namespace {
 const char MSG_GET = 1;
 const char MSG_SET = 2;
 const char MSG_DEL = 3;
+const char MSG_SCAN = 4;
+const char MSG_SCAN_ITEM = 5;
 const char MSG_INVALID_REQ = -10;
 const char MSG_OTHER_ERR = -11;
 const char MSG_EMPTY = -127;
+const uint32_t MAX_MSG_BYTES = 64 * 1024 * 1024; // Longer keys or vals are invalid messages.
+const size_t SCAN_BATCH = 256; // Entries copied under the writer lock of the Smsl at once by SCAN.
 
 } // End anonyomous namespace.
 
 namespace sk_cs {
 
-struct SKString {
-    uint16_t size;
-    char data[1024];
+// The binary format: the header, then key_size bytes of key and val_size bytes of val.
+struct MsgHeader {
+    char status;
+    uint32_t key_size;
+    uint32_t val_size;
 };
 
 struct Msg {
@@ -43,17 +50,79 @@ struct Msg {
      * 1 -> GET.
      * 2 -> SET.
      * 3 -> DEL.
+     * 4 -> SCAN, key is the prefix.
      * When it is a message from server to client:
      * Normal situation: Return operation function's return value.
+     * 5 -> One entry of SCAN, the last message of SCAN has status 0.
      * -10 -> Received invalid message, check the binary format.
      * -11 -> Other errors.
      * -127 -> Empty message, check the code.
      */
     char status;
-    SKString key;
-    SKString val;
+    std::string key;
+    std::string val;
 };
 
+// Write all bytes to the socket. Return 0 means success.
+inline int write_all(int socket, const char* data, size_t bytes) {
+    while (bytes > 0) {
+        ssize_t ret = write(socket, data, bytes);
+        if (ret <= 0) {
+            return -1;
+        }
+        data += ret;
+        bytes -= ret;
+    }
+    return 0;
+}
+
+// Read exactly bytes from the socket. Return 0 means success.
+inline int read_all(int socket, char* data, size_t bytes) {
+    while (bytes > 0) {
+        ssize_t ret = read(socket, data, bytes);
+        if (ret <= 0) {
+            return -1;
+        }
+        data += ret;
+        bytes -= ret;
+    }
+    return 0;
+}
+
+// Send a whole message. Return 0 means success.
+inline int send_msg(int socket, const Msg& msg) {
+    MsgHeader header;
+    memset(&header, 0, sizeof(header));
+    header.status = msg.status;
+    header.key_size = msg.key.size();
+    header.val_size = msg.val.size();
+    if (write_all(socket, reinterpret_cast<const char*>(&header), sizeof(header)) != 0 ||
+        write_all(socket, msg.key.data(), msg.key.size()) != 0 ||
+        write_all(socket, msg.val.data(), msg.val.size()) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Receive a whole message. Return 0 means success, -1 means broken or invalid message.
+inline int recv_msg(int socket, Msg& msg) {
+    MsgHeader header;
+    if (read_all(socket, reinterpret_cast<char*>(&header), sizeof(header)) != 0 ||
+        header.key_size > MAX_MSG_BYTES || header.val_size > MAX_MSG_BYTES) {
+        msg.status = MSG_OTHER_ERR;
+        return -1;
+    }
+    msg.status = header.status;
+    msg.key.resize(header.key_size);
+    msg.val.resize(header.val_size);
+    if (read_all(socket, &msg.key[0], header.key_size) != 0 ||
+        read_all(socket, &msg.val[0], header.val_size) != 0) {
+        msg.status = MSG_OTHER_ERR;
+        return -1;
+    }
+    return 0;
+}
+
 template <typename T>
 class AtomData {
 private:
@@ -179,12 +248,16 @@ private:
     pthread_t _handle_pid; // The pid of handle thread.
     AtomData<bool> _listen_stop; // If true, the listen thread will stop.
     AtomQueue<int> _handler_queue; // The queue storaging the client sockets.
-    smsl::Smsl<SKString, SKString> *_data; // The Smsl.
+    smsl::Smsl<smsl::SmslBlob, smsl::SmslBlob> *_data; // The Smsl, keys and vals are in its blob heap.
 private:
-    static int _cmp_skstring(const SKString& lhs, const SKString& rhs);
-    static std::string _print_skstring(const SKString& para);
+    static int _cmp_blob(const smsl::SmslBlob& lhs, const smsl::SmslBlob& rhs);
+    static std::string _print_blob(const smsl::SmslBlob& para);
     static void* _listen(void* skserver);
     static void* _handle(void* skserver);
+    
+    // Send each entry whose key starts with the prefix to the client.
+    // The entries are copied by batches, and sent after the writer lock of the Smsl is released.
+    static void _scan(SKServer& server, int client_socket, const std::string& prefix);
 };
     
 } // End namespace sk_cs.
@@ -0,0 +1,218 @@
+// Immutable sorted table of the LSM mode of SafeSL.
+// The frozen memtable is flushed to a table, and tables of the same tier are merged.
+// The blocks are the same as the blocks of the dump, the vals are tagged with the tombstone flag.
+//     [MAGIC][KEY_ENCODING]
+//     [BLOCK]...
+//     [INDEX] [OFFSET][BYTES][FIRST_KEY_BYTES][FIRST_KEY] of each block, varints except the key.
+//     [BLOOM] [HASH_NUM][BITS]
+//     [FOOTER] see TableFooter.
+
+#ifndef _SSTABLE_H_
+#define _SSTABLE_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "safesl.h"
+
+namespace {
+
+const char TABLE_MAGIC[] = "SAFETBL1";
+const size_t TABLE_MAGIC_BYTES = 8;
+const size_t TABLE_BLOOM_BITS_PER_KEY = 10; // About 1% false positives.
+const uint32_t TABLE_BLOOM_HASH_NUM = 7;
+
+} // End anoyomous namespace.
+
+namespace skiplist {
+
+// The end of the table file.
+// CRC is the CRC32C of the index and the bloom filter.
+struct TableFooter {
+    uint64_t index_offset;
+    uint64_t bloom_offset;
+    uint64_t entries;
+    uint32_t crc;
+    uint32_t block_num;
+    char magic[TABLE_MAGIC_BYTES];
+};
+
+template <typename KeyType, typename ValType>
+class SSTable {
+private:
+    SSTable(const SSTable&);
+    SSTable& operator=(const SSTable&);
+public:
+    /**
+     * The keys and vals are parsed by the converters of owner.
+     * @param id: The number in the file name, see SafeSL::use_lsm.
+     * @param tier: 0 means flushed from a memtable, N + 1 means merged from tables of tier N.
+     */
+    SSTable(SafeSL<KeyType, ValType>* owner, const std::string& path, unsigned long long id, int tier);
+    ~SSTable();
+
+    /**
+     * Open the file, read the index and the bloom filter.
+     * Return 0 means success.
+     */
+    int open();
+
+    /**
+     * Look up the key by the bloom filter, the index and one block.
+     * It's thread safe.
+     * Return 1 means found and deleted tells if it's a tombstone, 0 means not found, -1 means error.
+     */
+    int get(const KeyType& key, ValType& val, bool& deleted);
+
+    /**
+     * Read the entries of a block and their tombstone flags.
+     * Return 0 means success.
+     */
+    int read_block(size_t index, std::vector<std::pair<KeyType, ValType> >& entries,
+        std::vector<char>& deleted);
+
+    /**
+     * Unlink the file when the table is destroyed, e.g., after merged into another table.
+     */
+    void remove_on_close() {
+        _remove = true;
+    }
+
+    unsigned long long id() const {
+        return _id;
+    }
+    int tier() const {
+        return _tier;
+    }
+    const std::string& path() const {
+        return _path;
+    }
+    size_t entries() const {
+        return _entries;
+    }
+    size_t block_num() const {
+        return _index.size();
+    }
+    
+    /**
+     * Return the number of blocks whose first key isn't larger than the key,
+     * so the key can only be in the block before.
+     */
+    size_t upper_block(const KeyType& key) const;
+    
+    // Compare the keys like the owner.
+    int compare(const KeyType& left, const KeyType& right) const {
+        return _owner->_cmp(left, right);
+    }
+
+    // Set or test the bits of the bloom filter by the hash of the serialized key.
+    static void bloom_add(std::string& filter, uint32_t hash_num, size_t hash);
+    static bool bloom_test(const std::string& filter, uint32_t hash_num, size_t hash);
+
+private:
+    // The location and the first key of a block.
+    struct IndexEntry {
+        unsigned long long offset;
+        unsigned long long bytes; // With the block header.
+        KeyType first_key;
+    };
+
+    SafeSL<KeyType, ValType>* _owner;
+    std::string _path;
+    unsigned long long _id;
+    int _tier;
+    int _fd; // -1 means not opened.
+    uint32_t _key_encoding;
+    uint64_t _entries;
+    std::vector<IndexEntry> _index;
+    std::string _bloom; // Bits of the bloom filter.
+    uint32_t _hash_num;
+    bool _remove;
+};
+
+// Writes a table, the entries must be added in ascending key order.
+template <typename KeyType, typename ValType>
+class SSTableWriter {
+private:
+    SSTableWriter(const SSTableWriter&);
+    SSTableWriter& operator=(const SSTableWriter&);
+public:
+    // The file is written to a temporary path, and renamed by finish.
+    SSTableWriter(SafeSL<KeyType, ValType>* owner, const std::string& path);
+
+    // Remove the temporary file if not finished.
+    ~SSTableWriter();
+
+    // Return 0 means success.
+    int add(const KeyType& key, const ValType& val, bool deleted);
+
+    // Write the index, the bloom filter and the footer, sync and rename the file.
+    // Return 0 means success.
+    int finish();
+
+    size_t entries() const {
+        return _entries;
+    }
+
+private:
+    // Write the block and record it in the index. Return 0 means OK.
+    int _flush_block();
+
+    typedef typename SafeSL<KeyType, ValType>::BlockBuilder BlockBuilder;
+    SafeSL<KeyType, ValType>* _owner;
+    std::string _path;
+    std::string _temp_path;
+    FILE* _file; // nullptr means failed or finished.
+    BlockBuilder _block;
+    std::string _scratch;
+    std::string _first_key; // Serialized first key of the block being built.
+    std::string _index;
+    std::vector<size_t> _hashes; // Hash of each key for the bloom filter.
+    uint64_t _entries;
+    uint32_t _block_num;
+};
+
+// Reads the entries of a table in order, used for merging and scans.
+template <typename KeyType, typename ValType>
+class SSTableCursor {
+public:
+    explicit SSTableCursor(SSTable<KeyType, ValType>* table) :
+        _table(table), _block(0), _pos(0) {}
+
+    // Move to the first entry. Return 0 means OK, -1 means error.
+    int seek_first();
+    
+    // Move to the first entry whose key >= key. Return 0 means OK, -1 means error.
+    int seek(const KeyType& key);
+
+    // Move to the next entry. Return 0 means OK, -1 means error.
+    int next();
+
+    // False means no more entries.
+    bool valid() const {
+        return _pos < _entries.size();
+    }
+    const KeyType& key() const {
+        return _entries[_pos].first;
+    }
+    const ValType& val() const {
+        return _entries[_pos].second;
+    }
+    bool deleted() const {
+        return _deleted[_pos] != 0;
+    }
+
+private:
+    // Load the block, or the next nonempty one. Return 0 means OK.
+    int _load(size_t block);
+
+    SSTable<KeyType, ValType>* _table;
+    size_t _block;
+    size_t _pos;
+    std::vector<std::pair<KeyType, ValType> > _entries;
+    std::vector<char> _deleted;
+};
+
+} // End namespace skiplist.
+
+#endif // End ifndef _SSTABLE_H_.
@@ -0,0 +1,356 @@
+// Immutable sorted table of the LSM mode of SafeSL.
+
+#ifndef _SSTABLE_HPP_
+#define _SSTABLE_HPP_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sstable.h"
+
+namespace skiplist {
+
+template <typename KeyType, typename ValType>
+SSTable<KeyType, ValType>::SSTable(SafeSL<KeyType, ValType>* owner, const std::string& path,
+    unsigned long long id, int tier) :
+    _owner(owner), _path(path), _id(id), _tier(tier), _fd(-1),
+    _key_encoding(KEY_PREFIX), _entries(0), _hash_num(0), _remove(false) {}
+
+template <typename KeyType, typename ValType>
+SSTable<KeyType, ValType>::~SSTable() {
+    if (_fd != -1) {
+        ::close(_fd);
+    }
+    if (_remove) {
+        unlink(_path.c_str());
+    }
+}
+
+template <typename KeyType, typename ValType>
+int SSTable<KeyType, ValType>::open() {
+    _fd = ::open(_path.c_str(), O_RDONLY);
+    if (_fd == -1) {
+        toscreen << "Cannot open the table: " << _path << ".\n";
+        return -1;
+    }
+    struct stat info;
+    if (fstat(_fd, &info) != 0) {
+        return -1;
+    }
+    uint64_t file_bytes = info.st_size;
+    char magic[TABLE_MAGIC_BYTES];
+    TableFooter footer;
+    if (file_bytes < TABLE_MAGIC_BYTES + sizeof(uint32_t) + sizeof(TableFooter) ||
+        pread(_fd, magic, TABLE_MAGIC_BYTES, 0) != static_cast<ssize_t>(TABLE_MAGIC_BYTES) ||
+        pread(_fd, &_key_encoding, sizeof(uint32_t), TABLE_MAGIC_BYTES) != sizeof(uint32_t) ||
+        pread(_fd, &footer, sizeof(TableFooter), file_bytes - sizeof(TableFooter)) != sizeof(TableFooter) ||
+        memcmp(magic, TABLE_MAGIC, TABLE_MAGIC_BYTES) != 0 ||
+        memcmp(footer.magic, TABLE_MAGIC, TABLE_MAGIC_BYTES) != 0 ||
+        footer.index_offset > footer.bloom_offset ||
+        footer.bloom_offset > file_bytes - sizeof(TableFooter)) {
+        toscreen << "Table: " << _path << " has wrong format.\n";
+        return -1;
+    }
+
+    // The index and the bloom filter are read at once and checked by the CRC.
+    std::string meta(file_bytes - sizeof(TableFooter) - footer.index_offset, '\0');
+    if (pread(_fd, &meta[0], meta.size(), footer.index_offset) != static_cast<ssize_t>(meta.size()) ||
+        crc32c(0, meta.data(), meta.size()) != footer.crc) {
+        toscreen << "Table: " << _path << " has broken index.\n";
+        return -1;
+    }
+    size_t index_end = footer.bloom_offset - footer.index_offset;
+    size_t pos = 0;
+    Binary bin; // Tag of this Binary is TAG_POINTER.
+    _index.resize(footer.block_num);
+    for (uint32_t i = 0; i < footer.block_num; ++i) {
+        unsigned long long key_bytes;
+        if (read_varint(meta.data(), index_end, pos, _index[i].offset) != 0 ||
+            read_varint(meta.data(), index_end, pos, _index[i].bytes) != 0 ||
+            read_varint(meta.data(), index_end, pos, key_bytes) != 0 || key_bytes > index_end - pos) {
+            toscreen << "Table: " << _path << " has broken index.\n";
+            return -1;
+        }
+        bin.bytes = key_bytes;
+        bin.data = &meta[pos];
+        pos += key_bytes;
+        if (SafeSL<KeyType, ValType>::_parse_obj(_index[i].first_key, bin, _owner->bin2key) != 0) {
+            toscreen << "Table: " << _path << " has broken index.\n";
+            return -1;
+        }
+    }
+    if (meta.size() - index_end < sizeof(uint32_t)) {
+        toscreen << "Table: " << _path << " has broken bloom filter.\n";
+        return -1;
+    }
+    memcpy(&_hash_num, &meta[index_end], sizeof(uint32_t));
+    _bloom = meta.substr(index_end + sizeof(uint32_t));
+    _entries = footer.entries;
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+size_t SSTable<KeyType, ValType>::upper_block(const KeyType& key) const {
+    size_t low = 0;
+    size_t high = _index.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (_owner->_cmp(_index[mid].first_key, key) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+template <typename KeyType, typename ValType>
+int SSTable<KeyType, ValType>::get(const KeyType& key, ValType& val, bool& deleted) {
+    if (_index.empty()) {
+        return 0;
+    }
+    std::string key_data;
+    SafeSL<KeyType, ValType>::_append_obj(key_data, key, _owner->key2bin);
+    if (!bloom_test(_bloom, _hash_num, SafeSL<KeyType, ValType>::_hash_bytes(
+        key_data.data() + sizeof(size_t), key_data.size() - sizeof(size_t)))) {
+        return 0;
+    }
+
+    // The last block whose first key isn't larger than the key.
+    size_t blocks = upper_block(key);
+    if (blocks == 0) {
+        return 0;
+    }
+    std::vector<std::pair<KeyType, ValType> > entries;
+    std::vector<char> flags;
+    if (read_block(blocks - 1, entries, flags) != 0) {
+        return -1;
+    }
+    size_t low = 0;
+    size_t high = entries.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (_owner->_cmp(entries[mid].first, key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == entries.size() || _owner->_cmp(entries[low].first, key) != 0) {
+        return 0;
+    }
+    deleted = (flags[low] != 0);
+    if (!deleted) {
+        val = entries[low].second;
+    }
+    return 1;
+}
+
+template <typename KeyType, typename ValType>
+int SSTable<KeyType, ValType>::read_block(size_t index,
+    std::vector<std::pair<KeyType, ValType> >& entries, std::vector<char>& deleted) {
+    entries.clear();
+    deleted.clear();
+    const IndexEntry& location = _index[index];
+    DumpBlockHeader header;
+    if (location.bytes < sizeof(DumpBlockHeader) ||
+        pread(_fd, &header, sizeof(DumpBlockHeader), location.offset) != sizeof(DumpBlockHeader) ||
+        header.stored_bytes != location.bytes - sizeof(DumpBlockHeader)) {
+        toscreen << "Table: " << _path << " has broken block " << index << ".\n";
+        return -1;
+    }
+    std::string body(header.stored_bytes, '\0');
+    std::string raw;
+    if (pread(_fd, &body[0], body.size(), location.offset + sizeof(DumpBlockHeader)) !=
+        static_cast<ssize_t>(body.size()) ||
+        SafeSL<KeyType, ValType>::_unpack_block(header, body.data(), raw) != 0 ||
+        _owner->_decode_block(raw, header.entries, _key_encoding, entries, &deleted) != 0) {
+        toscreen << "Table: " << _path << " has broken block " << index << ".\n";
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+void SSTable<KeyType, ValType>::bloom_add(std::string& filter, uint32_t hash_num, size_t hash) {
+    // Double hashing, the positions are hash + i * delta.
+    size_t bits = filter.size() * 8;
+    size_t delta = (hash >> 33) | (hash << 31);
+    for (uint32_t i = 0; i < hash_num; ++i) {
+        size_t bit = hash % bits;
+        filter[bit / 8] |= static_cast<char>(1 << (bit % 8));
+        hash += delta;
+    }
+}
+
+template <typename KeyType, typename ValType>
+bool SSTable<KeyType, ValType>::bloom_test(const std::string& filter, uint32_t hash_num, size_t hash) {
+    size_t bits = filter.size() * 8;
+    if (bits == 0) {
+        return true;
+    }
+    size_t delta = (hash >> 33) | (hash << 31);
+    for (uint32_t i = 0; i < hash_num; ++i) {
+        size_t bit = hash % bits;
+        if ((filter[bit / 8] & (1 << (bit % 8))) == 0) {
+            return false;
+        }
+        hash += delta;
+    }
+    return true;
+}
+
+template <typename KeyType, typename ValType>
+SSTableWriter<KeyType, ValType>::SSTableWriter(SafeSL<KeyType, ValType>* owner,
+    const std::string& path) :
+    _owner(owner), _path(path), _temp_path(path + ".tmp"), _file(nullptr),
+    _entries(0), _block_num(0) {
+    _block.tagged = true;
+    _file = fopen(_temp_path.c_str(), "wb");
+    uint32_t key_encoding = _owner->_key_encoding();
+    if (_file == nullptr) {
+        toscreen << "Cannot open the table file: " << _temp_path << ".\n";
+    } else if (fwrite(TABLE_MAGIC, TABLE_MAGIC_BYTES, 1, _file) != 1 ||
+        fwrite(&key_encoding, sizeof(uint32_t), 1, _file) != 1) {
+        toscreen << "Write the table header failed.\n";
+        fclose(_file);
+        _file = nullptr;
+    }
+}
+
+template <typename KeyType, typename ValType>
+SSTableWriter<KeyType, ValType>::~SSTableWriter() {
+    if (_file != nullptr) {
+        fclose(_file);
+        unlink(_temp_path.c_str());
+    }
+}
+
+template <typename KeyType, typename ValType>
+int SSTableWriter<KeyType, ValType>::add(const KeyType& key, const ValType& val, bool deleted) {
+    if (_file == nullptr) {
+        return -1;
+    }
+    if (_block.entries == 0) {
+        _first_key.clear();
+        SafeSL<KeyType, ValType>::_append_obj(_first_key, key, _owner->key2bin);
+    }
+    _owner->_add_entry(_block, key, val, _scratch, deleted);
+    // The key is serialized again, since the integer keys are not serialized by _add_entry.
+    _scratch.clear();
+    SafeSL<KeyType, ValType>::_append_obj(_scratch, key, _owner->key2bin);
+    _hashes.push_back(SafeSL<KeyType, ValType>::_hash_bytes(
+        _scratch.data() + sizeof(size_t), _scratch.size() - sizeof(size_t)));
+    ++_entries;
+    if (_block.raw.size() >= DUMP_BLOCK_BYTES) {
+        return _flush_block();
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SSTableWriter<KeyType, ValType>::_flush_block() {
+    if (_block.entries == 0) {
+        return 0;
+    }
+    long offset = ftell(_file);
+    if (offset == -1 || _owner->_flush_block(_file, _block) != 0) {
+        toscreen << "Write the table block failed.\n";
+        fclose(_file);
+        _file = nullptr;
+        unlink(_temp_path.c_str());
+        return -1;
+    }
+    append_varint(_index, offset);
+    append_varint(_index, ftell(_file) - offset);
+    append_varint(_index, _first_key.size() - sizeof(size_t));
+    _index.append(_first_key, sizeof(size_t), std::string::npos);
+    ++_block_num;
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SSTableWriter<KeyType, ValType>::finish() {
+    if (_file == nullptr || _flush_block() != 0) {
+        return -1;
+    }
+    // [HASH_NUM][BITS].
+    size_t bits = _entries * TABLE_BLOOM_BITS_PER_KEY;
+    std::string filter((bits < 64 ? 64 : bits + 7) / 8, '\0');
+    for (size_t i = 0; i < _hashes.size(); ++i) {
+        SSTable<KeyType, ValType>::bloom_add(filter, TABLE_BLOOM_HASH_NUM, _hashes[i]);
+    }
+    std::string bloom(reinterpret_cast<const char*>(&TABLE_BLOOM_HASH_NUM), sizeof(uint32_t));
+    bloom.append(filter);
+
+    TableFooter footer;
+    footer.index_offset = ftell(_file);
+    footer.bloom_offset = footer.index_offset + _index.size();
+    footer.entries = _entries;
+    footer.crc = crc32c(crc32c(0, _index.data(), _index.size()), bloom.data(), bloom.size());
+    footer.block_num = _block_num;
+    memcpy(footer.magic, TABLE_MAGIC, TABLE_MAGIC_BYTES);
+    bool ok = (_index.empty() || fwrite(_index.data(), _index.size(), 1, _file) == 1) &&
+        fwrite(bloom.data(), bloom.size(), 1, _file) == 1 &&
+        fwrite(&footer, sizeof(TableFooter), 1, _file) == 1 &&
+        fflush(_file) == 0 && fsync(fileno(_file)) == 0;
+    fclose(_file);
+    _file = nullptr;
+    if (!ok || rename(_temp_path.c_str(), _path.c_str()) != 0) {
+        toscreen << "Write the table failed: " << _path << ".\n";
+        unlink(_temp_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SSTableCursor<KeyType, ValType>::seek_first() {
+    return _load(0);
+}
+
+template <typename KeyType, typename ValType>
+int SSTableCursor<KeyType, ValType>::seek(const KeyType& key) {
+    size_t blocks = _table->upper_block(key);
+    if (_load(blocks == 0 ? 0 : blocks - 1) != 0) {
+        return -1;
+    }
+    while (valid() && _table->compare(_entries[_pos].first, key) < 0) {
+        if (next() != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int SSTableCursor<KeyType, ValType>::next() {
+    if (++_pos < _entries.size()) {
+        return 0;
+    }
+    return _load(_block + 1);
+}
+
+template <typename KeyType, typename ValType>
+int SSTableCursor<KeyType, ValType>::_load(size_t block) {
+    _entries.clear();
+    _deleted.clear();
+    _pos = 0;
+    for (_block = block; _block < _table->block_num(); ++_block) {
+        if (_table->read_block(_block, _entries, _deleted) != 0) {
+            _entries.clear();
+            return -1;
+        }
+        if (!_entries.empty()) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+} // End namespace skiplist.
+
+#endif // End ifndef _SSTABLE_HPP_.
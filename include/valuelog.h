@@ -0,0 +1,143 @@
+// Value log of VlogSL.
+// Values are appended to numbered segments, the skiplist only keeps their handles.
+// A manifest lists the segments in use, the last one is being appended:
+//     [BASE].manifest, [BASE].00000001, [BASE].00000003, ...
+// Each segment begins with "SAFEVLG1", then records framed like the log records:
+//     [CRC][LENGTH] [PAYLOAD]
+
+#ifndef _VALUELOG_H_
+#define _VALUELOG_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace {
+
+const char VLOG_MAGIC[] = "SAFEVLG1";
+const size_t VLOG_MAGIC_BYTES = 8;
+const size_t DEFAULT_VLOG_SEGMENT_BYTES = 256 * 1024 * 1024; // Roll to a new segment after this size.
+
+} // End anoyomous namespace.
+
+namespace skiplist {
+
+// Where a value record is, the skiplist stores it instead of the value.
+struct ValueHandle {
+    uint64_t segment;
+    uint64_t offset; // Position of the record in the segment.
+    uint64_t bytes; // Bytes of the record with its header.
+
+    bool operator==(const ValueHandle& other) const {
+        return segment == other.segment && offset == other.offset && bytes == other.bytes;
+    }
+};
+
+// Each value record begins with this header.
+// CRC is the CRC32C of LENGTH and the payload after it.
+struct ValueRecordHeader {
+    uint32_t crc;
+    uint32_t length; // Bytes of the payload.
+};
+
+class ValueLog {
+private:
+    ValueLog(const ValueLog&);
+    ValueLog& operator=(const ValueLog&);
+public:
+    ValueLog();
+    ~ValueLog();
+
+    /**
+     * Open the segments listed by the manifest, the manifest and the first segment
+     * are created if unexisting. The torn tail of the last segment is truncated.
+     * Return 0 means success.
+     */
+    int open(const std::string& base_path);
+
+    /**
+     * Sync the last segment and close all segments.
+     */
+    void close();
+
+    /**
+     * Roll to a new segment when the last one reaches the size.
+     */
+    void set_segment_bytes(size_t bytes) {
+        _segment_bytes = bytes;
+    }
+
+    /**
+     * Append one record of the payload. It's thread safe.
+     * Return 0 means success and handle tells where it is.
+     */
+    int append(const char* data, size_t bytes, ValueHandle& handle);
+
+    /**
+     * Read the payload of the record and check its CRC. It's thread safe.
+     * Return 0 means success, -1 means the segment is removed or the record is broken.
+     */
+    int read(const ValueHandle& handle, std::string& payload);
+
+    /**
+     * Return true if the record is within the segments in use.
+     */
+    bool covers(const ValueHandle& handle);
+
+    /**
+     * Read a segment and visit its intact records in order.
+     * The visitor is called as visitor(handle, payload, bytes) and returns false to stop.
+     * Return 0 means success, -1 means the segment cannot be read.
+     */
+    template <typename Visitor>
+    int scan(unsigned long long segment, Visitor visitor);
+
+    /**
+     * Sync the last segment, the former ones are synced when rolling.
+     * Return 0 means success.
+     */
+    int sync();
+
+    /**
+     * Remove a segment which isn't being appended, the manifest is updated first.
+     * Return 0 means success.
+     */
+    int remove(unsigned long long segment);
+
+    /**
+     * Return the segments in use and their bytes.
+     */
+    std::vector<std::pair<unsigned long long, size_t> > segments();
+
+    /**
+     * Return the segment being appended.
+     */
+    unsigned long long active_segment();
+
+private:
+    std::string _base_path;
+    std::map<unsigned long long, int> _fds; // Descriptor of each segment in use.
+    std::map<unsigned long long, size_t> _sizes; // Bytes of each segment in use.
+    unsigned long long _segment; // The segment being appended, 0 means not opened.
+    size_t _segment_bytes;
+    pthread_rwlock_t _lock; // Appending and removing take it exclusively.
+
+    // Open the segment, write the magic if it's empty. The lock must be held.
+    int _open_segment(unsigned long long segment, bool active);
+
+    // Return the bytes of the intact records from the beginning of the data.
+    static size_t _intact_bytes(const std::string& data);
+
+    // Read the whole segment. The lock must be held. Return 0 means success.
+    int _read_segment(unsigned long long segment, std::string& data);
+
+    // Replace the manifest atomically by rename. The lock must be held.
+    int _write_manifest();
+};
+
+} // End namespace skiplist.
+
+#endif // End ifndef _VALUELOG_H_.
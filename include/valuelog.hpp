@@ -0,0 +1,305 @@
+// Value log of VlogSL.
+// Values are appended to numbered segments, the skiplist only keeps their handles.
+
+#ifndef _VALUELOG_HPP_
+#define _VALUELOG_HPP_
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include "valuelog.h"
+#include "safelog.hpp"
+#include "crc32c.h"
+
+#define toscreen std::cout<<__FILE__<<", "<<__LINE__<<": "
+
+namespace skiplist {
+
+inline ValueLog::ValueLog() : _segment(0), _segment_bytes(DEFAULT_VLOG_SEGMENT_BYTES) {
+    pthread_rwlock_init(&_lock, nullptr);
+}
+
+inline ValueLog::~ValueLog() {
+    close();
+    pthread_rwlock_destroy(&_lock);
+}
+
+inline int ValueLog::open(const std::string& base_path) {
+    close();
+    pthread_rwlock_wrlock(&_lock);
+    _base_path = base_path;
+    int ret = 0;
+    FILE* manifest = fopen((base_path + ".manifest").c_str(), "r");
+    if (manifest == nullptr) {
+        ret = _open_segment(1, true);
+        if (ret == 0) {
+            ret = _write_manifest();
+        }
+    } else {
+        // SAFESL_VLOG, then [segment ID] from old to new.
+        char title[32] = {0};
+        unsigned long long segment;
+        std::vector<unsigned long long> segments;
+        if (fscanf(manifest, "%31s", title) != 1 || strcmp(title, "SAFESL_VLOG") != 0) {
+            ret = -1;
+        }
+        while (ret == 0 && fscanf(manifest, " segment %llu", &segment) == 1) {
+            segments.push_back(segment);
+        }
+        fclose(manifest);
+        if (segments.empty()) {
+            ret = -1;
+        }
+        for (size_t i = 0; ret == 0 && i < segments.size(); ++i) {
+            ret = _open_segment(segments[i], i + 1 == segments.size());
+        }
+    }
+    if (ret == 0) {
+        // Records after a torn one are unreachable by scan, drop them.
+        std::string data;
+        ret = _read_segment(_segment, data);
+        size_t intact = _intact_bytes(data);
+        if (ret == 0 && intact != data.size()) {
+            toscreen << "Drop the torn tail of value log segment: "
+                << LogWriter::segment_path(_base_path, _segment) << ", "
+                << data.size() - intact << " bytes.\n";
+            if (ftruncate(_fds[_segment], intact) != 0) {
+                ret = -1;
+            }
+            _sizes[_segment] = intact;
+        }
+    }
+    pthread_rwlock_unlock(&_lock);
+    if (ret != 0) {
+        toscreen << "Cannot open the value log: " << base_path << ".\n";
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+inline void ValueLog::close() {
+    pthread_rwlock_wrlock(&_lock);
+    if (_segment != 0 && fdatasync(_fds[_segment]) != 0) {
+        toscreen << "Sync the value log failed.\n";
+    }
+    for (std::map<unsigned long long, int>::iterator it = _fds.begin(); it != _fds.end(); ++it) {
+        ::close(it->second);
+    }
+    _fds.clear();
+    _sizes.clear();
+    _segment = 0;
+    pthread_rwlock_unlock(&_lock);
+}
+
+inline int ValueLog::append(const char* data, size_t bytes, ValueHandle& handle) {
+    std::string record(sizeof(ValueRecordHeader), '\0');
+    record.append(data, bytes);
+    ValueRecordHeader header;
+    header.length = bytes;
+    memcpy(&record[0] + sizeof(uint32_t), &header.length, sizeof(uint32_t));
+    header.crc = crc32c(0, record.data() + sizeof(uint32_t), sizeof(uint32_t) + header.length);
+    memcpy(&record[0], &header.crc, sizeof(uint32_t));
+
+    pthread_rwlock_wrlock(&_lock);
+    if (_segment == 0) {
+        pthread_rwlock_unlock(&_lock);
+        return -1;
+    }
+    if (_segment_bytes != 0 && _sizes[_segment] >= _segment_bytes) {
+        // The former segment is synced once it's sealed.
+        if (fdatasync(_fds[_segment]) != 0 || _open_segment(_segment + 1, true) != 0 ||
+            _write_manifest() != 0) {
+            toscreen << "Roll the value log failed.\n";
+            pthread_rwlock_unlock(&_lock);
+            return -1;
+        }
+    }
+    handle.segment = _segment;
+    handle.offset = _sizes[_segment];
+    handle.bytes = record.size();
+    int ret = 0;
+    if (pwrite(_fds[_segment], record.data(), record.size(), handle.offset) !=
+        static_cast<ssize_t>(record.size())) {
+        toscreen << "Write the value log failed.\n";
+        ret = -1;
+    } else {
+        _sizes[_segment] += record.size();
+    }
+    pthread_rwlock_unlock(&_lock);
+    return ret;
+}
+
+inline int ValueLog::read(const ValueHandle& handle, std::string& payload) {
+    if (handle.bytes < sizeof(ValueRecordHeader)) {
+        return -1;
+    }
+    std::string record(handle.bytes, '\0');
+    pthread_rwlock_rdlock(&_lock);
+    std::map<unsigned long long, int>::iterator it = _fds.find(handle.segment);
+    bool ok = (it != _fds.end() &&
+        pread(it->second, &record[0], record.size(), handle.offset) == static_cast<ssize_t>(record.size()));
+    pthread_rwlock_unlock(&_lock);
+    ValueRecordHeader header;
+    if (ok) {
+        memcpy(&header, record.data(), sizeof(ValueRecordHeader));
+    }
+    if (!ok || header.length != record.size() - sizeof(ValueRecordHeader) ||
+        crc32c(0, record.data() + sizeof(uint32_t), sizeof(uint32_t) + header.length) != header.crc) {
+        return -1;
+    }
+    payload.assign(record, sizeof(ValueRecordHeader), std::string::npos);
+    return 0;
+}
+
+inline bool ValueLog::covers(const ValueHandle& handle) {
+    pthread_rwlock_rdlock(&_lock);
+    std::map<unsigned long long, size_t>::iterator it = _sizes.find(handle.segment);
+    bool res = (it != _sizes.end() && handle.offset >= VLOG_MAGIC_BYTES &&
+        handle.offset + handle.bytes <= it->second);
+    pthread_rwlock_unlock(&_lock);
+    return res;
+}
+
+template <typename Visitor>
+int ValueLog::scan(unsigned long long segment, Visitor visitor) {
+    std::string data;
+    // Hold the lock, so the descriptor isn't closed while reading.
+    pthread_rwlock_rdlock(&_lock);
+    int ret = _read_segment(segment, data);
+    pthread_rwlock_unlock(&_lock);
+    if (ret != 0) {
+        return -1;
+    }
+    size_t end = _intact_bytes(data);
+    size_t pos = VLOG_MAGIC_BYTES;
+    while (pos < end) {
+        ValueRecordHeader header;
+        memcpy(&header, data.data() + pos, sizeof(ValueRecordHeader));
+        ValueHandle handle;
+        handle.segment = segment;
+        handle.offset = pos;
+        handle.bytes = sizeof(ValueRecordHeader) + header.length;
+        if (!visitor(handle, data.data() + pos + sizeof(ValueRecordHeader),
+            static_cast<size_t>(header.length))) {
+            break;
+        }
+        pos += handle.bytes;
+    }
+    return 0;
+}
+
+inline int ValueLog::sync() {
+    pthread_rwlock_rdlock(&_lock);
+    int ret = (_segment != 0 && fdatasync(_fds[_segment]) == 0) ? 0 : -1;
+    pthread_rwlock_unlock(&_lock);
+    return ret;
+}
+
+inline int ValueLog::remove(unsigned long long segment) {
+    pthread_rwlock_wrlock(&_lock);
+    std::map<unsigned long long, int>::iterator it = _fds.find(segment);
+    if (segment == _segment || it == _fds.end()) {
+        pthread_rwlock_unlock(&_lock);
+        return -1;
+    }
+    // Update the manifest first, a crash then only leaves an unused file.
+    ::close(it->second);
+    _fds.erase(it);
+    _sizes.erase(segment);
+    int ret = _write_manifest();
+    if (ret == 0) {
+        unlink(LogWriter::segment_path(_base_path, segment).c_str());
+    }
+    pthread_rwlock_unlock(&_lock);
+    return ret;
+}
+
+inline std::vector<std::pair<unsigned long long, size_t> > ValueLog::segments() {
+    pthread_rwlock_rdlock(&_lock);
+    std::vector<std::pair<unsigned long long, size_t> > res(_sizes.begin(), _sizes.end());
+    pthread_rwlock_unlock(&_lock);
+    return res;
+}
+
+inline unsigned long long ValueLog::active_segment() {
+    pthread_rwlock_rdlock(&_lock);
+    unsigned long long segment = _segment;
+    pthread_rwlock_unlock(&_lock);
+    return segment;
+}
+
+inline int ValueLog::_open_segment(unsigned long long segment, bool active) {
+    std::string path = LogWriter::segment_path(_base_path, segment);
+    int fd = ::open(path.c_str(), active ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd == -1) {
+        toscreen << "Cannot open the value log segment: " << path << ".\n";
+        return -1;
+    }
+    size_t size = lseek(fd, 0, SEEK_END);
+    if (size == 0 && active) {
+        if (pwrite(fd, VLOG_MAGIC, VLOG_MAGIC_BYTES, 0) != (ssize_t)VLOG_MAGIC_BYTES) {
+            toscreen << "Write the value log magic failed.\n";
+            ::close(fd);
+            return -1;
+        }
+        size = VLOG_MAGIC_BYTES;
+    }
+    char magic[VLOG_MAGIC_BYTES];
+    if (pread(fd, magic, VLOG_MAGIC_BYTES, 0) != (ssize_t)VLOG_MAGIC_BYTES ||
+        memcmp(magic, VLOG_MAGIC, VLOG_MAGIC_BYTES) != 0) {
+        toscreen << "Value log segment: " << path << " has unknown format.\n";
+        ::close(fd);
+        return -1;
+    }
+    _fds[segment] = fd;
+    _sizes[segment] = size;
+    if (active) {
+        _segment = segment;
+    }
+    return 0;
+}
+
+inline size_t ValueLog::_intact_bytes(const std::string& data) {
+    size_t pos = VLOG_MAGIC_BYTES;
+    while (data.size() - pos >= sizeof(ValueRecordHeader)) {
+        ValueRecordHeader header;
+        memcpy(&header, data.data() + pos, sizeof(ValueRecordHeader));
+        if (header.length > data.size() - pos - sizeof(ValueRecordHeader) ||
+            crc32c(0, data.data() + pos + sizeof(uint32_t),
+                sizeof(uint32_t) + header.length) != header.crc) {
+            break;
+        }
+        pos += sizeof(ValueRecordHeader) + header.length;
+    }
+    return pos;
+}
+
+inline int ValueLog::_read_segment(unsigned long long segment, std::string& data) {
+    std::map<unsigned long long, int>::iterator it = _fds.find(segment);
+    if (it == _fds.end()) {
+        return -1;
+    }
+    data.resize(_sizes.find(segment)->second);
+    return (pread(it->second, &data[0], data.size(), 0) == static_cast<ssize_t>(data.size())) ? 0 : -1;
+}
+
+inline int ValueLog::_write_manifest() {
+    std::string content = "SAFESL_VLOG\n";
+    char line[64];
+    for (std::map<unsigned long long, int>::iterator it = _fds.begin(); it != _fds.end(); ++it) {
+        snprintf(line, sizeof(line), "segment %llu\n", it->first);
+        content += line;
+    }
+    if (LogWriter::replace_file(_base_path + ".manifest", content) != 0) {
+        toscreen << "Replace the value log manifest failed.\n";
+        return -1;
+    }
+    return 0;
+}
+
+} // End namespace skiplist.
+
+#endif // End ifndef _VALUELOG_HPP_.
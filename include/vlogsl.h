@@ -0,0 +1,113 @@
+// SafeSL with key-value separation.
+// The values live only in an append-only value log, see valuelog.h.
+// The skiplist, its log and its dumps only keep the key and a ValueHandle of 24 bytes,
+// so large values are written once, and the memory and checkpoint I/O follow the key count.
+
+#ifndef _VLOGSL_H_
+#define _VLOGSL_H_
+
+#include <map>
+#include <string>
+#include <pthread.h>
+#include "safesl.hpp"
+#include "valuelog.hpp"
+
+namespace skiplist {
+
+template <typename KeyType, typename ValType>
+class VlogSL {
+private:
+    VlogSL(const VlogSL&);
+    VlogSL& operator=(const VlogSL&);
+public:
+    /**
+     * The same as SafeSL, the values are appended to [LOG_PATH].vlog.00000001, ...
+     * A nullptr converter means using the Serializer of the type.
+     */
+    VlogSL(int (*cmp_fun)(const KeyType&, const KeyType&),
+        std::string (*key_to_str)(const KeyType&),
+        void (*convert_key_to_bin)(const KeyType&, Binary& bin_data),
+        void (*convert_val_to_bin)(const ValType&, Binary& bin_data),
+        void (*parse_key_from_bin)(KeyType&, const Binary& bin_data),
+        void (*parse_val_from_bin)(ValType&, const Binary& bin_data),
+        const std::string &log_path_in = "log",
+        int level_in = DEFAULT_LEVEL);
+
+    // Use the Serializer of the key and val instead of the converters.
+    VlogSL(int (*cmp_fun)(const KeyType&, const KeyType&),
+        std::string (*key_to_str)(const KeyType&),
+        const std::string &log_path_in = "log",
+        int level_in = DEFAULT_LEVEL);
+    ~VlogSL();
+
+    // Like SafeSL, the value is read from the value log by its handle.
+    // safe_get returns -1 if the value cannot be read.
+    int safe_get(const KeyType& key, ValType& val);
+    int safe_set(const KeyType& key, const ValType& val);
+    int safe_del(const KeyType& key);
+
+    // Whatever the policy, the value log is synced before each sync of the skiplist log.
+    // A value not synced yet may be lost with the torn tail of the value log, restore deletes its key.
+    void set_sync_policy(SyncPolicy policy, long param = 0) {
+        _index.set_sync_policy(policy, param);
+    }
+
+    // The value log rolls to a new segment when the current one reaches the size.
+    void set_value_segment_bytes(size_t bytes) {
+        _values.set_segment_bytes(bytes);
+    }
+
+    size_t size() {
+        return _index.size();
+    }
+
+    // Like SafeSL, the dump only has the keys and the handles.
+    // The value log is synced first, so the handles in the dump are all readable.
+    int dump_to_file(const std::string& dump_path);
+    int checkpoint(const std::string& dump_path);
+    int checkpoint_status(bool wait = false) {
+        return _index.checkpoint_status(wait);
+    }
+
+    // Restore the skiplist like SafeSL, then count the live bytes of each value log segment.
+    // Keys whose values were lost with the torn tail of the value log are deleted.
+    int restore(const std::string& log_file, const std::string& dump_file = "NOFILE");
+
+    // Rewrite the live values of the sealed segments whose live bytes are at most
+    // max_live_ratio of their size, then remove those segments.
+    // Writers are blocked only while one value is moved.
+    // Return the number of removed segments, -1 means failed.
+    int gc_value_log(double max_live_ratio = 0.5);
+
+    // Bytes of the values still referenced by the skiplist, and of all value log segments.
+    void value_log_usage(size_t& live_bytes, size_t& total_bytes);
+
+private:
+    typedef SafeSL<KeyType, ValueHandle> Index;
+
+    // Serialize the value record of the key and val.
+    void _encode_value(const KeyType& key, const ValType& val, std::string& out);
+
+    // Parse the key of a value record, and the val if it's not nullptr. Return 0 means OK.
+    int _parse_value(const char* payload, size_t bytes, KeyType& key, ValType* val);
+
+    // Wait until the skiplist log record meets the sync policy.
+    int _commit(long long token);
+    
+    // The sync hook of the skiplist log, values is the ValueLog.
+    static int _sync_values(void* values);
+
+    void (*key2bin)(const KeyType&, Binary& bin_data);
+    void (*val2bin)(const ValType&, Binary& bin_data);
+    void (*bin2key)(KeyType&, const Binary& bin_data);
+    void (*bin2val)(ValType&, const Binary& bin_data);
+
+    Index _index; // Keys and handles, logged and dumped as SafeSL.
+    ValueLog _values;
+    pthread_mutex_t _write_lock; // Serialize the writers and the moves of the garbage collection.
+    std::map<unsigned long long, size_t> _live; // Live bytes of each value log segment.
+};
+
+} // End namespace skiplist.
+
+#endif // End ifndef _VLOGSL_H_.
@@ -0,0 +1,304 @@
+// SafeSL with key-value separation.
+// The values live only in an append-only value log, see valuelog.h.
+
+#ifndef _VLOGSL_HPP_
+#define _VLOGSL_HPP_
+
+#include <iostream>
+#include <vector>
+#include "vlogsl.h"
+
+namespace skiplist {
+
+template <typename KeyType, typename ValType>
+VlogSL<KeyType, ValType>::VlogSL(int (*cmp_fun)(const KeyType&, const KeyType&),
+    std::string (*key_to_str)(const KeyType&),
+    void (*convert_key_to_bin)(const KeyType&, Binary& bin_data),
+    void (*convert_val_to_bin)(const ValType&, Binary& bin_data),
+    void (*parse_key_from_bin)(KeyType&, const Binary& bin_data),
+    void (*parse_val_from_bin)(ValType&, const Binary& bin_data),
+    const std::string &log_path_in, int level_in) :
+    key2bin(convert_key_to_bin), val2bin(convert_val_to_bin),
+    bin2key(parse_key_from_bin), bin2val(parse_val_from_bin),
+    _index(cmp_fun, key_to_str, convert_key_to_bin, nullptr, parse_key_from_bin, nullptr,
+        log_path_in, level_in) {
+    pthread_mutex_init(&_write_lock, nullptr);
+    if (_values.open(log_path_in + ".vlog") != 0) {
+        toscreen << "Initializing VlogSL failed. Cannot open the value log.\n";
+    }
+    _index._log.set_sync_hook(_sync_values, &_values);
+}
+
+template <typename KeyType, typename ValType>
+VlogSL<KeyType, ValType>::VlogSL(int (*cmp_fun)(const KeyType&, const KeyType&),
+    std::string (*key_to_str)(const KeyType&),
+    const std::string &log_path_in, int level_in) :
+    key2bin(nullptr), val2bin(nullptr), bin2key(nullptr), bin2val(nullptr),
+    _index(cmp_fun, key_to_str, log_path_in, level_in) {
+    if (!Serializer<ValType>::enabled) {
+        toscreen << "Initializing VlogSL failed. No Serializer for the val, specialize it.\n";
+    }
+    pthread_mutex_init(&_write_lock, nullptr);
+    if (_values.open(log_path_in + ".vlog") != 0) {
+        toscreen << "Initializing VlogSL failed. Cannot open the value log.\n";
+    }
+    _index._log.set_sync_hook(_sync_values, &_values);
+}
+
+template <typename KeyType, typename ValType>
+VlogSL<KeyType, ValType>::~VlogSL() {
+    _index.checkpoint_status(true);
+    // Sync the skiplist log while the value log is open, nothing is appended after it.
+    _index._log.sync();
+    _index._log.set_sync_hook(nullptr, nullptr);
+    _values.close();
+    pthread_mutex_destroy(&_write_lock);
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::safe_get(const KeyType& key, ValType& val) {
+    ValueHandle handle;
+    int ret = _index.safe_get(key, handle);
+    if (ret < 0) {
+        return -1;
+    }
+    std::string payload;
+    KeyType stored_key;
+    // The garbage collection may have moved the value meanwhile, then read it from the new place.
+    while (_values.read(handle, payload) != 0) {
+        ValueHandle moved;
+        if (_index.safe_get(key, moved) < 0 || moved == handle) {
+            toscreen << "Read the value of key: " << _index._tostr(key) << " failed.\n";
+            return -1;
+        }
+        handle = moved;
+    }
+    if (_parse_value(payload.data(), payload.size(), stored_key, &val) != 0) {
+        toscreen << "Parse the value of key: " << _index._tostr(key) << " failed.\n";
+        return -1;
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::safe_set(const KeyType& key, const ValType& val) {
+    // Serialize out of the lock, each thread has its own buffer.
+    static thread_local std::string record;
+    _encode_value(key, val, record);
+    
+    pthread_mutex_lock(&_write_lock);
+    ValueHandle handle;
+    if (_index.safe_get(key, handle) >= 0) {
+        pthread_mutex_unlock(&_write_lock);
+        toscreen << "Key: " << _index._tostr(key) << " already exists, set key failed.\n";
+        return 1;
+    }
+    long long token = 0;
+    int ret = 0;
+    if (_values.append(record.data(), record.size(), handle) != 0) {
+        toscreen << "Append the value of key: " << _index._tostr(key) << " failed.\n";
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = _index.async_set(key, handle, token);
+    }
+    if (ret == 0) {
+        _live[handle.segment] += handle.bytes;
+    }
+    pthread_mutex_unlock(&_write_lock);
+    if (ret == 0) {
+        return _commit(token);
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::safe_del(const KeyType& key) {
+    pthread_mutex_lock(&_write_lock);
+    ValueHandle handle;
+    long long token = 0;
+    int ret = (_index.safe_get(key, handle) >= 0) ? _index.async_del(key, token) : -1;
+    if (ret == 0) {
+        // The value becomes garbage of its segment.
+        _live[handle.segment] -= handle.bytes;
+    }
+    pthread_mutex_unlock(&_write_lock);
+    if (ret == 0) {
+        return _index._commit_log(token);
+    }
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::dump_to_file(const std::string& dump_path) {
+    pthread_mutex_lock(&_write_lock);
+    int ret = _values.sync();
+    if (ret != 0) {
+        toscreen << "Sync the value log failed.\n";
+    } else {
+        ret = _index.dump_to_file(dump_path);
+    }
+    pthread_mutex_unlock(&_write_lock);
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::checkpoint(const std::string& dump_path) {
+    pthread_mutex_lock(&_write_lock);
+    int ret = _values.sync();
+    if (ret != 0) {
+        toscreen << "Sync the value log failed.\n";
+    } else {
+        ret = _index.checkpoint(dump_path);
+    }
+    pthread_mutex_unlock(&_write_lock);
+    return ret;
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::restore(const std::string& log_file, const std::string& dump_file) {
+    if (_index.restore(log_file, dump_file) != 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&_write_lock);
+    _live.clear();
+    std::vector<KeyType> lost;
+    _index.walk([&](const KeyType& key, const ValueHandle& handle, bool deleted) {
+        if (!deleted && _values.covers(handle)) {
+            _live[handle.segment] += handle.bytes;
+        } else if (!deleted) {
+            lost.push_back(key);
+        }
+        return true;
+    });
+    // The value log wasn't synced before the skiplist log, their values are lost.
+    long long token = 0;
+    for (size_t i = 0; i < lost.size(); ++i) {
+        toscreen << "The value of key: " << _index._tostr(lost[i]) << " is lost, delete it.\n";
+        _index.async_del(lost[i], token);
+    }
+    pthread_mutex_unlock(&_write_lock);
+    if (token != 0) {
+        return _index._commit_log(token);
+    }
+    return 0;
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::gc_value_log(double max_live_ratio) {
+    std::vector<std::pair<unsigned long long, size_t> > segments = _values.segments();
+    unsigned long long active = _values.active_segment();
+    int removed = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        unsigned long long segment = segments[i].first;
+        pthread_mutex_lock(&_write_lock);
+        size_t live = _live[segment];
+        pthread_mutex_unlock(&_write_lock);
+        if (segment == active || live > segments[i].second * max_live_ratio) {
+            continue;
+        }
+
+        // Move the values still referenced to the active segment, one at a time.
+        // The handle is replaced by a batch, which overwrites the key.
+        long long token = 0;
+        int ret = 0;
+        KeyType key;
+        int scanned = _values.scan(segment,
+            [&](const ValueHandle& handle, const char* payload, size_t bytes) {
+            if (_parse_value(payload, bytes, key, nullptr) != 0) {
+                ret = -1;
+                return false;
+            }
+            pthread_mutex_lock(&_write_lock);
+            ValueHandle current;
+            if (_index.safe_get(key, current) >= 0 && current == handle) {
+                ValueHandle moved;
+                WriteBatch<KeyType, ValueHandle> batch;
+                if (_values.append(payload, bytes, moved) != 0) {
+                    ret = -1;
+                } else {
+                    batch.set(key, moved);
+                    ret = _index.async_write(batch, token);
+                }
+                if (ret == 0) {
+                    _live[segment] -= handle.bytes;
+                    _live[moved.segment] += moved.bytes;
+                }
+            }
+            pthread_mutex_unlock(&_write_lock);
+            return ret == 0;
+        });
+
+        // The moved values and their new handles are durable before the segment is removed.
+        if (scanned != 0 || ret != 0 || _values.sync() != 0 ||
+            (token != 0 && _index.wait_log(token) != 0) || _values.remove(segment) != 0) {
+            toscreen << "Collect value log segment: " << segment << " failed.\n";
+            return -1;
+        }
+        pthread_mutex_lock(&_write_lock);
+        _live.erase(segment);
+        pthread_mutex_unlock(&_write_lock);
+        ++removed;
+    }
+    return removed;
+}
+
+template <typename KeyType, typename ValType>
+void VlogSL<KeyType, ValType>::value_log_usage(size_t& live_bytes, size_t& total_bytes) {
+    std::vector<std::pair<unsigned long long, size_t> > segments = _values.segments();
+    total_bytes = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        total_bytes += segments[i].second;
+    }
+    live_bytes = 0;
+    pthread_mutex_lock(&_write_lock);
+    for (std::map<unsigned long long, size_t>::iterator it = _live.begin(); it != _live.end(); ++it) {
+        live_bytes += it->second;
+    }
+    pthread_mutex_unlock(&_write_lock);
+}
+
+template <typename KeyType, typename ValType>
+void VlogSL<KeyType, ValType>::_encode_value(const KeyType& key, const ValType& val,
+    std::string& out) {
+    // [KEY_BYTES][KEY][VAL_BYTES][VAL], the key tells the garbage collection whose value it is.
+    out.clear();
+    Index::_append_obj(out, key, key2bin);
+    Index::_append_obj(out, val, val2bin);
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::_parse_value(const char* payload, size_t bytes,
+    KeyType& key, ValType* val) {
+    size_t pos = 0;
+    Binary bin; // Tag of this Binary is TAG_POINTER.
+    if (Index::_read_bin(payload, bytes, pos, bin) != 0 || Index::_parse_obj(key, bin, bin2key) != 0) {
+        return -1;
+    }
+    if (val == nullptr) {
+        return 0;
+    }
+    if (Index::_read_bin(payload, bytes, pos, bin) != 0 || Index::_parse_obj(*val, bin, bin2val) != 0) {
+        return -1;
+    }
+    return pos == bytes ? 0 : -1;
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::_commit(long long token) {
+    // The sync hook syncs the value log first, so a synced handle always has its value.
+    return _index._commit_log(token);
+}
+
+template <typename KeyType, typename ValType>
+int VlogSL<KeyType, ValType>::_sync_values(void* values) {
+    if (static_cast<ValueLog*>(values)->sync() != 0) {
+        toscreen << "Sync the value log failed.\n";
+        return -1;
+    }
+    return 0;
+}
+
+} // End namespace skiplist.
+
+#endif // End ifndef _VLOGSL_HPP_.
@@ -15,14 +15,8 @@ SKClient::SKClient(const string& ip, short port) {
 int SKClient::set(const string& key, const string& val) {
     Msg request, response;
     request.status = MSG_SET;
-    size_t key_size = key.size() >= 1024 ? 1023 : key.size();
-    size_t val_size = val.size() >= 1024 ? 1023 : val.size();
-    memcpy(request.key.data, key.c_str(), key_size);
-    memcpy(request.val.data, val.c_str(), val_size);
-    request.key.data[key_size] = '\0';
-    request.val.data[val_size] = '\0';
-    request.key.size = key_size + 1;
-    request.val.size = val_size + 1;
+    request.key = key;
+    request.val = val;
     int ret = _call_server(request, response);
     if (ret < 0) {
         return -1;
@@ -33,31 +27,19 @@ int SKClient::set(const string& key, const string& val) {
 int SKClient::get(const string& key, string& val) {
     Msg request, response;
     request.status = MSG_GET;
-    if (key.size() >= 1024) {
-        // Unsupported key.
-        return -1;
-    }
-    memcpy(request.key.data, key.c_str(), key.size());
-    request.key.data[key.size()] = '\0';
-    request.key.size = key.size() + 1;
+    request.key = key;
     int ret = _call_server(request, response);
     if (ret < 0) {
         return -1;
     }
-    val = response.val.data;
+    val = response.val;
     return response.status;
 }
 
 int SKClient::del(const string& key) {
     Msg request, response;
-    request.status = MSG_GET;
-    if (key.size() >= 1024) {
-        // Unsupported key.
-        return -1;
-    }
-    memcpy(request.key.data, key.c_str(), key.size());
-    request.key.data[key.size()] = '\0';
-    request.key.size = key.size() + 1;
+    request.status = MSG_DEL;
+    request.key = key;
     int ret = _call_server(request, response);
     if (ret < 0) {
         return -1;
@@ -65,6 +47,33 @@ int SKClient::del(const string& key) {
     return response.status;
 }
 
+int SKClient::prefix_scan(const string& prefix, vector<pair<string, string> >& res) {
+    Msg request, response;
+    request.status = MSG_SCAN;
+    request.key = prefix;
+    _socket = socket(PF_INET, SOCK_STREAM, 0);
+    if (_socket < 0) {
+        toscreen << "Initialize the client socket failed.\n";
+        return -1;
+    }
+    if (connect(_socket, (sockaddr*)&_srv_addr, sizeof(sockaddr)) < 0) {
+        toscreen << "Connect to server failed.\n";
+        close(_socket);
+        return -1;
+    }
+    send_msg(_socket, request);
+    res.clear();
+    // Read entries until the finishing message.
+    while (recv_msg(_socket, response) == 0 && response.status == MSG_SCAN_ITEM) {
+        res.push_back(make_pair(response.key, response.val));
+    }
+    close(_socket);
+    if (response.status != 0) {
+        return -1;
+    }
+    return res.size();
+}
+
 int SKClient::_call_server(const Msg& request, Msg& response) {
     _socket = socket(PF_INET, SOCK_STREAM, 0);
     if (_socket < 0) {
@@ -74,10 +83,13 @@ int SKClient::_call_server(const Msg& request, Msg& response) {
     int ret = connect(_socket, (sockaddr*)&_srv_addr, sizeof(sockaddr));
     if (ret < 0) {
         toscreen << "Connect to server failed.\n";
+        close(_socket);
+        return -1;
+    }
+    if (send_msg(_socket, request) != 0 || recv_msg(_socket, response) != 0) {
+        close(_socket);
         return -1;
     }
-    write(_socket, &request, sizeof(Msg));
-    read(_socket, &response, sizeof(Msg));
     close(_socket);
     return 0;
 }
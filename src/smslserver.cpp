@@ -13,8 +13,8 @@ SKServer::SKServer(const std::string& shared_path,
     
 int SKServer::start() {
     // Initialize the shared_memory data.
-    _data = new(std::nothrow) smsl::Smsl<SKString, SKString>(
-        _shared_path, _cmp_skstring, _print_skstring, true);
+    _data = new(std::nothrow) smsl::Smsl<smsl::SmslBlob, smsl::SmslBlob>(
+        _shared_path, _cmp_blob, _print_blob, true);
     if (_data == nullptr) {
         toscreen << "Create smsl failed. Start the server failed.\n";
         return -1;
@@ -116,27 +116,21 @@ void SKServer::stop(bool clean_mem) {
     return;
 }
 
-int SKServer::_cmp_skstring(const SKString& lhs, const SKString& rhs) {
-    if (lhs.size != rhs.size) {
-        return lhs.size - rhs.size;
+int SKServer::_cmp_blob(const smsl::SmslBlob& lhs, const smsl::SmslBlob& rhs) {
+    // Lexicographic order, so keys with the same prefix are contiguous.
+    size_t size = lhs.bytes < rhs.bytes ? lhs.bytes : rhs.bytes;
+    int res = memcmp(lhs.data, rhs.data, size);
+    if (res != 0) {
+        return res;
     }
-    uint16_t size = lhs.size;
-    for (uint16_t i = 0; i < size; ++i) {
-        if (lhs.data[i] != rhs.data[i]) {
-            return lhs.data[i] - rhs.data[i];
-        }
-    }
-    return 0;
+    return (lhs.bytes < rhs.bytes) ? -1 : (lhs.bytes > rhs.bytes);
 }
 
-std::string SKServer::_print_skstring(const SKString& para) {
-    static char buffer[1025];
-    if (para.size == 0) {
+std::string SKServer::_print_blob(const smsl::SmslBlob& para) {
+    if (para.bytes == 0) {
         return "{empty_content}";
     }
-    memcpy(buffer, para.data, para.size - 1);
-    buffer[para.size] = '\0';
-    return buffer;
+    return std::string(para.data, para.bytes);
 }
 
 void* SKServer::_listen(void* skserver) {
@@ -179,31 +173,81 @@ void* SKServer::_handle(void* skserver) {
         }
         
         // Read the request.
-        ret = read(client_socket, &read_msg, sizeof(Msg));
-        if (ret != sizeof(Msg)) {
+        if (recv_msg(client_socket, read_msg) != 0) {
             toscreen << "Received invalid message, ignore.\n";
             static Msg message_wrong_binary(MSG_INVALID_REQ);
-            write(client_socket, &message_wrong_binary, sizeof(Msg));
+            send_msg(client_socket, message_wrong_binary);
             close(client_socket);
             continue;
         }
-        
-        // Handle the request.
+    
+        // Handle the request, the key and the val are copied into the blob heap by set.
+        smsl::SmslBlob key(read_msg.key.data(), read_msg.key.size());
         write_msg.key = read_msg.key;
         write_msg.val = read_msg.val;
         if (read_msg.status == MSG_GET) {
-            write_msg.status = server._data->get(read_msg.key, write_msg.val);
+            smsl::SmslBlob val;
+            ret = server._data->get(key, val);
+            write_msg.status = ret;
+            if (ret >= 0) {
+                write_msg.val.assign(val.data, val.bytes);
+            }
         } else if (read_msg.status == MSG_SET) {
-            write_msg.status = server._data->set(read_msg.key, read_msg.val);
+            write_msg.status = server._data->set(key,
+                smsl::SmslBlob(read_msg.val.data(), read_msg.val.size()));
         } else if (read_msg.status == MSG_DEL) {
-            write_msg.status = server._data->del(read_msg.key);
+            write_msg.status = server._data->del(key);
+        } else if (read_msg.status == MSG_SCAN) {
+            _scan(server, client_socket, read_msg.key);
+            write_msg.status = 0;
         }
-        
+    
         // Send response and close the socket.
-        write(client_socket, &write_msg, sizeof(Msg));
+        send_msg(client_socket, write_msg);
         close(client_socket);
     }
     return nullptr;
 }
 
+void SKServer::_scan(SKServer& server, int client_socket, const std::string& prefix) {
+    // The prefix itself is the smallest key starting with the prefix.
+    // A slow client must not block the writers, so send nothing while the Smsl is locked.
+    Msg item_msg(MSG_SCAN_ITEM);
+    std::vector<std::pair<std::string, std::string> > batch;
+    std::string last = prefix;
+    bool more = true;
+    for (bool first = true; more; first = false) {
+        batch.clear();
+        more = false;
+        smsl::SmslBlob begin(last.data(), last.size());
+        server._data->scan(begin, [&](const smsl::SmslBlob& key, const smsl::SmslBlob& val) {
+            if (!first && key.bytes == last.size() && memcmp(key.data, last.data(), last.size()) == 0) {
+                // Sent by the former batch.
+                return true;
+            }
+            if (key.bytes < prefix.size() || memcmp(key.data, prefix.data(), prefix.size()) != 0) {
+                // Out of the prefix range.
+                return false;
+            }
+            if (batch.size() == SCAN_BATCH) {
+                more = true;
+                return false;
+            }
+            batch.push_back(std::make_pair(std::string(key.data, key.bytes), std::string(val.data, val.bytes)));
+            return true;
+        });
+        for (size_t i = 0; i < batch.size(); ++i) {
+            item_msg.key.swap(batch[i].first);
+            item_msg.val.swap(batch[i].second);
+            if (send_msg(client_socket, item_msg) != 0) {
+                return;
+            }
+        }
+        if (!batch.empty()) {
+            // Resume after the last key sent, it was swapped into the message.
+            last = item_msg.key;
+        }
+    }
+}
+
 } // End namespace sk_cs.
\ No newline at end of file
@@ -55,6 +55,21 @@ int main() {
             }
             continue;
         }
+        if (strcmp(para1, "scan") == 0) {
+            cin >> para2;
+            string prefix = (para2);
+            vector<pair<string, string> > res;
+            int ret = sklist.prefix_scan(prefix, res);
+            if (ret == -1) {
+                cout << "Failed.\n";
+            } else {
+                for (size_t i = 0; i < res.size(); ++i) {
+                    cout << "Key: " << res[i].first << ", Value: " << res[i].second << ".\n";
+                }
+                cout << "Found " << ret << " keys with prefix: " << prefix << ".\n";
+            }
+            continue;
+        }
         cout << "Unknown command: " << para1 << ", try again.\n";
     }
     